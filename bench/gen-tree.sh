@@ -0,0 +1,87 @@
+#!/bin/sh
+# Generate a synthetic tree of git repositories for benchmarking.
+#
+# usage: gen-tree.sh [options] DIR
+#   -n REPOS      number of repositories (default 50)
+#   -d DEPTH      directory levels above each repository (default 2)
+#   -p PERCENT    share of repositories left dirty (default 20)
+#   -f FILES      tracked files per repository (default 20)
+#   -u FILES      untracked files in each dirty repository (default 10)
+#   -i FILES      ignored files per repository, plus a node_modules
+#                 directory of that size at the top (default 100)
+set -eu
+
+repos=50
+depth=2
+dirty=20
+tracked=20
+untracked=10
+ignored=100
+
+while getopts n:d:p:f:u:i: opt; do
+    case $opt in
+        n) repos=$OPTARG ;;
+        d) depth=$OPTARG ;;
+        p) dirty=$OPTARG ;;
+        f) tracked=$OPTARG ;;
+        u) untracked=$OPTARG ;;
+        i) ignored=$OPTARG ;;
+        *) sed -n '2,12s/^# \{0,1\}//p' "$0" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 1 ] || { sed -n '2,12s/^# \{0,1\}//p' "$0" >&2; exit 1; }
+root=$1
+
+# Write count files named prefix1..prefixN into dir
+make_files() {
+    mkdir -p "$1"
+    i=1
+    while [ "$i" -le "$3" ]; do
+        echo "$2 $i" > "$1/$2$i"
+        i=$((i + 1))
+    done
+}
+
+rm -rf "$root"
+mkdir -p "$root"
+
+# One template repository, copied everywhere
+template=$root/.template
+git init -q "$template"
+make_files "$template/src" file "$tracked"
+echo "ignored/" > "$template/.gitignore"
+git -C "$template" add -A
+git -C "$template" -c user.name=bench -c user.email=bench@example.com commit -qm initial
+make_files "$template/ignored" junk "$ignored"
+
+make_files "$root/node_modules/pkg" dep "$ignored"
+
+n=0
+while [ "$n" -lt "$repos" ]; do
+    # Spread repositories over a 4-way fan-out, depth levels deep
+    dir=$root
+    level=1
+    k=$n
+    while [ "$level" -lt "$depth" ]; do
+        dir=$dir/d${level}_$((k % 4))
+        k=$((k / 4))
+        level=$((level + 1))
+    done
+    repo=$dir/repo$n
+    mkdir -p "$dir"
+    cp -a "$template" "$repo"
+
+    # Copies get new inodes; settle the index so clean repos look clean
+    git -C "$repo" update-index -q --refresh || true
+
+    # Spread the dirty ones evenly
+    if [ $((n * dirty % 100)) -lt "$dirty" ]; then
+        echo change >> "$repo/src/file1"
+        make_files "$repo/new" untracked "$untracked"
+    fi
+    n=$((n + 1))
+done
+
+rm -rf "$template"
+echo "$root: $repos repositories" >&2
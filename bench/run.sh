@@ -0,0 +1,125 @@
+#!/bin/sh
+# Benchmark uncommitted over synthetic trees and print CSV.
+#
+# usage: bench/run.sh [-i ITERATIONS] [-o FILE] [-k] [-l] [-t SPAWNS:MS] [SHAPE...]
+#   -i ITERATIONS  timed runs per shape and mode (default 5)
+#   -o FILE        write CSV to FILE instead of stdout
+#   -k             keep previously generated trees
+#   -l             also build with libgit2 and compare the backends
+#   -t SPAWNS:MS   exit 1 if a run takes more git processes or milliseconds
+#                  per repository than this (either may be left empty)
+#
+# A shape is name:repos:depth:dirty_percent:untracked:ignored, e.g.
+# wide:500:1:20:10:100 (see gen-tree.sh). Without shapes a default set
+# runs. Each shape is scanned cold (--no-cache) and warm (cache primed),
+# and syscalls are counted with strace when it is installed.
+set -eu
+
+here=$(cd "$(dirname "$0")" && pwd)
+iterations=5
+out=
+keep=0
+backends=cli
+max_spawns=
+max_ms=
+failed=0
+
+while getopts i:o:klt: opt; do
+    case $opt in
+        i) iterations=$OPTARG ;;
+        o) out=$OPTARG ;;
+        k) keep=1 ;;
+        l) backends="cli libgit2" ;;
+        t) case $OPTARG in
+               *:*) max_spawns=${OPTARG%%:*}; max_ms=${OPTARG#*:} ;;
+               *) echo "bench: -t takes SPAWNS:MS, e.g. 1:20 or 1:" >&2; exit 1 ;;
+           esac ;;
+        *) sed -n '2,16s/^# \{0,1\}//p' "$0" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -eq 0 ]; then
+    set -- small:50:2:20:10:100 \
+           wide:500:1:20:10:100 \
+           deep:100:6:20:10:100 \
+           untracked:20:1:100:5000:0 \
+           ignored:20:1:0:0:5000
+fi
+
+work=${BENCH_DIR:-${TMPDIR:-/tmp}/uncommitted-bench}
+mkdir -p "$work"
+bin=$work/uncommitted
+${CC:-gcc} -O2 -Wall -pthread -o "$bin" "$here/../uncommitted.c" -lz
+if [ "$backends" != cli ]; then
+    ${CC:-gcc} -O2 -Wall -pthread -DWITH_LIBGIT2 ${LIBGIT2_CFLAGS:-} -o "$bin-libgit2" "$here/../uncommitted.c" \
+        -lz ${LIBGIT2_LIBS:--lgit2}
+fi
+
+# Cache lives with the trees, away from the user's own
+XDG_CACHE_HOME=$work/cache
+export XDG_CACHE_HOME
+
+[ -n "$out" ] && exec > "$out"
+echo "shape,repos,depth,dirty_percent,untracked,ignored,backend,mode,iteration,wall_ms,spawns,maxrss_kb,child_maxrss_kb,user_ms,sys_ms,syscalls"
+
+# Print the value of key from a --stats line
+stat_field() {
+    echo "$1" | tr ' ' '\n' | sed -n "s/^$2=//p"
+}
+
+# Whether value per repo goes past limit; an empty limit or value never does
+over_limit() {
+    [ -n "$2" ] && [ -n "$1" ] && awk -v v="$1" -v n="$repos" -v max="$2" 'BEGIN { exit !(v / n > max) }'
+}
+
+for shape in "$@"; do
+    IFS=: read -r name repos depth dirty untracked ignored <<END
+$shape
+END
+    tree=$work/$name
+    stamp="$repos:$depth:$dirty:$untracked:$ignored"
+    if [ "$keep" -eq 0 ] || [ "$(cat "$tree.shape" 2>/dev/null)" != "$stamp" ]; then
+        "$here/gen-tree.sh" -n "$repos" -d "$depth" -p "$dirty" -u "$untracked" -i "$ignored" "$tree"
+        echo "$stamp" > "$tree.shape"
+    fi
+
+    for backend in $backends; do
+        run="$bin --backend=$backend"
+        [ "$backend" = libgit2 ] && run="$bin-libgit2 --backend=$backend"
+
+        for mode in cold warm; do
+            if [ "$mode" = cold ]; then
+                flags=--no-cache
+            else
+                flags=
+                $run "$tree" > /dev/null  # prime the cache
+            fi
+
+            syscalls=
+            if command -v strace > /dev/null 2>&1; then
+                strace -f -c -o "$work/strace.txt" $run $flags "$tree" > /dev/null 2>&1 || true
+                syscalls=$(awk '$NF == "total" { print $4 }' "$work/strace.txt")
+            fi
+
+            i=1
+            while [ "$i" -le "$iterations" ]; do
+                stats=$($run --stats $flags "$tree" 2>&1 > /dev/null | grep '^stats ' || true)
+                printf '%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s\n' \
+                    "$name" "$repos" "$depth" "$dirty" "$untracked" "$ignored" "$backend" "$mode" "$i" \
+                    "$(stat_field "$stats" wall_ms)" "$(stat_field "$stats" spawns)" \
+                    "$(stat_field "$stats" maxrss_kb)" "$(stat_field "$stats" child_maxrss_kb)" \
+                    "$(stat_field "$stats" user_ms)" "$(stat_field "$stats" sys_ms)" "$syscalls"
+                spawns=$(stat_field "$stats" spawns)
+                wall_ms=$(stat_field "$stats" wall_ms)
+                if over_limit "$spawns" "$max_spawns" || over_limit "$wall_ms" "$max_ms"; then
+                    echo "bench: $name $backend $mode run $i: $spawns spawns, $wall_ms ms for $repos repos" >&2
+                    failed=1
+                fi
+                i=$((i + 1))
+            done
+        done
+    done
+done
+
+exit $failed
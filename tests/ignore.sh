@@ -0,0 +1,188 @@
+#!/bin/sh
+# Ignore-rule tests: compare the in-process gitignore matcher with
+# `git check-ignore --no-index --stdin` on the same repository.
+#
+# usage: tests/ignore.sh [-n SEEDS] [-b BACKENDS] BINARY
+#   -n SEEDS     generated repositories to check after the fixed one (default 40)
+#   -b BACKENDS  space-separated --backend values to check (default "cli")
+#
+# Every file is tracked and modified, so a change is listed exactly when
+# its path doesn't match the ignore rules. The fixed repository covers
+# negation, `**`, anchoring, directory-only patterns, escapes, character
+# classes and nested .gitignore files; the generated ones combine those
+# from a seed, which a failure reports.
+set -eu
+
+seeds=40
+backends=cli
+
+while getopts n:b: opt; do
+    case $opt in
+        n) seeds=$OPTARG ;;
+        b) backends=$OPTARG ;;
+        *) sed -n '2,12s/^# \{0,1\}//p' "$0" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 1 ] || { sed -n '2,12s/^# \{0,1\}//p' "$0" >&2; exit 1; }
+bin=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/uncommitted-ignore.XXXXXX")
+trap 'rm -rf "$work"' EXIT INT TERM
+
+# Keep the user's git and uncommitted settings out of it
+HOME=$work/home
+XDG_CONFIG_HOME=$work/config
+XDG_CACHE_HOME=$work/cache
+GIT_CONFIG_NOSYSTEM=1
+GIT_AUTHOR_NAME=test GIT_AUTHOR_EMAIL=test@example.com
+GIT_COMMITTER_NAME=test GIT_COMMITTER_EMAIL=test@example.com
+LC_ALL=C
+export HOME XDG_CONFIG_HOME XDG_CACHE_HOME GIT_CONFIG_NOSYSTEM LC_ALL \
+       GIT_AUTHOR_NAME GIT_AUTHOR_EMAIL GIT_COMMITTER_NAME GIT_COMMITTER_EMAIL
+unset GIT_DIR GIT_WORK_TREE GIT_INDEX_FILE
+mkdir -p "$HOME" "$XDG_CONFIG_HOME" "$XDG_CACHE_HOME"
+git config --global init.defaultBranch main
+
+failed=0
+matched=0
+
+# touch_files PATH...: create each file and its directories, skipping
+# paths that collide with an existing file or directory
+touch_files() {
+    for path in "$@"; do
+        mkdir -p "$(dirname "$path")" 2> /dev/null || continue
+        [ -e "$path" ] || : > "$path"
+    done
+}
+
+# check_repo DIR LABEL [CONFIG VALUE]: commit everything, set the config,
+# modify it, and compare what the scanner lists with what check-ignore
+# leaves over
+check_repo() {
+    dir=$1
+    label=$2
+    cd "$dir"
+    git add -A -f
+    git commit -q -m fixture
+    [ $# -eq 4 ] && git config "$3" "$4"
+    # The .gitignore files stay as they are, and out of the comparison
+    git ls-files -z -- . ':!:**/.gitignore' ':!:.gitignore' > "$work/files"
+    xargs -0 -n 64 sh -c 'for f; do echo changed >> "$f"; done' sh < "$work/files"
+    tr '\000' '\n' < "$work/files" | sort > "$work/tracked"
+    git check-ignore --no-index --stdin -z < "$work/files" | tr '\000' '\n' | sort > "$work/ignored"
+    comm -23 "$work/tracked" "$work/ignored" > "$work/want"
+    matched=$((matched + $(wc -l < "$work/ignored")))
+    cd "$work"
+
+    for backend in $backends; do
+        "$bin" --backend="$backend" --no-cache --stats --format=nul "$dir" 2> "$work/stats" |
+            tr '\000' '\n' | sed -n 's/^M\. //p' | sort > "$work/got"
+        if ! cmp -s "$work/want" "$work/got"; then
+            echo "FAIL: $label ($backend): < listed by git, > listed by uncommitted"
+            diff "$work/want" "$work/got" | head -20
+            failed=1
+        fi
+        # One git process (status) means the rules were matched in-process
+        if [ "$backend" = cli ] && ! grep -q ' spawns=1 ' "$work/stats"; then
+            echo "FAIL: $label ($backend): fell back to git check-ignore"
+            cat "$work/stats"
+            failed=1
+        fi
+    done
+}
+
+# The fixed repository, one rule of each kind
+repo=$work/fixed
+git init -q "$repo"
+cd "$repo"
+touch_files a.o b.c keep.o src/a.o src/deep/a.o build/out build/keep \
+    docs/build/x logs/today.log logs/keep.log logs/old/y.log \
+    '*' star.txt '#hash' '!bang' 'trail ' trail x/y/z/w.tmp x/w.tmp \
+    lib/a.c lib/b.c lib/c.h vendor/inner/f vendor/f AB.TXT ab.txt c1 c2 cx \
+    nested/a.o nested/b.o nested/sub/c.o nested/sub/d.o
+cat > .gitignore <<'EOF'
+# a comment, then a blank line
+
+*.o
+!keep.o
+/build/
+!/build/keep
+logs/**/*.log
+!logs/keep.log
+\*
+\#hash
+\!bang
+x/**/w.tmp
+lib/[ab].c
+vendor/*/
+c[[:digit:]]
+[A-Z]*.TXT
+EOF
+printf 'trail\\ \n' >> .gitignore
+cat > nested/.gitignore <<'EOF'
+!*.o
+sub/c.o
+/d.o
+EOF
+echo 'sub/d.o' > nested/sub/.gitignore
+check_repo "$repo" fixed
+
+# Generated repositories: random paths and rules from a seed
+seed=1
+while [ "$seed" -le "$seeds" ]; do
+    repo=$work/seed$seed
+    git init -q "$repo"
+    cd "$repo"
+    awk -v seed="$seed" '
+        function pick(list,   parts, n) { n = split(list, parts, " "); return parts[int(rand() * n) + 1] }
+        function pattern(   n, p, i) {
+            n = int(rand() * 3) + 1
+            p = pick(atoms)
+            for (i = 1; i < n; i++) p = p "/" pick(atoms)
+            if (rand() < 0.2) p = "/" p
+            if (rand() < 0.2) p = p "/"
+            if (rand() < 0.2) p = "!" p
+            return p
+        }
+        BEGIN {
+            srand(seed)
+            names = "a b ab foo bar x.o y.c z.tar.gz AB Foo.O .dot gen1 k~"
+            atoms = "a b foo * ** ? [ab] [!a] *.o *.c x* .dot [[:alpha:]]* f?o *.gz *o AB \\*"
+            for (i = 0; i < 60; i++) {
+                depth = int(rand() * 4) + 1
+                path = pick(names)
+                for (d = 1; d < depth; d++) path = path "/" pick(names)
+                print "path " path
+            }
+            for (i = 0; i < 4; i++) {
+                dir = ""
+                depth = int(rand() * 3)
+                for (d = 0; d < depth; d++) dir = dir pick(names) "/"
+                rules = int(rand() * 8) + 1
+                for (r = 0; r < rules; r++) print "rule " dir ".gitignore " pattern()
+            }
+            for (r = 0; r < 3; r++) print "rule .git/info/exclude " pattern()
+        }' > "$work/plan"
+    # With core.ignoreCase the paths (and the directories holding rules) are
+    # lowercase, as on a case-insensitive filesystem; the rules keep their case
+    fold=cat
+    [ $((seed % 5)) -eq 0 ] && fold="tr A-Z a-z"
+    sed -n 's/^path //p' "$work/plan" | $fold | while IFS= read -r path; do touch_files "$path"; done
+    sed -n 's/^rule //p' "$work/plan" | while IFS=' ' read -r file rule; do
+        file=$(printf '%s\n' "$file" | $fold)
+        # Rules naming a directory that is really a file have nowhere to go
+        mkdir -p "$(dirname "$file")" 2> /dev/null && printf '%s\n' "$rule" >> "$file" || true
+    done
+    if [ $((seed % 5)) -eq 0 ]; then
+        check_repo "$repo" "seed $seed" core.ignoreCase true
+    else
+        check_repo "$repo" "seed $seed"
+    fi
+    seed=$((seed + 1))
+done
+
+if [ "$failed" -eq 0 ]; then
+    echo "ignore rules match git check-ignore ($backends, fixed + $seeds seeds, $matched ignored paths)"
+fi
+exit $failed
@@ -0,0 +1,272 @@
+#!/bin/sh
+# Golden-output tests: build fixture repos covering each kind of change,
+# scan them in every output format, and diff against tests/golden.
+#
+# usage: tests/run.sh [-u] [-b BACKENDS] BINARY
+#   -u           rewrite the goldens from this binary instead of comparing
+#   -b BACKENDS  space-separated --backend values to check (default "cli");
+#                every backend must match the same goldens
+#
+# Each format is checked cold (--no-cache) and again with the scan cache
+# primed, which must not change the output. Repos changed after a primed
+# scan (a file deep in an untracked directory, an edited file, moved refs)
+# must show the change on the next warm scan. JSON and NUL output stream repos
+# in completion order, so they are sorted by repo before comparing.
+set -eu
+
+here=$(cd "$(dirname "$0")" && pwd)
+update=0
+backends=cli
+
+while getopts ub: opt; do
+    case $opt in
+        u) update=1 ;;
+        b) backends=$OPTARG ;;
+        *) sed -n '2,11s/^# \{0,1\}//p' "$0" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 1 ] || { sed -n '2,11s/^# \{0,1\}//p' "$0" >&2; exit 1; }
+bin=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+
+work=$(mktemp -d "${TMPDIR:-/tmp}/uncommitted-test.XXXXXX")
+trap 'rm -rf "$work"' EXIT INT TERM
+
+# Keep the user's git and uncommitted settings out of it
+HOME=$work/home
+XDG_CONFIG_HOME=$work/config
+XDG_CACHE_HOME=$work/cache
+GIT_CONFIG_NOSYSTEM=1
+GIT_AUTHOR_NAME=test GIT_AUTHOR_EMAIL=test@example.com
+GIT_COMMITTER_NAME=test GIT_COMMITTER_EMAIL=test@example.com
+GIT_AUTHOR_DATE='2024-01-01T00:00:00Z' GIT_COMMITTER_DATE='2024-01-01T00:00:00Z'
+LC_ALL=C
+export HOME XDG_CONFIG_HOME XDG_CACHE_HOME GIT_CONFIG_NOSYSTEM LC_ALL \
+       GIT_AUTHOR_NAME GIT_AUTHOR_EMAIL GIT_COMMITTER_NAME GIT_COMMITTER_EMAIL \
+       GIT_AUTHOR_DATE GIT_COMMITTER_DATE
+unset GIT_DIR GIT_WORK_TREE GIT_INDEX_FILE
+mkdir -p "$HOME" "$XDG_CONFIG_HOME" "$XDG_CACHE_HOME"
+git config --global init.defaultBranch main
+git config --global advice.detachedHead false
+
+tree=$work/tree
+mkdir -p "$tree"
+
+# new_repo NAME: a repo with two committed files, a and b
+new_repo() {
+    git init -q "$tree/$1"
+    cd "$tree/$1"
+    echo a > a
+    echo b > b
+    git add a b
+    git commit -q -m initial
+}
+
+new_repo clean
+
+new_repo modified
+echo more >> a
+
+new_repo staged
+echo more >> a
+git add a
+
+new_repo staged-and-modified
+echo more >> a
+git add a
+echo again >> a
+
+new_repo added
+echo c > c
+git add c
+
+new_repo deleted-in-index
+git rm -q a
+
+new_repo deleted-in-worktree
+rm a
+
+new_repo renamed
+git mv a renamed-a
+
+new_repo untracked
+echo u > u
+mkdir -p dir/sub
+echo x > dir/sub/x
+echo 'space' > 'with space.txt'
+echo 'utf8' > "$(printf 'caf\303\251.txt')"
+
+# Ignored untracked files stay hidden, and so does a change to a tracked
+# file that matches the ignore rules (check-ignore --no-index semantics)
+new_repo ignored
+printf '*.log\nbuild/\n' > .gitignore
+mkdir -p build
+echo keep > build/keep.txt
+git add .gitignore
+git add -f build/keep.txt
+git commit -q -m ignores
+echo changed >> build/keep.txt
+echo l > debug.log
+echo o > build/output.o
+echo n > new.txt
+
+new_repo conflict
+git checkout -q -b other
+echo theirs > a
+git commit -q -am theirs
+git checkout -q main
+echo ours > a
+git commit -q -am ours
+git merge -q other > /dev/null 2>&1 || true
+
+new_repo typechange
+rm b
+ln -s a b
+
+# Ahead and behind an upstream; the bare origin is outside the tree
+git init -q --bare "$work/origin.git"
+new_repo tracking
+git remote add origin ../../origin.git
+git push -q -u origin main 2> /dev/null
+git clone -q "$work/origin.git" "$work/other"
+(cd "$work/other" && echo theirs > theirs && git add theirs && git commit -q -m theirs && git push -q 2> /dev/null)
+git fetch -q
+echo ours > ours
+git add ours
+git commit -q -m ours
+echo more >> a
+
+new_repo detached
+git checkout -q --detach HEAD
+echo more >> b
+
+cd "$tree"
+failed=0
+
+# scan NAME ARGS...: run the binary, putting streamed formats in repo order
+scan() {
+    name=$1
+    shift
+    case $name in
+        *.json)
+            "$bin" "$@" . > "$work/raw" || true
+            grep -v '^{"type":"summary"' "$work/raw" | sort
+            grep '^{"type":"summary"' "$work/raw"
+            ;;
+        nul.txt)
+            # One line per repo record group, sorted, then split back up
+            "$bin" "$@" . | tr '\000' '\n' | awk '
+                /^summary / { summary = $0; next }
+                /^repo / && group != "" { print group; group = "" }
+                { group = group == "" ? $0 : group "\001" $0 }
+                END { if (group != "") print group; print summary }' |
+                sort | tr '\001' '\n'
+            ;;
+        *)
+            "$bin" "$@" . || true
+            ;;
+    esac
+}
+
+# check NAME ARGS...: scan the tree and compare with golden/NAME
+check() {
+    name=$1
+    shift
+    golden=$here/golden/$name
+    if [ "$update" -eq 1 ]; then
+        scan "$name" --no-cache "$@" > "$golden"
+        return
+    fi
+    for backend in $backends; do
+        for run in cold warm; do
+            flags=--no-cache
+            if [ "$run" = warm ]; then
+                flags=
+                "$bin" --backend="$backend" "$@" . > /dev/null || true
+            fi
+            scan "$name" --backend="$backend" $flags "$@" > "$work/out"
+            if ! cmp -s "$golden" "$work/out"; then
+                echo "FAIL: $name ($backend, $run)"
+                diff -u "$golden" "$work/out" | head -40
+                failed=1
+            fi
+        done
+    done
+}
+
+check box.txt
+check summary.txt --summary
+check json.txt --format=json
+check nul.txt --format=nul
+check untracked-all.json --format=json --untracked-files=all
+check max-entries.json --format=json --max-entries 1
+check max-files.txt --max-files 1
+
+# Changes made after the cache was primed must show up in the next scan:
+# each case is scanned warm once the change is made and compared with a
+# --no-cache scan of the same state
+mutate() {
+    case $1 in
+        deep-untracked) echo y > build/obj/new.c ;;
+        edited-tracked) echo more >> a ;;
+        moved-upstream) git update-ref refs/remotes/origin/main HEAD~1 ;;
+        moved-branch) git update-ref refs/heads/main HEAD~1 ;;
+    esac
+}
+
+if [ "$update" -eq 0 ]; then
+    for backend in $backends; do
+        tree=$work/after-$backend
+        mkdir -p "$tree"
+        new_repo deep-untracked
+        echo '*.o' > .gitignore
+        git add .gitignore
+        git commit -q -m ignores
+        mkdir -p build/obj
+        echo o > build/obj/a.o
+        new_repo edited-tracked
+        new_repo moved-upstream
+        echo more >> b
+        git commit -q -am second
+        git remote add origin ../../origin.git
+        git update-ref refs/remotes/origin/main HEAD
+        git branch -q -u origin/main
+        echo more >> a
+        new_repo moved-branch
+        echo more >> b
+        git commit -q -am second
+
+        # Let the index age past the racy window, or nothing gets cached
+        sleep 1
+        for name in deep-untracked edited-tracked moved-upstream moved-branch; do
+            cd "$tree/$name"
+            # The first git status may rewrite the index, so prime twice
+            "$bin" --backend="$backend" --format=nul . > /dev/null
+            "$bin" --backend="$backend" --format=nul . > "$work/before"
+            "$bin" --backend="$backend" --format=nul --stats . 2> "$work/stats" > /dev/null
+            if ! grep -q ' spawns=0 ' "$work/stats"; then
+                echo "FAIL: $name ($backend): primed scan wasn't served from the cache"
+                failed=1
+            fi
+            mutate "$name"
+            "$bin" --backend="$backend" --format=nul . > "$work/out"
+            "$bin" --backend="$backend" --no-cache --format=nul . > "$work/want"
+            if cmp -s "$work/before" "$work/want"; then
+                echo "FAIL: $name ($backend): the change made no difference"
+                failed=1
+            elif ! cmp -s "$work/want" "$work/out"; then
+                echo "FAIL: $name ($backend): warm scan missed the change"
+                tr '\000' '\n' < "$work/want" > "$work/want.txt"
+                tr '\000' '\n' < "$work/out" | diff "$work/want.txt" - | head -20
+                failed=1
+            fi
+        done
+    done
+fi
+
+if [ "$update" -eq 1 ]; then
+    echo "goldens updated in $here/golden"
+elif [ "$failed" -eq 0 ]; then
+    echo "all golden tests passed ($backends)"
+fi
+exit $failed
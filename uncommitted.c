@@ -1,10 +1,40 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#endif
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <zlib.h>
+#ifdef WITH_LIBGIT2
+#include <git2.h>
+#endif
+
+extern char **environ;
 
 // ANSI color codes
 #define RESET       "\033[0m"
@@ -27,32 +57,76 @@
 #define VERT        "║"
 #define T_RIGHT     "╠"
 #define T_LEFT      "╣"
+#define BOX_EDGE    CYAN VERT RESET
+
+// Exit status when --quiet finds a dirty repo
+#define EXIT_DIRTY 2
+
+// Box layout: the terminal's width, or DEFAULT_WIDTH when output isn't
+// one. Columns beyond DEFAULT_WIDTH go to the file column.
+#define DEFAULT_WIDTH 80
+#define MIN_WIDTH 60
+#define FILE_COLUMN 40     // at DEFAULT_WIDTH
+#define STATUS_COLUMN 20
 
 // Initial capacities (will grow as needed)
 #define INITIAL_FILES_CAPACITY 16
 #define INITIAL_REPOS_CAPACITY 8
+#define ARENA_CHUNK_SIZE 4096
 
+// Bump allocator: strings are carved out of a chain of chunks and all of
+// them are released together
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *head;
+} Arena;
+
+// A repo's file changes, stored column-wise. Each filename is split after
+// its last '/' into a directory, interned once per repo, and the rest; both
+// are NUL-terminated strings in one blob, addressed by offset.
 typedef struct {
-    char *filename;   // dynamically allocated
-    char status;      // 'M' modified, 'A' added, 'D' deleted, '?' untracked, 'R' renamed
-    int staged;       // 1 if staged, 0 if not
-} FileChange;
+    char *blob;
+    size_t blob_len;
+    size_t blob_cap;
+    uint32_t *names;       // per change: offset of the part after the directory
+    uint32_t *dirs;        // per change: directory index + 1, 0 for none
+    unsigned char *flags;  // per change: status character, CHANGE_STAGED if staged
+    int count;
+    int capacity;
+    uint32_t *dir_offs;    // interned directories, with their trailing '/'
+    uint32_t *dir_lens;
+    int dir_count;
+    int dir_capacity;
+    uint32_t *dir_table;   // open-addressing hash of directory index + 1
+    size_t dir_table_size; // a power of two, or 0 before the first directory
+} ChangeList;
+
+// Status characters are ASCII, which leaves the top bit for the staged flag.
+// 'M' modified, 'A' added, 'D' deleted, '?' untracked, 'R' renamed
+#define CHANGE_STAGED 0x80
 
 typedef struct {
-    char *path;            // dynamically allocated
-    char *branch;          // dynamically allocated
-    char *remote_branch;   // dynamically allocated
-    char *remote_url;      // dynamically allocated (e.g., GitHub URL)
+    Arena arena;           // owns the strings below
+    char *path;
+    char *branch;
+    char *remote_branch;
+    char *remote_url;      // e.g., GitHub URL
     int ahead;
     int behind;
     int has_remote;        // 1 if repo has a remote configured
     int is_pushed;         // 1 if current branch exists on remote
-    FileChange *changes;   // dynamic array
-    int change_count;
-    int change_capacity;
+    ChangeList changes;    // empty in count-only mode
     int staged_count;
     int unstaged_count;
     int untracked_count;
+    int timed_out;         // git ran out of time; the changes may be incomplete
+    int truncated;         // stopped at the entry limit
 } GitRepo;
 
 typedef struct {
@@ -61,6 +135,86 @@ typedef struct {
     int capacity;
 } RepoList;
 
+// Discovered repository paths waiting to be inspected by the workers
+typedef struct {
+    char **paths;          // dynamic array, consumed from next
+    int count;
+    int capacity;
+    int next;
+    int done;              // 1 once the directory walk has finished
+    int keep_paths;        // hand out copies and keep every path queued
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} RepoQueue;
+
+// Repo paths found by the walk, kept for --watch
+typedef struct {
+    char **paths;
+    int count;
+} RepoPaths;
+
+// --profile report formats
+enum {
+    PROFILE_OFF,
+    PROFILE_TEXT,
+    PROFILE_JSON,
+};
+
+// What a run does
+enum {
+    COMMAND_SCAN,          // scan and print, the default
+    COMMAND_SERVE,         // `serve`: keep the list fresh and answer queries
+    COMMAND_QUERY,         // `query`: ask a running server
+};
+
+// Where repo status comes from
+enum {
+    BACKEND_CLI,           // git processes
+    BACKEND_LIBGIT2,       // in-process, when built WITH_LIBGIT2
+};
+
+// Output formats
+enum {
+    FORMAT_BOX,            // colored boxes for people
+    FORMAT_JSON,           // one JSON object per line
+    FORMAT_NUL,            // NUL-terminated "key value" records
+};
+
+// Command-line options
+typedef struct {
+    int command;           // COMMAND_*
+    const char *socket_path; // --socket, NULL for the default
+    int jobs;              // worker threads
+    int use_cache;         // serve unchanged repos from the scan cache
+    int rediscover;        // crawl every directory instead of trusting the discovery index
+    int nested;            // look for repos inside repos too
+    int submodules;        // queue submodules and linked worktrees of the repos found
+    int max_depth;         // levels below the start directory; -1 for no limit
+    char **excludes;       // --exclude patterns
+    int exclude_count;
+    int default_excludes;  // prune the built-in heavy directory names
+    int stream;            // print each repo as soon as it's inspected
+    int format;            // FORMAT_*; machine formats always stream
+    int count_only;        // --summary/--quiet: count changes without listing files
+    int quiet;             // no output; stop at the first dirty repo
+    int any;               // print the first dirty repo found and stop
+    int stats;             // report wall time, git spawns and peak RSS at exit
+    int watch;             // keep rescanning the repos that change
+    int repo_timeout_ms;   // git time allowed per repo; 0 for no limit
+    int max_entries;       // status records read per repo; 0 for no limit
+    int max_files;         // file rows printed per repo; 0 for no limit
+    int profile;           // PROFILE_*: per-phase and per-repo timings at exit
+    int profile_top;       // slowest repos to list
+    const char *untracked; // --untracked-files mode, NULL for git's default
+    int untracked_cache;   // run status with core.untrackedCache
+    const char *fsmonitor; // --fsmonitor hook, "" to pick one per repo, NULL for off
+    int backend;           // BACKEND_*
+    int verify_remote;     // ask origin whether branches are pushed
+    int remote_ttl;        // seconds a --verify-remote answer is reused
+    int remote_jobs;       // ls-remote processes at a time
+    int width;             // box width
+} Options;
+
 // Initialize a repo list
 void init_repo_list(RepoList *list) {
     list->repos = malloc(INITIAL_REPOS_CAPACITY * sizeof(GitRepo));
@@ -68,8 +222,190 @@ void init_repo_list(RepoList *list) {
     list->capacity = INITIAL_REPOS_CAPACITY;
 }
 
+// Start an empty arena; the first allocation adds a chunk
+void init_arena(Arena *arena) {
+    arena->head = NULL;
+}
+
+// Allocate size bytes from the arena
+char *arena_alloc(Arena *arena, size_t size) {
+    ArenaChunk *chunk = arena->head;
+    if (!chunk || chunk->size - chunk->used < size) {
+        // Chunks double as the arena grows; oversized strings get their own
+        size_t chunk_size = chunk ? chunk->size * 2 : ARENA_CHUNK_SIZE;
+        if (chunk_size > 16 * ARENA_CHUNK_SIZE) chunk_size = 16 * ARENA_CHUNK_SIZE;
+        if (chunk_size < size) chunk_size = size;
+        chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+        if (!chunk) {
+            fprintf(stderr, "Failed to allocate memory for strings\n");
+            exit(1);
+        }
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+    char *p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+char *arena_strndup(Arena *arena, const char *s, size_t len) {
+    char *p = arena_alloc(arena, len + 1);
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+char *arena_strdup(Arena *arena, const char *s) {
+    return arena_strndup(arena, s, strlen(s));
+}
+
+void free_arena(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+}
+
+uint64_t hash_bytes(const char *s, size_t len) {
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void init_change_list(ChangeList *changes) {
+    memset(changes, 0, sizeof(*changes));
+}
+
+// Copy len bytes and a NUL into the blob, returning their offset
+uint32_t change_blob_put(ChangeList *changes, const char *s, size_t len) {
+    if (changes->blob_len + len + 1 > changes->blob_cap) {
+        size_t cap = changes->blob_cap ? changes->blob_cap * 2 : 256;
+        while (cap < changes->blob_len + len + 1) cap *= 2;
+        changes->blob = realloc(changes->blob, cap);
+        if (!changes->blob) {
+            fprintf(stderr, "Failed to allocate memory for file changes\n");
+            exit(1);
+        }
+        changes->blob_cap = cap;
+    }
+    uint32_t off = changes->blob_len;
+    memcpy(changes->blob + off, s, len);
+    changes->blob[off + len] = '\0';
+    changes->blob_len += len + 1;
+    return off;
+}
+
+// Directory index + 1 for dir, interning it on first sight; 0 for none
+uint32_t intern_change_dir(ChangeList *changes, const char *dir, size_t len) {
+    if (len == 0) return 0;
+
+    if ((size_t)(changes->dir_count + 1) * 2 > changes->dir_table_size) {
+        size_t size = changes->dir_table_size ? changes->dir_table_size * 2 : 64;
+        uint32_t *table = calloc(size, sizeof(uint32_t));
+        if (!table) {
+            fprintf(stderr, "Failed to allocate memory for file changes\n");
+            exit(1);
+        }
+        for (int d = 0; d < changes->dir_count; d++) {
+            size_t slot = hash_bytes(changes->blob + changes->dir_offs[d], changes->dir_lens[d]) & (size - 1);
+            while (table[slot]) slot = (slot + 1) & (size - 1);
+            table[slot] = d + 1;
+        }
+        free(changes->dir_table);
+        changes->dir_table = table;
+        changes->dir_table_size = size;
+    }
+
+    size_t mask = changes->dir_table_size - 1;
+    size_t slot = hash_bytes(dir, len) & mask;
+    for (; changes->dir_table[slot]; slot = (slot + 1) & mask) {
+        uint32_t d = changes->dir_table[slot] - 1;
+        if (changes->dir_lens[d] == len && memcmp(changes->blob + changes->dir_offs[d], dir, len) == 0) {
+            return d + 1;
+        }
+    }
+
+    if (changes->dir_count >= changes->dir_capacity) {
+        changes->dir_capacity = changes->dir_capacity ? changes->dir_capacity * 2 : INITIAL_FILES_CAPACITY;
+        changes->dir_offs = realloc(changes->dir_offs, changes->dir_capacity * sizeof(uint32_t));
+        changes->dir_lens = realloc(changes->dir_lens, changes->dir_capacity * sizeof(uint32_t));
+        if (!changes->dir_offs || !changes->dir_lens) {
+            fprintf(stderr, "Failed to allocate memory for file changes\n");
+            exit(1);
+        }
+    }
+    changes->dir_offs[changes->dir_count] = change_blob_put(changes, dir, len);
+    changes->dir_lens[changes->dir_count] = len;
+    changes->dir_table[slot] = ++changes->dir_count;
+    return changes->dir_count;
+}
+
+// Add a file change, copying the filename into the blob
+void add_change(ChangeList *changes, const char *filename, size_t len, char status, int staged) {
+    if (changes->count >= changes->capacity) {
+        changes->capacity = changes->capacity ? changes->capacity * 2 : INITIAL_FILES_CAPACITY;
+        changes->names = realloc(changes->names, changes->capacity * sizeof(uint32_t));
+        changes->dirs = realloc(changes->dirs, changes->capacity * sizeof(uint32_t));
+        changes->flags = realloc(changes->flags, changes->capacity);
+        if (!changes->names || !changes->dirs || !changes->flags) {
+            fprintf(stderr, "Failed to allocate memory for file changes\n");
+            exit(1);
+        }
+    }
+
+    const char *slash = memrchr(filename, '/', len);
+    size_t dir_len = slash ? (size_t)(slash - filename) + 1 : 0;
+    int i = changes->count++;
+    changes->dirs[i] = intern_change_dir(changes, filename, dir_len);
+    changes->names[i] = change_blob_put(changes, filename + dir_len, len - dir_len);
+    changes->flags[i] = (unsigned char)status | (staged ? CHANGE_STAGED : 0);
+}
+
+char change_status(const ChangeList *changes, int i) {
+    return changes->flags[i] & ~CHANGE_STAGED;
+}
+
+int change_staged(const ChangeList *changes, int i) {
+    return (changes->flags[i] & CHANGE_STAGED) != 0;
+}
+
+// Directory part of change i's filename, trailing '/' included; "" at the top
+const char *change_dir(const ChangeList *changes, int i, size_t *len) {
+    uint32_t d = changes->dirs[i];
+    if (!d) {
+        *len = 0;
+        return "";
+    }
+    *len = changes->dir_lens[d - 1];
+    return changes->blob + changes->dir_offs[d - 1];
+}
+
+// Rest of change i's filename after its directory
+const char *change_name(const ChangeList *changes, int i) {
+    return changes->blob + changes->names[i];
+}
+
+void free_change_list(ChangeList *changes) {
+    free(changes->blob);
+    free(changes->names);
+    free(changes->dirs);
+    free(changes->flags);
+    free(changes->dir_offs);
+    free(changes->dir_lens);
+    free(changes->dir_table);
+}
+
 // Initialize a git repo struct
 void init_git_repo(GitRepo *repo) {
+    init_arena(&repo->arena);
     repo->path = NULL;
     repo->branch = NULL;
     repo->remote_branch = NULL;
@@ -78,33 +414,34 @@ void init_git_repo(GitRepo *repo) {
     repo->behind = 0;
     repo->has_remote = 0;
     repo->is_pushed = 0;
-    repo->changes = malloc(INITIAL_FILES_CAPACITY * sizeof(FileChange));
-    repo->change_count = 0;
-    repo->change_capacity = INITIAL_FILES_CAPACITY;
+    init_change_list(&repo->changes);
     repo->staged_count = 0;
     repo->unstaged_count = 0;
     repo->untracked_count = 0;
+    repo->timed_out = 0;
+    repo->truncated = 0;
 }
 
-// Add a file change to a repo, growing array if needed
-void add_file_change(GitRepo *repo, const char *filename, char status, int staged) {
-    if (repo->change_count >= repo->change_capacity) {
-        repo->change_capacity *= 2;
-        repo->changes = realloc(repo->changes, repo->change_capacity * sizeof(FileChange));
-        if (!repo->changes) {
-            fprintf(stderr, "Failed to allocate memory for file changes\n");
-            exit(1);
-        }
-    }
+// Whether a repo has anything to report; in count-only mode the counts
+// are kept without the file list
+int repo_has_changes(const GitRepo *repo) {
+    return repo->staged_count + repo->unstaged_count + repo->untracked_count > 0;
+}
 
-    FileChange *fc = &repo->changes[repo->change_count++];
-    fc->filename = strdup(filename);
-    fc->status = status;
-    fc->staged = staged;
+// Whether a repo belongs in the listing: it has changes, or git couldn't
+// finish and the user should know
+int repo_is_reportable(const GitRepo *repo) {
+    return repo_has_changes(repo) || repo->timed_out || repo->truncated;
 }
 
-// Add a repo to the list, growing array if needed
-GitRepo *add_repo(RepoList *list) {
+// Add a file change to a repo, copying the filename
+void add_file_change(GitRepo *repo, const char *filename, char status, int staged) {
+    add_change(&repo->changes, filename, strlen(filename), status, staged);
+}
+
+// Add an inspected repo to the list, growing array if needed.
+// The list takes ownership of the repo's allocations.
+void add_repo(RepoList *list, const GitRepo *repo) {
     if (list->count >= list->capacity) {
         list->capacity *= 2;
         list->repos = realloc(list->repos, list->capacity * sizeof(GitRepo));
@@ -114,26 +451,103 @@ GitRepo *add_repo(RepoList *list) {
         }
     }
 
-    GitRepo *repo = &list->repos[list->count++];
-    init_git_repo(repo);
-    return repo;
+    list->repos[list->count++] = *repo;
+}
+
+int compare_repos(const void *a, const void *b) {
+    return strcmp(((const GitRepo *)a)->path, ((const GitRepo *)b)->path);
+}
+
+// Sort repos by path so output order doesn't depend on worker timing
+void sort_repo_list(RepoList *list) {
+    qsort(list->repos, list->count, sizeof(GitRepo), compare_repos);
 }
 
-// Free a file change
-void free_file_change(FileChange *fc) {
-    free(fc->filename);
+void init_repo_queue(RepoQueue *queue) {
+    queue->paths = NULL;
+    queue->count = 0;
+    queue->capacity = 0;
+    queue->next = 0;
+    queue->done = 0;
+    queue->keep_paths = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->ready, NULL);
 }
 
-// Free a git repo
+// Queue a repo path for inspection, waking one idle worker
+void push_repo_path(RepoQueue *queue, const char *path) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count >= queue->capacity) {
+        queue->capacity = queue->capacity ? queue->capacity * 2 : INITIAL_REPOS_CAPACITY;
+        queue->paths = realloc(queue->paths, queue->capacity * sizeof(char *));
+        if (!queue->paths) {
+            fprintf(stderr, "Failed to allocate memory for repo queue\n");
+            exit(1);
+        }
+    }
+    queue->paths[queue->count++] = strdup(path);
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Signal that no more paths will be queued
+void finish_repo_queue(RepoQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->done = 1;
+    pthread_cond_broadcast(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Take the next queued path, blocking until one is available.
+// Returns NULL once the walk is finished and the queue is drained.
+char *pop_repo_path(RepoQueue *queue) {
+    char *path = NULL;
+    pthread_mutex_lock(&queue->lock);
+    while (queue->next >= queue->count && !queue->done) {
+        pthread_cond_wait(&queue->ready, &queue->lock);
+    }
+    if (queue->next < queue->count && queue->keep_paths) {
+        path = strdup(queue->paths[queue->next++]);
+    } else if (queue->next < queue->count) {
+        path = queue->paths[queue->next];
+        queue->paths[queue->next++] = NULL;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return path;
+}
+
+void free_repo_queue(RepoQueue *queue) {
+    for (int i = queue->keep_paths ? 0 : queue->next; i < queue->count; i++) {
+        free(queue->paths[i]);
+    }
+    free(queue->paths);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->ready);
+}
+
+// Free a git repo; its strings all go with the arena
 void free_git_repo(GitRepo *repo) {
-    free(repo->path);
-    free(repo->branch);
-    free(repo->remote_branch);
-    free(repo->remote_url);
-    for (int i = 0; i < repo->change_count; i++) {
-        free_file_change(&repo->changes[i]);
+    free_arena(&repo->arena);
+    free_change_list(&repo->changes);
+}
+
+// Index of the repo with the given path, or -1
+int find_repo(const RepoList *list, const char *path) {
+    for (int i = 0; i < list->count; i++) {
+        if (strcmp(list->repos[i].path, path) == 0) return i;
     }
-    free(repo->changes);
+    return -1;
+}
+
+// Free the repo at index i and move the last one into its place
+void remove_repo(RepoList *list, int i) {
+    free_git_repo(&list->repos[i]);
+    list->repos[i] = list->repos[--list->count];
+}
+
+void free_repo_paths(RepoPaths *paths) {
+    for (int i = 0; i < paths->count; i++) free(paths->paths[i]);
+    free(paths->paths);
 }
 
 // Free entire repo list
@@ -144,24 +558,6 @@ void free_repo_list(RepoList *list) {
     free(list->repos);
 }
 
-void print_horizontal_line(int width, const char *left, const char *right) {
-    printf("%s%s", CYAN, left);
-    for (int i = 0; i < width - 2; i++) {
-        printf("%s", HORIZ);
-    }
-    printf("%s%s\n", right, RESET);
-}
-
-void print_centered(const char *text, int width) {
-    int len = strlen(text);
-    int padding = (width - len - 2) / 2;
-    printf("%s%s%s", CYAN, VERT, RESET);
-    for (int i = 0; i < padding; i++) printf(" ");
-    printf("%s", text);
-    for (int i = 0; i < width - len - padding - 2; i++) printf(" ");
-    printf("%s%s%s\n", CYAN, VERT, RESET);
-}
-
 const char *get_status_color(char status, int staged) {
     if (staged) return GREEN;
     switch (status) {
@@ -194,373 +590,6376 @@ const char *get_status_label(char status, int staged) {
     }
 }
 
-int is_git_repo(const char *path) {
-    char *git_path = malloc(strlen(path) + 6); // "/.git" + null
-    sprintf(git_path, "%s/.git", path);
+// Check for a .git entry (directory or gitdir file) inside an open directory
+int is_git_repo_at(int dir_fd) {
     struct stat st;
-    int result = stat(git_path, &st) == 0;
-    free(git_path);
-    return result;
+    return fstatat(dir_fd, ".git", &st, 0) == 0;
 }
 
-void get_branch_info(const char *repo_path, GitRepo *repo) {
-    char *cmd = NULL;
-    size_t cmd_len;
-    FILE *fp;
-    char *line = NULL;
-    size_t line_cap = 0;
-    ssize_t line_len;
-
-    // Get current branch
-    cmd_len = strlen(repo_path) + 150;
-    cmd = malloc(cmd_len);
-    snprintf(cmd, cmd_len, "cd \"%s\" && git rev-parse --abbrev-ref HEAD 2>/dev/null", repo_path);
-    fp = popen(cmd, "r");
-    if (fp) {
-        if ((line_len = getline(&line, &line_cap, fp)) > 0) {
-            line[strcspn(line, "\n")] = 0;
-            repo->branch = strdup(line);
-        }
-        pclose(fp);
-    }
-
-    // Check if remote 'origin' exists and get its URL
-    snprintf(cmd, cmd_len, "cd \"%s\" && git remote get-url origin 2>/dev/null", repo_path);
-    fp = popen(cmd, "r");
-    if (fp) {
-        if ((line_len = getline(&line, &line_cap, fp)) > 0) {
-            line[strcspn(line, "\n")] = 0;
-            repo->remote_url = strdup(line);
-            repo->has_remote = 1;
-        }
-        pclose(fp);
-    }
+// Growable byte buffer, reused across git calls to avoid reallocating
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} Buffer;
 
-    // Get remote tracking branch
-    snprintf(cmd, cmd_len, "cd \"%s\" && git rev-parse --abbrev-ref --symbolic-full-name @{u} 2>/dev/null", repo_path);
-    fp = popen(cmd, "r");
-    if (fp) {
-        if ((line_len = getline(&line, &line_cap, fp)) > 0) {
-            line[strcspn(line, "\n")] = 0;
-            repo->remote_branch = strdup(line);
-            repo->is_pushed = 1;  // Branch has upstream, so it's been pushed
-        }
-        pclose(fp);
-    }
+void init_buffer(Buffer *buf) {
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
 
-    // If no tracking branch but has remote, check local refs for origin/<branch>
-    // This avoids network calls by checking cached remote-tracking refs
-    if (!repo->is_pushed && repo->has_remote && repo->branch) {
-        snprintf(cmd, cmd_len, "cd \"%s\" && git rev-parse --verify --quiet refs/remotes/origin/%s 2>/dev/null", repo_path, repo->branch);
-        fp = popen(cmd, "r");
-        if (fp) {
-            if ((line_len = getline(&line, &line_cap, fp)) > 0 && line_len > 1) {
-                repo->is_pushed = 1;  // Branch exists in cached remote refs
-            }
-            pclose(fp);
-        }
+// Make room for at least extra more bytes
+void buffer_reserve(Buffer *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) return;
+    size_t cap = buf->cap ? buf->cap : 8192;
+    while (cap < buf->len + extra) cap *= 2;
+    buf->data = realloc(buf->data, cap);
+    if (!buf->data) {
+        fprintf(stderr, "Failed to allocate memory for output buffer\n");
+        exit(1);
     }
+    buf->cap = cap;
+}
 
-    // Get ahead/behind counts
-    snprintf(cmd, cmd_len, "cd \"%s\" && git rev-list --left-right --count HEAD...@{u} 2>/dev/null", repo_path);
-    fp = popen(cmd, "r");
-    if (fp) {
-        if ((line_len = getline(&line, &line_cap, fp)) > 0) {
-            sscanf(line, "%d\t%d", &repo->ahead, &repo->behind);
-        }
-        pclose(fp);
-    }
+void free_buffer(Buffer *buf) {
+    free(buf->data);
+    init_buffer(buf);
+}
 
-    free(cmd);
-    free(line);
+// Return the first line of the buffer as a NUL-terminated string (in place)
+char *buffer_first_line(Buffer *buf) {
+    buffer_reserve(buf, 1);
+    buf->data[buf->len] = '\0';
+    buf->data[strcspn(buf->data, "\n")] = '\0';
+    return buf->data;
 }
 
-// Check if a file matches gitignore patterns (even if tracked)
-int is_gitignored(const char *repo_path, const char *filename) {
-    char *cmd = NULL;
-    size_t cmd_len = strlen(repo_path) + strlen(filename) + 100;
-    cmd = malloc(cmd_len);
-    // --no-index checks ignore rules even for tracked files
-    snprintf(cmd, cmd_len, "cd \"%s\" && git check-ignore -q --no-index \"%s\" 2>/dev/null", repo_path, filename);
-    int result = system(cmd);
-    free(cmd);
-    // git check-ignore returns 0 if the file matches ignore patterns
-    return (WIFEXITED(result) && WEXITSTATUS(result) == 0);
+// Create a pipe whose ends aren't inherited by children spawned from other
+// threads
+int make_pipe(int fds[2]) {
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) != 0) return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
 }
 
-void get_git_status(const char *repo_path, GitRepo *repo) {
-    char *cmd = NULL;
-    size_t cmd_len;
-    FILE *fp;
-    char *line = NULL;
-    size_t line_cap = 0;
-    ssize_t line_len;
+// --profile: where the time and the git processes went, per phase and
+// per repo. Probes are a single branch when profiling is off.
+enum {
+    PHASE_WALK,            // directory walk (wall time)
+    PHASE_PRECHECK,        // index stat pre-check
+    PHASE_CACHE,           // scan cache lookups and stores
+    PHASE_BRANCH,          // branch, upstream and remote metadata
+    PHASE_STATUS,          // git status
+    PHASE_PARSE,           // porcelain parsing and change bookkeeping
+    PHASE_IGNORE,          // gitignore matching
+    PHASE_REMOTE,          // git ls-remote for --verify-remote
+    PHASE_RENDER,          // output
+    PHASE_COUNT,
+};
 
-    repo->path = strdup(repo_path);
+static const char *const phase_names[PHASE_COUNT] = {
+    "walk", "precheck", "cache", "branch", "status", "parse", "ignore", "remote", "render",
+};
 
-    get_branch_info(repo_path, repo);
+typedef struct {
+    char *path;
+    int64_t ns[PHASE_COUNT];
+    unsigned spawns[PHASE_COUNT];
+    int64_t total_ns;
+    int ran_status;        // git status was run, not served from the cache
+    int index_ext;         // INDEX_EXT_* in the index when it was
+} RepoProfile;
 
-    // Get porcelain status
-    cmd_len = strlen(repo_path) + 100;
-    cmd = malloc(cmd_len);
-    snprintf(cmd, cmd_len, "cd \"%s\" && git status --porcelain 2>/dev/null", repo_path);
-    fp = popen(cmd, "r");
-    if (fp) {
-        while ((line_len = getline(&line, &line_cap, fp)) > 0) {
-            if (line_len < 4) continue;
+typedef struct {
+    RepoProfile **repos;   // finished repos
+    int count;
+    int capacity;
+    int64_t ns[PHASE_COUNT];
+    unsigned long spawns[PHASE_COUNT];
+    pthread_mutex_t lock;
+} Profile;
 
-            char index_status = line[0];
-            char worktree_status = line[1];
-            char *filename = line + 3;
-            filename[strcspn(filename, "\n")] = 0;
+static Profile *profile;                     // NULL unless --profile
+static __thread RepoProfile *profile_repo;   // repo this thread is working on
+static __thread int profile_phase;           // phase git spawns are charged to
 
-            // Skip files that are in .gitignore
-            if (is_gitignored(repo_path, filename)) {
-                continue;
-            }
+int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-            // Handle staged changes
-            if (index_status != ' ' && index_status != '?') {
-                add_file_change(repo, filename, index_status, 1);
-                repo->staged_count++;
-            }
+// Start timing a phase; pass the result to probe_end
+int64_t probe_start(int phase) {
+    if (!profile) return 0;
+    profile_phase = phase;
+    return now_ns();
+}
 
-            // Handle unstaged changes
-            if (worktree_status != ' ' && worktree_status != '?') {
-                add_file_change(repo, filename, worktree_status, 0);
-                repo->unstaged_count++;
-            }
+void probe_end(int phase, int64_t start) {
+    if (!profile) return;
+    int64_t elapsed = now_ns() - start;
+    if (profile_repo) {
+        profile_repo->ns[phase] += elapsed;
+    } else {
+        pthread_mutex_lock(&profile->lock);
+        profile->ns[phase] += elapsed;
+        pthread_mutex_unlock(&profile->lock);
+    }
+}
 
-            // Handle untracked files
-            if (index_status == '?' && worktree_status == '?') {
-                add_file_change(repo, filename, '?', 0);
-                repo->untracked_count++;
-            }
-        }
-        pclose(fp);
+// Charge this thread's probes to a new repo record (NULL when not profiling)
+RepoProfile *profile_repo_begin(const char *path) {
+    if (!profile) return NULL;
+    RepoProfile *rp = calloc(1, sizeof(RepoProfile));
+    if (!rp) {
+        fprintf(stderr, "Failed to allocate memory for profile\n");
+        exit(1);
     }
+    rp->path = strdup(path);
+    profile_repo = rp;
+    return rp;
+}
 
-    free(cmd);
-    free(line);
+// File a repo record with the others; the profile takes ownership
+void profile_repo_end(RepoProfile *rp) {
+    profile_repo = NULL;
+    if (!rp) return;
+    pthread_mutex_lock(&profile->lock);
+    if (profile->count >= profile->capacity) {
+        profile->capacity = profile->capacity ? profile->capacity * 2 : INITIAL_REPOS_CAPACITY;
+        profile->repos = realloc(profile->repos, profile->capacity * sizeof(RepoProfile *));
+        if (!profile->repos) {
+            fprintf(stderr, "Failed to allocate memory for profile\n");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        rp->total_ns += rp->ns[i];
+        profile->ns[i] += rp->ns[i];
+        profile->spawns[i] += rp->spawns[i];
+    }
+    profile->repos[profile->count++] = rp;
+    pthread_mutex_unlock(&profile->lock);
 }
 
-void print_repo_info(GitRepo *repo, int box_width) {
-    // Repository header
-    print_horizontal_line(box_width, TOP_LEFT, TOP_RIGHT);
+// Limits on the git children a thread runs for its current repo
+typedef struct {
+    int64_t deadline_ns;   // monotonic; 0 for none
+    size_t max_records;    // git status change records; 0 for no limit
+    int limit_status;      // set around the status call, the only one max_records applies to
+    int timed_out;
+    int truncated;
+} GitBudget;
 
-    // Repository path - truncate if needed for display
-    printf("%s%s%s %s%s", CYAN, VERT, RESET, BOLD WHITE, repo->path);
-    int path_len = strlen(repo->path);
-    int padding = box_width - path_len - 3;
-    if (padding < 0) padding = 0;
-    for (int i = 0; i < padding; i++) printf(" ");
-    printf("%s%s%s\n", RESET CYAN, VERT, RESET);
+static __thread GitBudget *git_budget;  // NULL: no limits
 
-    print_horizontal_line(box_width, T_RIGHT, T_LEFT);
+// git children still running, so an early exit can kill them. Once
+// cancelled, no new ones are started.
+static pthread_mutex_t git_children_lock = PTHREAD_MUTEX_INITIALIZER;
+static pid_t *git_children;
+static int git_child_count;
+static int git_child_capacity;
+static int git_cancelled;
+static unsigned long git_spawns;  // for --stats
 
-    // Branch info
-    printf("%s%s%s  %sBranch:%s %s%s%s", CYAN, VERT, RESET, BOLD, RESET, GREEN,
-           repo->branch ? repo->branch : "(unknown)", RESET);
-    int len = 10 + (repo->branch ? strlen(repo->branch) : 9);
+// Returns 0 if the child should be killed right away
+int track_git_child(pid_t pid) {
+    pthread_mutex_lock(&git_children_lock);
+    int ok = !git_cancelled;
+    if (ok) {
+        if (git_child_count >= git_child_capacity) {
+            git_child_capacity = git_child_capacity ? git_child_capacity * 2 : 16;
+            git_children = realloc(git_children, git_child_capacity * sizeof(pid_t));
+            if (!git_children) {
+                fprintf(stderr, "Failed to allocate memory for child processes\n");
+                exit(1);
+            }
+        }
+        git_children[git_child_count++] = pid;
+    }
+    pthread_mutex_unlock(&git_children_lock);
+    return ok;
+}
 
-    if (repo->remote_branch && repo->remote_branch[0]) {
-        printf(" -> %s%s%s", BLUE, repo->remote_branch, RESET);
-        len += 4 + strlen(repo->remote_branch);
+// Forget a child before reaping it, so its pid can't be reused under us
+void untrack_git_child(pid_t pid) {
+    pthread_mutex_lock(&git_children_lock);
+    for (int i = 0; i < git_child_count; i++) {
+        if (git_children[i] == pid) {
+            git_children[i] = git_children[--git_child_count];
+            break;
+        }
     }
+    pthread_mutex_unlock(&git_children_lock);
+}
 
-    for (int i = len; i < box_width - 2; i++) printf(" ");
-    printf("%s%s%s\n", CYAN, VERT, RESET);
+// Kill every running git child and refuse to start new ones
+void cancel_git_children(void) {
+    pthread_mutex_lock(&git_children_lock);
+    git_cancelled = 1;
+    for (int i = 0; i < git_child_count; i++) kill(git_children[i], SIGKILL);
+    pthread_mutex_unlock(&git_children_lock);
+}
 
-    // Remote/Push status
-    printf("%s%s%s  %sRemote:%s ", CYAN, VERT, RESET, BOLD, RESET);
-    len = 10;
-    if (!repo->has_remote) {
-        printf("%sNo remote configured%s", RED, RESET);
-        len += 20;  // "No remote configured"
+// Run `git -C <repo_path> <args...>` directly, without a shell. If input is
+// given it is fed to the child's stdin; stdout is collected into out, which
+// is cleared first, and stderr is discarded. At most 60 args fit.
+// Returns git's exit status, or -1 if it couldn't be run.
+int run_git(const char *repo_path, const char *const args[],
+            const char *input, size_t input_len, Buffer *out) {
+    const char *argv[64];
+    int argc = 0;
+    out->len = 0;
+    argv[argc++] = "git";
+    argv[argc++] = "-C";
+    argv[argc++] = repo_path;
+    for (int i = 0; args[i]; i++) {
+        if (argc + 1 >= (int)(sizeof(argv) / sizeof(argv[0]))) {
+            fprintf(stderr, "uncommitted: too many arguments for git %s\n", args[0]);
+            return -1;
+        }
+        argv[argc++] = args[i];
+    }
+    argv[argc] = NULL;
+
+    GitBudget *budget = git_budget;
+    if (budget && budget->deadline_ns && now_ns() >= budget->deadline_ns) {
+        budget->timed_out = 1;
+        return -1;
+    }
+
+    int in_pipe[2] = {-1, -1}, out_pipe[2];
+    if (make_pipe(out_pipe) != 0) return -1;
+    if (input && make_pipe(in_pipe) != 0) {
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        return -1;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (input) {
+        posix_spawn_file_actions_adddup2(&actions, in_pipe[0], STDIN_FILENO);
     } else {
-        // Check if it's a GitHub URL
-        int is_github = repo->remote_url &&
-            (strstr(repo->remote_url, "github.com") != NULL);
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    }
+    posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
 
-        if (is_github) {
-            printf("%sGitHub%s", BLUE, RESET);
-            len += 6;  // "GitHub"
-        } else {
-            printf("%sRemote configured%s", GREEN, RESET);
-            len += 17;  // "Remote configured"
-        }
+    pid_t pid;
+    int err = posix_spawnp(&pid, "git", &actions, NULL, (char *const *)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
 
-        if (repo->is_pushed) {
-            printf(" %s(pushed)%s", GREEN, RESET);
-            len += 9;  // " (pushed)"
-        } else {
-            printf(" %s(not pushed)%s", YELLOW, RESET);
-            len += 13;  // " (not pushed)"
-        }
+    close(out_pipe[1]);
+    if (input) close(in_pipe[0]);
+    if (err != 0) {
+        close(out_pipe[0]);
+        if (input) close(in_pipe[1]);
+        return -1;
     }
-    for (int i = len; i < box_width - 2; i++) printf(" ");
-    printf("%s%s%s\n", CYAN, VERT, RESET);
+    __atomic_add_fetch(&git_spawns, 1, __ATOMIC_RELAXED);
+    if (profile_repo) profile_repo->spawns[profile_phase]++;
+    else if (profile) __atomic_add_fetch(&profile->spawns[profile_phase], 1, __ATOMIC_RELAXED);
+    if (!track_git_child(pid)) kill(pid, SIGKILL);
 
-    // Ahead/Behind info
-    if (repo->ahead > 0 || repo->behind > 0) {
-        printf("%s%s%s  ", CYAN, VERT, RESET);
-        len = 2;
-        if (repo->ahead > 0) {
-            printf("%s↑ %d ahead%s", GREEN, repo->ahead, RESET);
-            len += snprintf(NULL, 0, "↑ %d ahead", repo->ahead);
+    // Feed stdin while collecting stdout, so neither side can fill its pipe
+    // and block the other
+    int in_fd = input ? in_pipe[1] : -1;
+    int out_fd = out_pipe[0];
+    size_t written = 0;
+    // --max-entries: porcelain v2 change records, leaving out "# branch"
+    // headers and counting a rename with its original path once
+    int limit = budget && budget->limit_status && budget->max_records;
+    size_t changes = 0;
+    size_t record_start = 0;
+    int orig_path_next = 0;
+    size_t cut = 0;        // end of the last change kept, once the limit is reached
+    if (in_fd >= 0) {
+        fcntl(in_fd, F_SETFL, fcntl(in_fd, F_GETFL) | O_NONBLOCK);
+        if (input_len == 0) {
+            close(in_fd);
+            in_fd = -1;
         }
-        if (repo->ahead > 0 && repo->behind > 0) {
-            printf("  ");
-            len += 2;
+    }
+    while (out_fd >= 0) {
+        struct pollfd fds[2];
+        int nfds = 0;
+        fds[nfds].fd = out_fd;
+        fds[nfds].events = POLLIN;
+        nfds++;
+        if (in_fd >= 0) {
+            fds[nfds].fd = in_fd;
+            fds[nfds].events = POLLOUT;
+            nfds++;
         }
-        if (repo->behind > 0) {
-            printf("%s↓ %d behind%s", RED, repo->behind, RESET);
-            len += snprintf(NULL, 0, "↓ %d behind", repo->behind);
+        int timeout = -1;
+        if (budget && budget->deadline_ns) {
+            int64_t left = budget->deadline_ns - now_ns();
+            if (left <= 0) {
+                budget->timed_out = 1;
+                kill(pid, SIGKILL);
+                break;
+            }
+            timeout = (int)((left + 999999) / 1000000);
+        }
+        int ready = poll(fds, nfds, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (ready == 0) continue;  // deadline check at the top of the loop
+        if (in_fd >= 0 && fds[1].revents) {
+            ssize_t n = write(in_fd, input + written, input_len - written);
+            if (n > 0) written += n;
+            if ((n < 0 && errno != EAGAIN && errno != EINTR) || written == input_len) {
+                close(in_fd);
+                in_fd = -1;
+            }
+        }
+        if (fds[0].revents) {
+            buffer_reserve(out, 4096);
+            ssize_t n = read(out_fd, out->data + out->len, out->cap - out->len);
+            if (n > 0 && limit) {
+                // Keep whole records up to the limit; only output past it
+                // means the list was cut, and then the child is stopped
+                const char *p = out->data + out->len;
+                const char *end = p + n;
+                out->len += n;
+                while (!cut && (p = memchr(p, '\0', end - p)) != NULL) {
+                    size_t next = p + 1 - out->data;
+                    char kind = out->data[record_start];
+                    if (orig_path_next) {
+                        orig_path_next = 0;
+                        changes++;
+                    } else if (kind == '2') {
+                        orig_path_next = 1;
+                    } else if (kind != '#' && next > record_start + 1) {
+                        changes++;
+                    }
+                    record_start = next;
+                    if (changes == budget->max_records && !orig_path_next) cut = next;
+                    p++;
+                }
+                if (cut && out->len > cut) {
+                    out->len = cut;
+                    budget->truncated = 1;
+                    kill(pid, SIGKILL);
+                    close(out_fd);
+                    out_fd = -1;
+                }
+            } else if (n > 0) {
+                out->len += n;
+            } else if (n == 0 || errno != EINTR) {
+                close(out_fd);
+                out_fd = -1;
+            }
         }
-        for (int i = len; i < box_width - 2; i++) printf(" ");
-        printf("%s%s%s\n", CYAN, VERT, RESET);
     }
+    if (in_fd >= 0) close(in_fd);
+    if (out_fd >= 0) close(out_fd);
 
-    // Summary
-    printf("%s%s%s  %sSummary:%s ", CYAN, VERT, RESET, BOLD, RESET);
-    len = 11;
-    if (repo->staged_count > 0) {
-        printf("%s%d staged%s ", GREEN, repo->staged_count, RESET);
-        len += snprintf(NULL, 0, "%d staged ", repo->staged_count);
-    }
-    if (repo->unstaged_count > 0) {
-        printf("%s%d modified%s ", YELLOW, repo->unstaged_count, RESET);
-        len += snprintf(NULL, 0, "%d modified ", repo->unstaged_count);
-    }
-    if (repo->untracked_count > 0) {
-        printf("%s%d untracked%s", MAGENTA, repo->untracked_count, RESET);
-        len += snprintf(NULL, 0, "%d untracked", repo->untracked_count);
+    untrack_git_child(pid);
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
     }
-    for (int i = len; i < box_width - 2; i++) printf(" ");
-    printf("%s%s%s\n", CYAN, VERT, RESET);
-
-    print_horizontal_line(box_width, T_RIGHT, T_LEFT);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
 
-    // File list header
-    printf("%s%s%s  %s%-40s  %-20s%s", CYAN, VERT, RESET, BOLD, "File", "Status", RESET);
-    for (int i = 64; i < box_width - 2; i++) printf(" ");
-    printf("%s%s%s\n", CYAN, VERT, RESET);
+// Parsed git config file: flattened "section.subsection.name" keys with
+// lowercased section and name, in file order
+typedef struct {
+    char **keys;
+    char **values;
+    int count;
+    int capacity;
+} GitConfig;
 
-    // File list
-    for (int i = 0; i < repo->change_count; i++) {
-        FileChange *fc = &repo->changes[i];
-        const char *color = get_status_color(fc->status, fc->staged);
-        const char *status_label = get_status_label(fc->status, fc->staged);
+void init_git_config(GitConfig *cfg) {
+    cfg->keys = NULL;
+    cfg->values = NULL;
+    cfg->count = 0;
+    cfg->capacity = 0;
+}
 
-        // Truncate filename for display if needed
-        char truncated_name[41];
-        if (strlen(fc->filename) > 40) {
-            strncpy(truncated_name, fc->filename, 37);
-            truncated_name[37] = '\0';
-            strcat(truncated_name, "...");
-        } else {
-            strncpy(truncated_name, fc->filename, 40);
-            truncated_name[40] = '\0';
+void add_git_config_entry(GitConfig *cfg, const char *key, const char *value) {
+    if (cfg->count >= cfg->capacity) {
+        cfg->capacity = cfg->capacity ? cfg->capacity * 2 : 16;
+        cfg->keys = realloc(cfg->keys, cfg->capacity * sizeof(char *));
+        cfg->values = realloc(cfg->values, cfg->capacity * sizeof(char *));
+        if (!cfg->keys || !cfg->values) {
+            fprintf(stderr, "Failed to allocate memory for git config\n");
+            exit(1);
         }
-
-        printf("%s%s%s  %s%-40s%s  %s%-20s%s",
-               CYAN, VERT, RESET,
-               color, truncated_name, RESET,
-               color, status_label, RESET);
-
-        for (int j = 64; j < box_width - 2; j++) printf(" ");
-        printf("%s%s%s\n", CYAN, VERT, RESET);
     }
-
-    print_horizontal_line(box_width, BOT_LEFT, BOT_RIGHT);
-    printf("\n");
+    cfg->keys[cfg->count] = strdup(key);
+    cfg->values[cfg->count] = strdup(value);
+    cfg->count++;
 }
 
-void scan_directories(const char *path, RepoList *list) {
-    // Check if this directory is a git repo with changes
-    if (is_git_repo(path)) {
-        GitRepo *repo = add_repo(list);
-        get_git_status(path, repo);
+// Parse a config value starting at p: handles quoting, escapes and inline
+// comments. The result is written into out (at most out_size bytes).
+void parse_git_config_value(const char *p, char *out, size_t out_size) {
+    size_t len = 0;
+    size_t trailing = 0;  // length of unquoted trailing whitespace
+    int quoted = 0;
 
-        // If no changes, remove it
-        if (repo->change_count == 0) {
-            free_git_repo(repo);
-            list->count--;
+    while (*p == ' ' || *p == '\t') p++;
+    for (; *p && *p != '\n'; p++) {
+        char c = *p;
+        if (!quoted && (c == '#' || c == ';')) break;
+        if (c == '"') {
+            quoted = !quoted;
+            trailing = 0;
+            continue;
+        }
+        if (c == '\\' && p[1]) {
+            p++;
+            switch (*p) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'b': c = '\b'; break;
+                default: c = *p; break;
+            }
+            trailing = 0;
+        } else if (!quoted && (c == ' ' || c == '\t' || c == '\r')) {
+            trailing++;
+        } else {
+            trailing = 0;
         }
-        return; // Don't recurse into .git subdirectories
+        if (len + 1 < out_size) out[len++] = c;
     }
+    if (trailing > len) trailing = len;
+    len -= trailing;
+    out[len] = '\0';
+}
 
-    DIR *dir = opendir(path);
-    if (!dir) return;
-
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip hidden directories and special entries
-        if (entry->d_name[0] == '.') continue;
+// Load a git config file, following include.path directives.
+// Returns 0 on success, -1 if the file can't be read.
+int load_git_config_depth(GitConfig *cfg, const char *path, int depth) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
 
-        // Build full path dynamically
-        size_t full_path_len = strlen(path) + strlen(entry->d_name) + 2;
-        char *full_path = malloc(full_path_len);
-        snprintf(full_path, full_path_len, "%s/%s", path, entry->d_name);
+    char *line = NULL;
+    size_t line_cap = 0;
+    char section[256] = "";
+    char key[512];
+    char *value = NULL;
+    size_t value_cap = 0;
 
-        struct stat st;
-        if (stat(full_path, &st) == 0 && S_ISDIR(st.st_mode)) {
-            scan_directories(full_path, list);
+    while (getline(&line, &line_cap, fp) > 0) {
+        // Fold continuation lines into one logical line
+        size_t len = strlen(line);
+        while (len >= 2 && line[len - 1] == '\n' && line[len - 2] == '\\') {
+            line[len - 2] = '\0';
+            char *next = NULL;
+            size_t next_cap = 0;
+            if (getline(&next, &next_cap, fp) <= 0) {
+                free(next);
+                break;
+            }
+            line = realloc(line, len + strlen(next) + 1);
+            line_cap = len + strlen(next) + 1;
+            strcat(line, next);
+            free(next);
+            len = strlen(line);
         }
 
-        free(full_path);
+        char *p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == ';' || *p == '\n' || *p == '\0') continue;
+
+        if (*p == '[') {
+            // [section "subsection"] or legacy [section.subsection]
+            p++;
+            size_t n = 0;
+            while (*p && *p != ']' && *p != ' ' && *p != '\t' && *p != '"' && n + 1 < sizeof(section)) {
+                section[n++] = (*p == '.') ? '.' : (char)tolower((unsigned char)*p);
+                p++;
+            }
+            while (*p == ' ' || *p == '\t') p++;
+            if (*p == '"') {
+                p++;
+                if (n + 1 < sizeof(section)) section[n++] = '.';
+                while (*p && *p != '"' && n + 1 < sizeof(section)) {
+                    if (*p == '\\' && p[1]) p++;
+                    section[n++] = *p++;
+                }
+            }
+            section[n] = '\0';
+            continue;
+        }
+
+        // name [= value]
+        size_t n = 0;
+        n = snprintf(key, sizeof(key), "%s.", section);
+        while ((isalnum((unsigned char)*p) || *p == '-') && n + 1 < sizeof(key)) {
+            key[n++] = (char)tolower((unsigned char)*p);
+            p++;
+        }
+        key[n] = '\0';
+        while (*p == ' ' || *p == '\t') p++;
+
+        if (value_cap < strlen(p) + 1) {
+            value_cap = strlen(p) + 1;
+            value = realloc(value, value_cap);
+        }
+        if (*p == '=') {
+            parse_git_config_value(p + 1, value, value_cap);
+        } else {
+            strcpy(value, "true");  // a bare name is a boolean true
+        }
+
+        if (strcmp(key, "include.path") == 0 && depth < 10) {
+            char include_path[PATH_MAX];
+            if (value[0] == '~' && value[1] == '/' && getenv("HOME")) {
+                snprintf(include_path, sizeof(include_path), "%s%s", getenv("HOME"), value + 1);
+            } else if (value[0] == '/') {
+                snprintf(include_path, sizeof(include_path), "%s", value);
+            } else {
+                // Relative includes are resolved against the including file
+                const char *slash = strrchr(path, '/');
+                int dir_len = slash ? (int)(slash - path) : 1;
+                snprintf(include_path, sizeof(include_path), "%.*s/%s",
+                         dir_len, slash ? path : ".", value);
+            }
+            load_git_config_depth(cfg, include_path, depth + 1);
+            continue;
+        }
+        add_git_config_entry(cfg, key, value);
+    }
+
+    free(value);
+    free(line);
+    fclose(fp);
+    return 0;
+}
+
+int load_git_config(GitConfig *cfg, const char *path) {
+    return load_git_config_depth(cfg, path, 0);
+}
+
+// Look up a config value; like git, the last definition wins
+const char *git_config_get(const GitConfig *cfg, const char *key) {
+    for (int i = cfg->count - 1; i >= 0; i--) {
+        if (strcmp(cfg->keys[i], key) == 0) return cfg->values[i];
+    }
+    return NULL;
+}
+
+void free_git_config(GitConfig *cfg) {
+    for (int i = 0; i < cfg->count; i++) {
+        free(cfg->keys[i]);
+        free(cfg->values[i]);
+    }
+    free(cfg->keys);
+    free(cfg->values);
+}
+
+// Build "<dir>/<name>" into out. Returns 0, or -1 if it doesn't fit.
+int join_path(char *out, size_t size, const char *dir, const char *name) {
+    int n = snprintf(out, size, "%s/%s", dir, name);
+    return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
+
+// Read a small file into buf, stripping the trailing newline.
+// Returns 0 on success, -1 if it can't be read.
+int read_small_file(const char *path, char *buf, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) return -1;
+    buf[n] = '\0';
+    buf[strcspn(buf, "\r\n")] = '\0';
+    return 0;
+}
+
+// Locate a repo's git directory and the common directory holding its refs
+// and config. For a plain checkout both are <repo>/.git; worktrees and
+// submodules have a .git file ("gitdir: ...") pointing elsewhere, and
+// linked worktrees name their common directory in a commondir file.
+// Returns 0 on success, -1 if the layout isn't recognized.
+int resolve_git_dirs(const char *repo_path, char *git_dir, char *common_dir, size_t size) {
+    char path[PATH_MAX];
+    char line[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/.git", repo_path);
+    if (stat(path, &st) != 0) return -1;
+
+    if (S_ISDIR(st.st_mode)) {
+        snprintf(git_dir, size, "%s", path);
+    } else {
+        if (read_small_file(path, line, sizeof(line)) != 0) return -1;
+        if (strncmp(line, "gitdir: ", 8) != 0) return -1;
+        if (line[8] == '/') {
+            snprintf(git_dir, size, "%s", line + 8);
+        } else {
+            snprintf(git_dir, size, "%s/%s", repo_path, line + 8);
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/commondir", git_dir);
+    if (read_small_file(path, line, sizeof(line)) == 0 && line[0]) {
+        if (line[0] == '/') {
+            snprintf(common_dir, size, "%s", line);
+        } else {
+            snprintf(common_dir, size, "%s/%s", git_dir, line);
+        }
+    } else {
+        snprintf(common_dir, size, "%s", git_dir);
+    }
+    return 0;
+}
+
+// Resolve a ref to its object id (hex), as a loose file or in packed-refs.
+// Symbolic refs are followed a few levels deep. Returns 1 if it exists.
+int resolve_ref(const char *common_dir, const char *refname, char *oid, size_t oid_size) {
+    char path[PATH_MAX];
+    char line[PATH_MAX];
+    char name[PATH_MAX];
+
+    snprintf(name, sizeof(name), "%s", refname);
+    for (int depth = 0; depth < 5; depth++) {
+        if (join_path(path, sizeof(path), common_dir, name) != 0) break;
+        if (read_small_file(path, line, sizeof(line)) != 0) break;
+        if (strncmp(line, "ref: ", 5) != 0) {
+            if (line[0] == '\0') return 0;
+            snprintf(oid, oid_size, "%s", line);
+            return 1;
+        }
+        snprintf(name, sizeof(name), "%s", line + 5);
+    }
+
+    snprintf(path, sizeof(path), "%s/packed-refs", common_dir);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+
+    char *entry = NULL;
+    size_t entry_cap = 0;
+    ssize_t entry_len;
+    int found = 0;
+    size_t name_len = strlen(name);
+    while ((entry_len = getline(&entry, &entry_cap, fp)) > 0) {
+        // "<oid> <refname>"; '#' is the header, '^' a peeled tag
+        if (entry[0] == '#' || entry[0] == '^') continue;
+        char *space = strchr(entry, ' ');
+        if (!space) continue;
+        char *ref = space + 1;
+        ref[strcspn(ref, "\r\n")] = '\0';
+        if (strlen(ref) == name_len && strcmp(ref, name) == 0) {
+            *space = '\0';
+            snprintf(oid, oid_size, "%s", entry);
+            found = 1;
+            break;
+        }
+    }
+    free(entry);
+    fclose(fp);
+    return found;
+}
+
+int ref_exists(const char *common_dir, const char *refname) {
+    char oid[128];
+    return resolve_ref(common_dir, refname, oid, sizeof(oid));
+}
+
+// Map a branch's merge ref through the remote's fetch refspecs to the
+// remote-tracking ref it is fetched into
+int map_fetch_refspec(const GitConfig *cfg, const char *remote, const char *merge,
+                      char *out, size_t size) {
+    char key[512];
+    int mapped = 0;
+    snprintf(key, sizeof(key), "remote.%s.fetch", remote);
+
+    for (int i = 0; i < cfg->count && !mapped; i++) {
+        if (strcmp(cfg->keys[i], key) != 0) continue;
+        const char *spec = cfg->values[i];
+        if (*spec == '+') spec++;
+        const char *colon = strchr(spec, ':');
+        if (!colon) continue;
+
+        size_t src_len = colon - spec;
+        const char *dst = colon + 1;
+        const char *src_star = memchr(spec, '*', src_len);
+        const char *dst_star = strchr(dst, '*');
+
+        if (!src_star && !dst_star) {
+            if (strlen(merge) == src_len && strncmp(merge, spec, src_len) == 0) {
+                snprintf(out, size, "%s", dst);
+                mapped = 1;
+            }
+        } else if (src_star && dst_star) {
+            size_t prefix = src_star - spec;
+            size_t suffix = src_len - prefix - 1;
+            size_t merge_len = strlen(merge);
+            if (merge_len >= prefix + suffix &&
+                strncmp(merge, spec, prefix) == 0 &&
+                strncmp(merge + merge_len - suffix, src_star + 1, suffix) == 0) {
+                snprintf(out, size, "%.*s%.*s%s",
+                         (int)(dst_star - dst), dst,
+                         (int)(merge_len - prefix - suffix), merge + prefix,
+                         dst_star + 1);
+                mapped = 1;
+            }
+        }
+    }
+    return mapped;
+}
+
+// Read branch, upstream, remote URL and push status straight from the git
+// directory, without spawning git. Returns 1 if all of them could be
+// determined, or 0 if git has to be asked instead (e.g. reftable refs).
+int read_branch_info(const char *repo_path, GitRepo *repo) {
+    char git_dir[PATH_MAX];
+    char common_dir[PATH_MAX];
+    char path[PATH_MAX];
+    char head[PATH_MAX];
+
+    if (resolve_git_dirs(repo_path, git_dir, common_dir, sizeof(git_dir)) != 0) return 0;
+
+    GitConfig cfg;
+    init_git_config(&cfg);
+    if (join_path(path, sizeof(path), common_dir, "config") != 0 ||
+        load_git_config(&cfg, path) != 0) {
+        free_git_config(&cfg);
+        return 0;
+    }
+    const char *ref_storage = git_config_get(&cfg, "extensions.refstorage");
+    if (ref_storage && strcmp(ref_storage, "files") != 0) {
+        free_git_config(&cfg);
+        return 0;
+    }
+
+    // HEAD lives in the per-worktree git dir
+    if (join_path(path, sizeof(path), git_dir, "HEAD") != 0 ||
+        read_small_file(path, head, sizeof(head)) != 0) {
+        free_git_config(&cfg);
+        return 0;
+    }
+    const char *branch = NULL;
+    if (strncmp(head, "ref: refs/heads/", 16) == 0) {
+        branch = head + 16;
+        repo->branch = arena_strdup(&repo->arena, branch);
+    } else {
+        repo->branch = arena_strdup(&repo->arena, "HEAD");  // detached, like rev-parse --abbrev-ref
+    }
+
+    const char *url = git_config_get(&cfg, "remote.origin.url");
+    if (url && url[0]) {
+        repo->remote_url = arena_strdup(&repo->arena, url);
+        repo->has_remote = 1;
+    }
+
+    if (branch) {
+        // Upstream from branch.<name>.remote / branch.<name>.merge
+        char key[PATH_MAX + 32];
+        snprintf(key, sizeof(key), "branch.%s.remote", branch);
+        const char *remote = git_config_get(&cfg, key);
+        snprintf(key, sizeof(key), "branch.%s.merge", branch);
+        const char *merge = git_config_get(&cfg, key);
+
+        char tracking[PATH_MAX];
+        int have_tracking = 0;
+        if (remote && merge) {
+            if (strcmp(remote, ".") == 0) {
+                snprintf(tracking, sizeof(tracking), "%s", merge);
+                have_tracking = 1;
+            } else {
+                have_tracking = map_fetch_refspec(&cfg, remote, merge, tracking, sizeof(tracking));
+            }
+        }
+        if (have_tracking && ref_exists(common_dir, tracking)) {
+            const char *shortname = tracking;
+            if (strncmp(shortname, "refs/remotes/", 13) == 0) shortname += 13;
+            else if (strncmp(shortname, "refs/heads/", 11) == 0) shortname += 11;
+            repo->remote_branch = arena_strdup(&repo->arena, shortname);
+            repo->is_pushed = 1;  // Branch has upstream, so it's been pushed
+        }
+
+        // If no tracking branch but has remote, check cached origin/<branch>
+        if (!repo->is_pushed && repo->has_remote) {
+            if (join_path(path, sizeof(path), "refs/remotes/origin", branch) == 0 &&
+                ref_exists(common_dir, path)) {
+                repo->is_pushed = 1;
+            }
+        }
+    }
+
+    free_git_config(&cfg);
+    return 1;
+}
+
+// Fallback for repos read_branch_info can't handle: ask git for the remote
+// and push status. Branch, upstream and ahead/behind have already been
+// taken from `git status --porcelain=v2 --branch`.
+void get_branch_info(const char *repo_path, GitRepo *repo, Buffer *out) {
+    const char *url_args[] = {"remote", "get-url", "origin", NULL};
+    if (run_git(repo_path, url_args, NULL, 0, out) == 0) {
+        const char *url = buffer_first_line(out);
+        if (url[0]) {
+            repo->remote_url = arena_strdup(&repo->arena, url);
+            repo->has_remote = 1;
+        }
+    }
+
+    // If no tracking branch but has remote, check local refs for origin/<branch>
+    // This avoids network calls by checking cached remote-tracking refs
+    if (!repo->is_pushed && repo->has_remote && repo->branch) {
+        char ref[PATH_MAX];
+        snprintf(ref, sizeof(ref), "refs/remotes/origin/%s", repo->branch);
+        const char *args[] = {"rev-parse", "--verify", "--quiet", ref, NULL};
+        if (run_git(repo_path, args, NULL, 0, out) == 0 && out->len > 1) {
+            repo->is_pushed = 1;  // Branch exists in cached remote refs
+        }
+    }
+}
+
+// Open-addressing hash set of strings, used to index tracked paths
+typedef struct {
+    char **slots;
+    size_t capacity;   // always a power of two
+    size_t count;
+} StringSet;
+
+void init_string_set(StringSet *set) {
+    set->capacity = 64;
+    set->count = 0;
+    set->slots = calloc(set->capacity, sizeof(char *));
+}
+
+size_t string_set_slot(const StringSet *set, const char *s, size_t len) {
+    size_t mask = set->capacity - 1;
+    size_t i = hash_bytes(s, len) & mask;
+    while (set->slots[i] &&
+           (strncmp(set->slots[i], s, len) != 0 || set->slots[i][len] != '\0')) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+int string_set_contains(const StringSet *set, const char *s, size_t len) {
+    return set->slots[string_set_slot(set, s, len)] != NULL;
+}
+
+// Add the first len bytes of s; returns 1 if it wasn't present yet
+int string_set_add(StringSet *set, const char *s, size_t len) {
+    if ((set->count + 1) * 2 > set->capacity) {
+        char **old = set->slots;
+        size_t old_capacity = set->capacity;
+        set->capacity *= 2;
+        set->slots = calloc(set->capacity, sizeof(char *));
+        if (!set->slots) {
+            fprintf(stderr, "Failed to allocate memory for path set\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i]) set->slots[string_set_slot(set, old[i], strlen(old[i]))] = old[i];
+        }
+        free(old);
+    }
+
+    size_t i = string_set_slot(set, s, len);
+    if (set->slots[i]) return 0;
+    set->slots[i] = strndup(s, len);
+    set->count++;
+    return 1;
+}
+
+void free_string_set(StringSet *set) {
+    for (size_t i = 0; i < set->capacity; i++) free(set->slots[i]);
+    free(set->slots);
+}
+
+#define OID_RAW_SIZE 20
+#define OID_HEX_SIZE 40
+
+#ifdef __APPLE__
+#define ST_MTIME_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#define ST_CTIME_NSEC(st) ((st).st_ctimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st) ((st).st_mtim.tv_nsec)
+#define ST_CTIME_NSEC(st) ((st).st_ctim.tv_nsec)
+#endif
+
+uint32_t get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+int hex_to_oid(const char *hex, unsigned char *oid) {
+    for (int i = 0; i < OID_RAW_SIZE; i++) {
+        unsigned int byte;
+        if (!isxdigit((unsigned char)hex[i * 2]) || !isxdigit((unsigned char)hex[i * 2 + 1])) return -1;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) return -1;
+        oid[i] = (unsigned char)byte;
+    }
+    return 0;
+}
+
+// Inflate the start of a zlib stream; only object headers are needed
+size_t inflate_prefix(const unsigned char *in, size_t in_len, char *out, size_t out_size) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) return 0;
+    zs.next_in = (unsigned char *)in;
+    zs.avail_in = in_len;
+    zs.next_out = (unsigned char *)out;
+    zs.avail_out = out_size;
+    int ret = inflate(&zs, Z_SYNC_FLUSH);
+    size_t produced = out_size - zs.avail_out;
+    inflateEnd(&zs);
+    return (ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR) ? produced : 0;
+}
+
+// Parse "tree <hex>" at the start of a commit body
+int parse_commit_tree(const char *body, size_t len, unsigned char *tree_oid) {
+    if (len < 5 + OID_HEX_SIZE || strncmp(body, "tree ", 5) != 0) return -1;
+    return hex_to_oid(body + 5, tree_oid);
+}
+
+// Look up an object in a version 2 pack index.
+// Returns its offset in the pack, or -1 if it isn't there.
+int64_t pack_index_lookup(const char *idx_path, const unsigned char *oid) {
+    int fd = open(idx_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 8 + 1024) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    int64_t offset = -1;
+    const unsigned char *fanout = map + 8;
+    if (memcmp(map, "\377tOc", 4) == 0 && get_be32(map + 4) == 2) {
+        uint32_t count = get_be32(fanout + 255 * 4);
+        uint32_t lo = oid[0] ? get_be32(fanout + (oid[0] - 1) * 4) : 0;
+        uint32_t hi = get_be32(fanout + oid[0] * 4);
+        const unsigned char *oids = fanout + 1024;
+        const unsigned char *offsets = oids + (size_t)count * (OID_RAW_SIZE + 4);
+        if ((size_t)(offsets - map) + (size_t)count * 4 <= size) {
+            while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                int cmp = memcmp(oids + (size_t)mid * OID_RAW_SIZE, oid, OID_RAW_SIZE);
+                if (cmp == 0) {
+                    uint32_t off = get_be32(offsets + (size_t)mid * 4);
+                    if (off & 0x80000000U) {
+                        // Index into the table of 64-bit offsets
+                        const unsigned char *large = offsets + (size_t)count * 4 + (size_t)(off & 0x7fffffffU) * 8;
+                        if ((size_t)(large - map) + 8 <= size) {
+                            offset = ((int64_t)get_be32(large) << 32) | get_be32(large + 4);
+                        }
+                    } else {
+                        offset = off;
+                    }
+                    break;
+                }
+                if (cmp < 0) lo = mid + 1;
+                else hi = mid;
+            }
+        }
+    }
+    munmap(map, size);
+    return offset;
+}
+
+// Find the tree of a commit by reading the object database directly. Only
+// loose objects and undeltified packed commits are understood; anything
+// else returns -1 so the caller can fall back to git.
+int read_commit_tree(const char *objects_dir, const unsigned char *commit_oid,
+                     unsigned char *tree_oid, int depth) {
+    char path[PATH_MAX];
+    unsigned char raw[4096];
+    char body[256];
+    static const char hex[] = "0123456789abcdef";
+    char oid_hex[OID_HEX_SIZE + 1];
+    for (int i = 0; i < OID_RAW_SIZE; i++) {
+        oid_hex[i * 2] = hex[commit_oid[i] >> 4];
+        oid_hex[i * 2 + 1] = hex[commit_oid[i] & 15];
+    }
+    oid_hex[OID_HEX_SIZE] = '\0';
+
+    // Loose object: zlib("commit <size>\0tree <hex>\n...")
+    snprintf(path, sizeof(path), "%s/%.2s/%s", objects_dir, oid_hex, oid_hex + 2);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t n = read(fd, raw, sizeof(raw));
+        close(fd);
+        if (n <= 0) return -1;
+        size_t len = inflate_prefix(raw, n, body, sizeof(body) - 1);
+        body[len] = '\0';
+        if (strncmp(body, "commit ", 7) != 0) return -1;
+        size_t header = strlen(body) + 1;
+        if (header >= len) return -1;
+        return parse_commit_tree(body + header, len - header, tree_oid);
+    }
+
+    // Packed object
+    snprintf(path, sizeof(path), "%s/pack", objects_dir);
+    DIR *dir = opendir(path);
+    if (dir) {
+        struct dirent *entry;
+        int result = 1;  // 1: not found yet
+        while (result == 1 && (entry = readdir(dir)) != NULL) {
+            size_t name_len = strlen(entry->d_name);
+            if (name_len < 5 || strcmp(entry->d_name + name_len - 4, ".idx") != 0) continue;
+
+            snprintf(path, sizeof(path), "%s/pack/%s", objects_dir, entry->d_name);
+            int64_t offset = pack_index_lookup(path, commit_oid);
+            if (offset < 0) continue;
+
+            result = -1;
+            snprintf(path, sizeof(path), "%s/pack/%.*s.pack", objects_dir,
+                     (int)(name_len - 4), entry->d_name);
+            int pack_fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (pack_fd < 0) break;
+            ssize_t n = pread(pack_fd, raw, sizeof(raw), offset);
+            close(pack_fd);
+            if (n <= 0) break;
+
+            // Object header: type in bits 4-6 of the first byte, then a
+            // little-endian size varint. Commits are type 1; deltas are
+            // left to git.
+            int type = (raw[0] >> 4) & 7;
+            ssize_t pos = 1;
+            if (raw[0] & 0x80) {
+                while (pos < n && (raw[pos] & 0x80)) pos++;
+                pos++;
+            }
+            if (type != 1 || pos >= n) break;
+            size_t len = inflate_prefix(raw + pos, n - pos, body, sizeof(body) - 1);
+            if (parse_commit_tree(body, len, tree_oid) == 0) result = 0;
+        }
+        closedir(dir);
+        if (result != 1) return result;
+    }
+
+    // Borrowed objects from alternates
+    if (depth < 5) {
+        snprintf(path, sizeof(path), "%s/info/alternates", objects_dir);
+        FILE *fp = fopen(path, "r");
+        if (fp) {
+            char line[PATH_MAX];
+            int result = -1;
+            while (result != 0 && fgets(line, sizeof(line), fp)) {
+                line[strcspn(line, "\r\n")] = '\0';
+                if (line[0] == '\0' || line[0] == '#') continue;
+                char alt[PATH_MAX];
+                if (line[0] == '/') snprintf(alt, sizeof(alt), "%s", line);
+                else if (join_path(alt, sizeof(alt), objects_dir, line) != 0) continue;
+                result = read_commit_tree(alt, commit_oid, tree_oid, depth + 1);
+            }
+            fclose(fp);
+            return result;
+        }
+    }
+    return -1;
+}
+
+// Index entry layout (versions 2-4)
+#define INDEX_ENTRY_FIXED   62      // stat data, object id and flags
+#define CE_ASSUME_VALID     0x8000
+#define CE_EXTENDED         0x4000
+#define CE_STAGE_MASK       0x3000
+#define CE_NAME_MASK        0x0fff
+#define CE_SKIP_WORKTREE    0x4000  // extended flags
+#define CE_INTENT_TO_ADD    0x2000  // extended flags
+#define GITLINK_MODE        0160000
+#define SYMLINK_MODE        0120000
+
+// Result of comparing a repo's index against its worktree
+typedef struct {
+    int clean;            // certainly clean, no need to run git
+    int cacheable;        // stat data can be trusted to key a scan cache entry
+    uint64_t digest;      // order-independent hash of the worktree's stat data
+    int64_t index_mtime;  // nanoseconds
+    int64_t index_size;
+    uint64_t head_hash;   // HEAD contents and the commit it points at
+    uint32_t entries;     // index entries, a proxy for what git status costs
+} IndexScan;
+
+uint64_t hash_mix(uint64_t h, uint64_t v) {
+    h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    return h * 1099511628211ULL;
+}
+
+int64_t stat_mtime_ns(const struct stat *st) {
+    return (int64_t)st->st_mtime * 1000000000LL + ST_MTIME_NSEC(*st);
+}
+
+// Gitignore rule flags
+#define IGNORE_NEGATE    1   // "!pattern": re-includes what earlier rules exclude
+#define IGNORE_DIR_ONLY  2   // "pattern/": only matches directories
+#define IGNORE_BASENAME  4   // no slash: matched against the last path component
+#define IGNORE_ENDSWITH  8   // "*literal": a plain suffix compare
+#define IGNORE_BUCKETED  16  // found through the list's hash buckets, not the scan
+
+typedef struct {
+    const char *pattern;   // without "!", a leading "/" or a trailing "/"
+    int len;
+    int prefix;            // length of the literal part before any glob character
+    int flags;
+    int next;              // earlier rule in the same bucket, or -1
+} IgnoreRule;
+
+// Rules from one ignore file, in file order; the last matching rule wins.
+// base is the directory the file sits in, "" or ending in "/".
+typedef struct {
+    const char *base;
+    int base_len;
+    IgnoreRule *rules;
+    int count;
+    int capacity;
+    int *buckets;          // rule index + 1, by literal name or "*.ext" suffix
+    int bucket_mask;       // bucket count minus one, -1 without buckets
+} IgnoreList;
+
+// A repo's ignore rules: core.excludesFile, info/exclude and the
+// .gitignore of every directory looked at so far, each read once
+typedef struct {
+    Arena arena;
+    const char *root;      // worktree
+    IgnoreList *lists;     // 0: core.excludesFile, 1: info/exclude, then directories
+    int count;
+    int capacity;
+    int *dirs;             // list index + 1 by directory, open addressing
+    int dir_mask;
+    int dir_count;
+    int icase;             // core.ignoreCase
+    int loaded;            // config read: 1, or -1 if it can't be followed here
+} IgnoreMatcher;
+
+// wild_match() results, as in git's wildmatch
+#define WILD_MATCH              0
+#define WILD_NOMATCH            1
+#define WILD_ABORT_ALL          -1
+#define WILD_ABORT_TO_STARSTAR  -2
+
+int is_glob_special(unsigned char c) {
+    return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+unsigned char fold_case(unsigned char c, int icase) {
+    return icase && isupper(c) ? (unsigned char)tolower(c) : c;
+}
+
+// Does c belong to the [:name:] class (name is len bytes)? -1 if there's
+// no such class
+int match_char_class(const unsigned char *name, int len, unsigned char c, int icase) {
+    static const struct {
+        const char *name;
+        int (*test)(int);
+    } classes[] = {
+        {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+        {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+        {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+    };
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+        if ((int)strlen(classes[i].name) != len || memcmp(classes[i].name, name, len) != 0) continue;
+        if (classes[i].test(c)) return 1;
+        // Case folding lets [:upper:] match lower case letters too
+        return icase && classes[i].test == isupper && islower(c);
+    }
+    return -1;
+}
+
+// Match text against a gitignore glob, the way git's wildmatch does with
+// WM_PATHNAME: "*", "?" and "[...]" stop at "/", while "**" between
+// slashes spans directories. An abort tells the "*" loops of the callers
+// that no longer texts can match either.
+int wild_match(const unsigned char *pattern, const unsigned char *p, const unsigned char *text, int icase) {
+    for (; *p; text++, p++) {
+        unsigned char t_ch = fold_case(*text, icase);
+        unsigned char p_ch = fold_case(*p, icase);
+        if (!t_ch && p_ch != '*') return WILD_ABORT_ALL;
+
+        switch (p_ch) {
+            case '\\':
+                p_ch = fold_case(*++p, icase);
+                if (t_ch != p_ch) return WILD_NOMATCH;
+                continue;
+            case '?':
+                if (t_ch == '/') return WILD_NOMATCH;
+                continue;
+            case '*': {
+                int match_slash = 0;
+                if (*++p == '*') {
+                    const unsigned char *prev = p - 2;
+                    while (*++p == '*') {}
+                    if ((prev < pattern || *prev == '/') &&
+                        (!*p || *p == '/' || (p[0] == '\\' && p[1] == '/'))) {
+                        // "**/" may match no directories at all
+                        if (p[0] == '/' && wild_match(pattern, p + 1, text, icase) == WILD_MATCH) {
+                            return WILD_MATCH;
+                        }
+                        match_slash = 1;
+                    }
+                }
+                if (!*p) {
+                    if (!match_slash && strchr((const char *)text, '/')) return WILD_NOMATCH;
+                    return WILD_MATCH;
+                }
+                if (!match_slash && *p == '/') {
+                    const char *slash = strchr((const char *)text, '/');
+                    if (!slash) return WILD_NOMATCH;
+                    text = (const unsigned char *)slash;
+                    break;  // the loop consumes the slash
+                }
+                while (t_ch) {
+                    // Skip ahead to the next literal character
+                    if (!is_glob_special(*p)) {
+                        p_ch = fold_case(*p, icase);
+                        while ((t_ch = fold_case(*text, icase)) && (match_slash || t_ch != '/')) {
+                            if (t_ch == p_ch) break;
+                            text++;
+                        }
+                        if (t_ch != p_ch) return WILD_NOMATCH;
+                    }
+                    int matched = wild_match(pattern, p, text, icase);
+                    if (matched != WILD_NOMATCH) {
+                        if (!match_slash || matched != WILD_ABORT_TO_STARSTAR) return matched;
+                    } else if (!match_slash && t_ch == '/') {
+                        return WILD_ABORT_TO_STARSTAR;
+                    }
+                    t_ch = fold_case(*++text, icase);
+                }
+                return WILD_ABORT_ALL;
+            }
+            case '[': {
+                p_ch = *++p;
+                if (p_ch == '^') p_ch = '!';
+                int negated = p_ch == '!';
+                if (negated) p_ch = *++p;
+                unsigned char prev_ch = 0;
+                int matched = 0;
+                do {
+                    if (!p_ch) return WILD_ABORT_ALL;
+                    if (p_ch == '\\') {
+                        p_ch = *++p;
+                        if (!p_ch) return WILD_ABORT_ALL;
+                        if (t_ch == fold_case(p_ch, icase)) matched = 1;
+                    } else if (p_ch == '-' && prev_ch && p[1] && p[1] != ']') {
+                        p_ch = *++p;
+                        if (p_ch == '\\') {
+                            p_ch = *++p;
+                            if (!p_ch) return WILD_ABORT_ALL;
+                        }
+                        if (t_ch <= p_ch && t_ch >= prev_ch) {
+                            matched = 1;
+                        } else if (icase && islower(t_ch)) {
+                            unsigned char upper = (unsigned char)toupper(t_ch);
+                            if (upper <= p_ch && upper >= prev_ch) matched = 1;
+                        }
+                        p_ch = 0;  // a range can't start another one
+                    } else if (p_ch == '[' && p[1] == ':') {
+                        const unsigned char *name = p += 2;
+                        while ((p_ch = *p) && p_ch != ']') p++;
+                        if (!p_ch) return WILD_ABORT_ALL;
+                        int len = (int)(p - name) - 1;
+                        if (len < 0 || p[-1] != ':') {
+                            // No ":]", so the "[" is just a character
+                            p = name - 2;
+                            p_ch = '[';
+                            if (t_ch == p_ch) matched = 1;
+                            continue;
+                        }
+                        int in_class = match_char_class(name, len, t_ch, icase);
+                        if (in_class < 0) return WILD_ABORT_ALL;
+                        if (in_class) matched = 1;
+                        p_ch = 0;
+                    } else if (t_ch == fold_case(p_ch, icase)) {
+                        matched = 1;
+                    }
+                } while (prev_ch = p_ch, (p_ch = *++p) != ']');
+                if (matched == negated || t_ch == '/') return WILD_NOMATCH;
+                continue;
+            }
+            default:
+                if (t_ch != p_ch) return WILD_NOMATCH;
+                continue;
+        }
+    }
+    return *text ? WILD_NOMATCH : WILD_MATCH;
+}
+
+int glob_matches(const char *pattern, const char *text, int icase) {
+    const unsigned char *p = (const unsigned char *)pattern;
+    return wild_match(p, p, (const unsigned char *)text, icase) == WILD_MATCH;
+}
+
+int bytes_equal(const char *a, const char *b, int len, int icase) {
+    if (!icase) return memcmp(a, b, len) == 0;
+    for (int i = 0; i < len; i++) {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return 0;
+    }
+    return 1;
+}
+
+// Drop trailing spaces, unless they're escaped with a backslash
+void trim_ignore_spaces(char *s) {
+    char *last_space = NULL;
+    for (char *p = s; *p; p++) {
+        if (*p == ' ') {
+            if (!last_space) last_space = p;
+            continue;
+        }
+        if (*p == '\\' && !*++p) return;
+        last_space = NULL;
+    }
+    if (last_space) *last_space = '\0';
+}
+
+// The part of a bucketed rule it's looked up by: the whole name, or the
+// ".ext" of "*.ext"
+const char *ignore_rule_key(const IgnoreRule *rule, int *len) {
+    if (rule->flags & IGNORE_ENDSWITH) {
+        *len = rule->len - 1;
+        return rule->pattern + 1;
+    }
+    *len = rule->len;
+    return rule->pattern;
+}
+
+// Parse an ignore file's contents into list. buf must have room for one
+// more byte than len.
+void parse_ignore_rules(IgnoreMatcher *m, IgnoreList *list, char *buf, size_t len) {
+    if (len >= 3 && memcmp(buf, "\xef\xbb\xbf", 3) == 0) {
+        buf += 3;
+        len -= 3;
+    }
+    buf[len] = '\0';
+
+    char *line = buf;
+    while (line < buf + len) {
+        char *nl = memchr(line, '\n', buf + len - line);
+        char *end = nl ? nl : buf + len;
+        char *p = line;
+        line = end + 1;
+        if (end > p && end[-1] == '\r') end--;
+        *end = '\0';
+        if (p[0] == '#') continue;
+        trim_ignore_spaces(p);
+
+        int flags = 0;
+        if (*p == '!') {
+            flags |= IGNORE_NEGATE;
+            p++;
+        }
+        int n = strlen(p);
+        if (n && p[n - 1] == '/') {
+            flags |= IGNORE_DIR_ONLY;
+            n--;
+        }
+        if (!memchr(p, '/', n)) flags |= IGNORE_BASENAME;
+        int prefix = 0;
+        while (prefix < n && !is_glob_special(p[prefix])) prefix++;
+        if (p[0] == '*') {
+            int i = 1;
+            while (i < n && !is_glob_special(p[i])) i++;
+            if (i == n) flags |= IGNORE_ENDSWITH;
+        }
+        // A leading slash only anchors the pattern, as any inner one does
+        if (!(flags & IGNORE_BASENAME) && p[0] == '/') {
+            p++;
+            n--;
+            prefix--;
+        }
+        if (n == 0) continue;
+
+        if (list->count >= list->capacity) {
+            list->capacity = list->capacity ? list->capacity * 2 : 16;
+            list->rules = realloc(list->rules, list->capacity * sizeof(IgnoreRule));
+            if (!list->rules) {
+                fprintf(stderr, "Failed to allocate memory for ignore rules\n");
+                exit(1);
+            }
+        }
+        IgnoreRule *rule = &list->rules[list->count++];
+        rule->pattern = arena_strndup(&m->arena, p, n);
+        rule->len = n;
+        rule->prefix = prefix;
+        rule->flags = flags;
+        rule->next = -1;
+    }
+
+    // Literal names and "*.ext" rules go into hash buckets, so a path only
+    // has to be compared against the rules that can match it
+    int bucketed = 0;
+    for (int i = 0; i < list->count && !m->icase; i++) {
+        IgnoreRule *rule = &list->rules[i];
+        if ((rule->flags & IGNORE_BASENAME) &&
+            (rule->prefix == rule->len || ((rule->flags & IGNORE_ENDSWITH) && rule->pattern[1] == '.'))) {
+            rule->flags |= IGNORE_BUCKETED;
+            bucketed++;
+        }
+    }
+    if (bucketed == 0) return;
+
+    int size = 16;
+    while (size < bucketed * 2) size *= 2;
+    list->buckets = calloc(size, sizeof(int));
+    if (!list->buckets) {
+        fprintf(stderr, "Failed to allocate memory for ignore rules\n");
+        exit(1);
+    }
+    list->bucket_mask = size - 1;
+    for (int i = 0; i < list->count; i++) {
+        IgnoreRule *rule = &list->rules[i];
+        if (!(rule->flags & IGNORE_BUCKETED)) continue;
+        int key_len;
+        const char *key = ignore_rule_key(rule, &key_len);
+        size_t slot = hash_bytes(key, key_len) & list->bucket_mask;
+        while (list->buckets[slot]) {
+            int other_len;
+            const char *other = ignore_rule_key(&list->rules[list->buckets[slot] - 1], &other_len);
+            if (other_len == key_len && memcmp(other, key, key_len) == 0) break;
+            slot = (slot + 1) & list->bucket_mask;
+        }
+        rule->next = list->buckets[slot] - 1;
+        list->buckets[slot] = i + 1;
+    }
+}
+
+// Read an ignore file into list; a missing file just adds no rules
+void load_ignore_file(IgnoreMatcher *m, IgnoreList *list, const char *path, int nofollow) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC | (nofollow ? O_NOFOLLOW : 0));
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return;
+    }
+    char *buf = malloc(st.st_size + 1);
+    if (!buf) {
+        fprintf(stderr, "Failed to allocate memory for ignore rules\n");
+        exit(1);
+    }
+    size_t len = 0;
+    while (len < (size_t)st.st_size) {
+        ssize_t n = read(fd, buf + len, st.st_size - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+    }
+    close(fd);
+    parse_ignore_rules(m, list, buf, len);
+    free(buf);
+}
+
+int add_ignore_list(IgnoreMatcher *m, const char *base, int base_len) {
+    if (m->count >= m->capacity) {
+        m->capacity = m->capacity ? m->capacity * 2 : 16;
+        m->lists = realloc(m->lists, m->capacity * sizeof(IgnoreList));
+        if (!m->lists) {
+            fprintf(stderr, "Failed to allocate memory for ignore rules\n");
+            exit(1);
+        }
+    }
+    IgnoreList *list = &m->lists[m->count];
+    memset(list, 0, sizeof(*list));
+    list->base = arena_strndup(&m->arena, base, base_len);
+    list->base_len = base_len;
+    list->bucket_mask = -1;
+    return m->count++;
+}
+
+// The list for the .gitignore in dir ("" or ending in "/"), read the
+// first time the directory comes up
+int ignore_dir_list(IgnoreMatcher *m, const char *dir, int len) {
+    size_t slot = hash_bytes(dir, len) & m->dir_mask;
+    while (m->dirs[slot]) {
+        const IgnoreList *list = &m->lists[m->dirs[slot] - 1];
+        if (list->base_len == len && memcmp(list->base, dir, len) == 0) return m->dirs[slot] - 1;
+        slot = (slot + 1) & m->dir_mask;
+    }
+
+    int index = add_ignore_list(m, dir, len);
+    char path[PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s/%.*s.gitignore", m->root, len, dir);
+    // Like git, a .gitignore that's a symlink isn't followed
+    if (n > 0 && (size_t)n < sizeof(path)) load_ignore_file(m, &m->lists[index], path, 1);
+
+    m->dirs[slot] = index + 1;
+    if (++m->dir_count * 2 > m->dir_mask + 1) {
+        int size = (m->dir_mask + 1) * 2;
+        int *dirs = calloc(size, sizeof(int));
+        if (!dirs) {
+            fprintf(stderr, "Failed to allocate memory for ignore rules\n");
+            exit(1);
+        }
+        for (int i = 0; i <= m->dir_mask; i++) {
+            if (!m->dirs[i]) continue;
+            const IgnoreList *list = &m->lists[m->dirs[i] - 1];
+            size_t s = hash_bytes(list->base, list->base_len) & (size - 1);
+            while (dirs[s]) s = (s + 1) & (size - 1);
+            dirs[s] = m->dirs[i];
+        }
+        free(m->dirs);
+        m->dirs = dirs;
+        m->dir_mask = size - 1;
+    }
+    return index;
+}
+
+int ignore_path_is_dir(const IgnoreMatcher *m, const char *path) {
+    char full[PATH_MAX];
+    struct stat st;
+    if (join_path(full, sizeof(full), m->root, path) != 0 || lstat(full, &st) != 0) return 0;
+    return S_ISDIR(st.st_mode);
+}
+
+// Does rule match path (len bytes, NUL-terminated there, last component at
+// name_off)? *is_dir is looked up when a directory-only rule needs it.
+int ignore_rule_matches(const IgnoreMatcher *m, const IgnoreList *list, const IgnoreRule *rule,
+                        const char *path, int len, int name_off, int *is_dir) {
+    if (rule->flags & IGNORE_DIR_ONLY) {
+        if (*is_dir < 0) *is_dir = ignore_path_is_dir(m, path);
+        if (!*is_dir) return 0;
+    }
+
+    if (rule->flags & IGNORE_BASENAME) {
+        const char *name = path + name_off;
+        int name_len = len - name_off;
+        if (rule->prefix == rule->len) {
+            return name_len == rule->len && bytes_equal(rule->pattern, name, name_len, m->icase);
+        }
+        if (rule->flags & IGNORE_ENDSWITH) {
+            return rule->len - 1 <= name_len &&
+                   bytes_equal(rule->pattern + 1, name + name_len - (rule->len - 1), rule->len - 1, m->icase);
+        }
+        return glob_matches(rule->pattern, name, m->icase);
+    }
+
+    // Anything with a slash is relative to the ignore file's directory
+    if (list->base_len ? (len < list->base_len || !bytes_equal(path, list->base, list->base_len, m->icase))
+                       : len < 1) {
+        return 0;
+    }
+    const char *rest = path + list->base_len;
+    int rest_len = len - list->base_len;
+    if (rule->prefix) {
+        if (rule->prefix > rest_len || !bytes_equal(rule->pattern, rest, rule->prefix, m->icase)) return 0;
+        if (rule->prefix == rule->len && rest_len == rule->prefix) return 1;
+    }
+    return glob_matches(rule->pattern + rule->prefix, rest + rule->prefix, m->icase);
+}
+
+// The last rule of list that matches path, or -1
+int ignore_list_match(const IgnoreMatcher *m, const IgnoreList *list, const char *path, int len,
+                      int name_off, int *is_dir) {
+    int best = -1;
+    if (list->bucket_mask >= 0) {
+        // Look up the basename, and each of its suffixes from a "."
+        const char *name = path + name_off;
+        int name_len = len - name_off;
+        for (int k = 0; k < name_len; k++) {
+            if (k > 0 && name[k] != '.') continue;
+            size_t slot = hash_bytes(name + k, name_len - k) & list->bucket_mask;
+            while (list->buckets[slot]) {
+                int key_len;
+                const char *key = ignore_rule_key(&list->rules[list->buckets[slot] - 1], &key_len);
+                if (key_len == name_len - k && memcmp(key, name + k, key_len) == 0) break;
+                slot = (slot + 1) & list->bucket_mask;
+            }
+            for (int i = list->buckets[slot] - 1; i > best; i = list->rules[i].next) {
+                if (ignore_rule_matches(m, list, &list->rules[i], path, len, name_off, is_dir)) {
+                    best = i;
+                    break;
+                }
+            }
+        }
+    }
+
+    for (int i = list->count - 1; i > best; i--) {
+        const IgnoreRule *rule = &list->rules[i];
+        if (rule->flags & IGNORE_BUCKETED) continue;
+        if (ignore_rule_matches(m, list, rule, path, len, name_off, is_dir)) return i;
+    }
+    return best;
+}
+
+// Match path against every list that applies to it, nearest .gitignore
+// first and core.excludesFile last. Returns 1 if excluded, 0 if a "!"
+// rule re-includes it, -1 if nothing matched.
+int ignore_lists_match(IgnoreMatcher *m, const char *path, int len, int *is_dir) {
+    const char *slash = memrchr(path, '/', len);
+    int name_off = slash ? (int)(slash - path) + 1 : 0;
+
+    for (int dir_len = name_off;; dir_len--) {
+        if (dir_len == 0 || path[dir_len - 1] == '/') {
+            int index = ignore_dir_list(m, path, dir_len);
+            const IgnoreList *list = &m->lists[index];
+            int i = ignore_list_match(m, list, path, len, name_off, is_dir);
+            if (i >= 0) return !(list->rules[i].flags & IGNORE_NEGATE);
+        }
+        if (dir_len == 0) break;
+    }
+    for (int l = 1; l >= 0; l--) {
+        const IgnoreList *list = &m->lists[l];
+        int i = ignore_list_match(m, list, path, len, name_off, is_dir);
+        if (i >= 0) return !(list->rules[i].flags & IGNORE_NEGATE);
+    }
+    return -1;
+}
+
+int config_bool(const char *value) {
+    return value && (strcasecmp(value, "true") == 0 || strcasecmp(value, "yes") == 0 ||
+                     strcasecmp(value, "on") == 0 || strcmp(value, "1") == 0);
+}
+
+// For settings that default to true: only an explicit false turns them off
+int config_false(const char *value) {
+    return value && (strcasecmp(value, "false") == 0 || strcasecmp(value, "no") == 0 ||
+                     strcasecmp(value, "off") == 0 || strcmp(value, "0") == 0 || !value[0]);
+}
+
+// Load the system, global and repository config, in the order git reads them
+void load_repo_config(GitConfig *cfg, const char *common_dir) {
+    char path[PATH_MAX];
+    const char *home = getenv("HOME");
+    const char *xdg = getenv("XDG_CONFIG_HOME");
+
+    if (!getenv("GIT_CONFIG_NOSYSTEM")) {
+        const char *system = getenv("GIT_CONFIG_SYSTEM");
+        load_git_config(cfg, system ? system : "/etc/gitconfig");
+    }
+    if (getenv("GIT_CONFIG_GLOBAL")) {
+        load_git_config(cfg, getenv("GIT_CONFIG_GLOBAL"));
+    } else {
+        if (xdg && xdg[0]) snprintf(path, sizeof(path), "%s/git/config", xdg);
+        else snprintf(path, sizeof(path), "%s/.config/git/config", home ? home : "");
+        load_git_config(cfg, path);
+        if (home) {
+            snprintf(path, sizeof(path), "%s/.gitconfig", home);
+            load_git_config(cfg, path);
+        }
+    }
+    if (join_path(path, sizeof(path), common_dir, "config") == 0) load_git_config(cfg, path);
+}
+
+// Does any includeIf target (whatever its condition) set one of the keys
+// the matcher depends on?
+int conditional_includes_matter(const GitConfig *cfg) {
+    int matter = 0;
+    for (int i = 0; i < cfg->count && !matter; i++) {
+        size_t len = strlen(cfg->keys[i]);
+        if (strncmp(cfg->keys[i], "includeif.", 10) != 0 || len < 5 ||
+            strcmp(cfg->keys[i] + len - 5, ".path") != 0) {
+            continue;
+        }
+        GitConfig included;
+        init_git_config(&included);
+        const char *value = cfg->values[i];
+        char path[PATH_MAX];
+        if (value[0] == '~' && value[1] == '/' && getenv("HOME")) {
+            snprintf(path, sizeof(path), "%s%s", getenv("HOME"), value + 1);
+        } else {
+            snprintf(path, sizeof(path), "%s", value);
+        }
+        if (value[0] != '/' && value[0] != '~') {
+            matter = 1;  // relative to a file we no longer know
+        } else if (load_git_config(&included, path) == 0 &&
+                   (git_config_get(&included, "core.excludesfile") ||
+                    git_config_get(&included, "core.ignorecase"))) {
+            matter = 1;
+        }
+        free_git_config(&included);
+    }
+    return matter;
+}
+
+// Set up a matcher for repo_path's worktree. Nothing is read until the
+// first path is checked, so an unused matcher costs nothing.
+void init_ignore_matcher(IgnoreMatcher *m, const char *repo_path) {
+    memset(m, 0, sizeof(*m));
+    init_arena(&m->arena);
+    m->root = repo_path;
+}
+
+// Read the config and the global ignore files. Returns -1 if the config
+// can't be followed here (config from the environment, or conditional
+// includes that touch ignore settings); git has to be asked then.
+int load_ignore_config(IgnoreMatcher *m) {
+    char git_dir[PATH_MAX];
+    char common_dir[PATH_MAX];
+    char path[PATH_MAX];
+    const char *home = getenv("HOME");
+    const char *xdg = getenv("XDG_CONFIG_HOME");
+
+    if (getenv("GIT_CONFIG_PARAMETERS") || getenv("GIT_CONFIG_COUNT") ||
+        resolve_git_dirs(m->root, git_dir, common_dir, sizeof(git_dir)) != 0) {
+        return -1;
+    }
+
+    GitConfig cfg;
+    init_git_config(&cfg);
+    load_repo_config(&cfg, common_dir);
+    if (conditional_includes_matter(&cfg)) {
+        free_git_config(&cfg);
+        return -1;
+    }
+
+    m->icase = config_bool(git_config_get(&cfg, "core.ignorecase"));
+    m->dir_mask = 15;
+    m->dirs = calloc(m->dir_mask + 1, sizeof(int));
+    if (!m->dirs) {
+        fprintf(stderr, "Failed to allocate memory for ignore rules\n");
+        exit(1);
+    }
+
+    // core.excludesFile defaults to $XDG_CONFIG_HOME/git/ignore
+    const char *excludes = git_config_get(&cfg, "core.excludesfile");
+    if (excludes && excludes[0] == '~' && excludes[1] == '/' && home) {
+        snprintf(path, sizeof(path), "%s%s", home, excludes + 1);
+    } else if (excludes && excludes[0] != '/') {
+        snprintf(path, sizeof(path), "%s/%s", m->root, excludes);  // git runs in the worktree
+    } else if (excludes) {
+        snprintf(path, sizeof(path), "%s", excludes);
+    } else if (xdg && xdg[0]) {
+        snprintf(path, sizeof(path), "%s/git/ignore", xdg);
+    } else {
+        snprintf(path, sizeof(path), "%s/.config/git/ignore", home ? home : "");
+    }
+    add_ignore_list(m, "", 0);
+    load_ignore_file(m, &m->lists[0], path, 0);
+    add_ignore_list(m, "", 0);
+    if (join_path(path, sizeof(path), common_dir, "info/exclude") == 0) {
+        load_ignore_file(m, &m->lists[1], path, 0);
+    }
+    free_git_config(&cfg);
+    return 0;
+}
+
+// Whether path (relative to the worktree) is ignored, tracked or not, like
+// `git check-ignore --no-index`. is_dir is 1 or 0 if known, else -1.
+// Returns 1 or 0, or -1 if only git can tell.
+int path_is_ignored(IgnoreMatcher *m, const char *path, int is_dir) {
+    if (!m->loaded) m->loaded = load_ignore_config(m) == 0 ? 1 : -1;
+    if (m->loaded < 0) return -1;
+
+    char buf[PATH_MAX];
+    int len = strlen(path);
+    if ((size_t)len >= sizeof(buf)) return 0;
+    memcpy(buf, path, len + 1);
+
+    // Once a leading directory is excluded, so is everything in it
+    for (int i = 0; i < len; i++) {
+        if (buf[i] != '/') continue;
+        int dir = 1;
+        buf[i] = '\0';
+        int excluded = ignore_lists_match(m, buf, i, &dir) == 1;
+        buf[i] = '/';
+        if (excluded) return 1;
+    }
+    return ignore_lists_match(m, buf, len, &is_dir) == 1;
+}
+
+void free_ignore_matcher(IgnoreMatcher *m) {
+    for (int i = 0; i < m->count; i++) {
+        free(m->lists[i].rules);
+        free(m->lists[i].buckets);
+    }
+    free(m->lists);
+    free(m->dirs);
+    free_arena(&m->arena);
+}
+
+// Entries hashed below untracked directories, per repo, before the digest
+// gives up on standing for them
+#define UNTRACKED_DIGEST_LIMIT 10000
+
+// Fold the name and stat data of everything below an untracked directory
+// into the digest, since a file appearing deep inside changes no stat data
+// higher up. Ignored paths are left out, and a nested repository counts
+// as the directory alone, as in git status. Returns -1 if the tree can't
+// be read or *budget runs out.
+int digest_untracked_dir(const char *repo_path, const char *dir_name, IgnoreMatcher *ignores,
+                         uint64_t *digest, int *budget) {
+    char path[PATH_MAX];
+    char child[PATH_MAX];
+    if (join_path(path, sizeof(path), repo_path, dir_name) != 0) return -1;
+    DIR *dir = opendir(path);
+    if (!dir) return -1;
+    if (faccessat(dirfd(dir), ".git", F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+        closedir(dir);
+        return 0;
+    }
+
+    int result = 0;
+    struct dirent *entry;
+    while (result == 0 && (entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+        if (--*budget < 0) {
+            result = -1;
+            break;
+        }
+        int len = snprintf(child, sizeof(child), "%s/%s", dir_name, name);
+        if (len < 0 || (size_t)len >= sizeof(child)) {
+            result = -1;
+            break;
+        }
+        struct stat st;
+        if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            result = -1;
+            break;
+        }
+        if (path_is_ignored(ignores, child, S_ISDIR(st.st_mode)) == 1) continue;
+        uint64_t h = hash_bytes(child, len);
+        h = hash_mix(h, stat_mtime_ns(&st));
+        h = hash_mix(h, st.st_size);
+        h = hash_mix(h, st.st_mode);
+        *digest += h;
+        if (S_ISDIR(st.st_mode)) result = digest_untracked_dir(repo_path, child, ignores, digest, budget);
+    }
+    closedir(dir);
+    return result;
+}
+
+// Check for files that aren't tracked: every directory holding tracked
+// files may only contain tracked or ignored paths. Returns 1 if nothing
+// else is there. With a digest, all directories are listed and each
+// untracked entry's name and stat data are folded into it, down through
+// untracked directories; *complete is cleared if one couldn't be hashed.
+int worktree_has_only_tracked(const char *repo_path, const StringSet *tracked, const StringSet *dirs,
+                              IgnoreMatcher *ignores, uint64_t *digest, int *complete) {
+    char path[PATH_MAX];
+    char child[PATH_MAX];
+    int clean = 1;
+    int budget = UNTRACKED_DIGEST_LIMIT;
+
+    for (size_t i = 0; i < dirs->capacity && (clean || digest); i++) {
+        const char *dir_name = dirs->slots[i];
+        if (!dir_name) continue;
+
+        if (dir_name[0]) {
+            if (join_path(path, sizeof(path), repo_path, dir_name) != 0) return 0;
+        } else {
+            snprintf(path, sizeof(path), "%s", repo_path);
+        }
+        DIR *dir = opendir(path);
+        if (!dir) return 0;
+
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            if (!dir_name[0] && strcmp(name, ".git") == 0) continue;
+
+            int len;
+            if (dir_name[0]) len = snprintf(child, sizeof(child), "%s/%s", dir_name, name);
+            else len = snprintf(child, sizeof(child), "%s", name);
+            if (len < 0 || (size_t)len >= sizeof(child)) {
+                closedir(dir);
+                return 0;
+            }
+            if (string_set_contains(tracked, child, len)) continue;
+
+            // git status leaves ignored files out as well
+            int is_dir = entry->d_type == DT_DIR ? 1 : entry->d_type == DT_UNKNOWN ? -1 : 0;
+            int is_ignored = path_is_ignored(ignores, child, is_dir) == 1;
+            if (!is_ignored) clean = 0;
+            if (!digest) {
+                if (!clean) break;
+                continue;
+            }
+            struct stat st;
+            uint64_t h = hash_bytes(child, len);
+            if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                h = hash_mix(h, stat_mtime_ns(&st));
+                h = hash_mix(h, st.st_size);
+                h = hash_mix(h, st.st_mode);
+                if (S_ISDIR(st.st_mode) && !is_ignored && *complete &&
+                    digest_untracked_dir(repo_path, child, ignores, digest, &budget) != 0) {
+                    *complete = 0;
+                }
+            } else {
+                *complete = 0;
+            }
+            *digest += h;
+        }
+        closedir(dir);
+    }
+    return clean;
+}
+
+// Compare the index's cached stat data against lstat() of every tracked
+// file, its cached root tree against HEAD's tree, and list tracked
+// directories to rule out untracked files (unless check_untracked is 0).
+// The first difference ends the walk unless want_digest is set, in which
+// case the whole worktree is hashed for the scan cache.
+void scan_index(const char *repo_path, int want_digest, int check_untracked, IndexScan *scan) {
+    char git_dir[PATH_MAX];
+    char common_dir[PATH_MAX];
+    char path[PATH_MAX];
+    char head[PATH_MAX];
+    char oid_hex[128];
+
+    memset(scan, 0, sizeof(*scan));
+    if (resolve_git_dirs(repo_path, git_dir, common_dir, sizeof(git_dir)) != 0) return;
+
+    // HEAD commit, if the branch isn't unborn
+    unsigned char head_oid[OID_RAW_SIZE];
+    const char *head_hex = head;
+    int have_head = 1;
+    if (join_path(path, sizeof(path), git_dir, "HEAD") != 0 ||
+        read_small_file(path, head, sizeof(head)) != 0) return;
+    if (strncmp(head, "ref: ", 5) == 0) {
+        have_head = resolve_ref(common_dir, head + 5, oid_hex, sizeof(oid_hex));
+        head_hex = oid_hex;
+    }
+    if (have_head && (strlen(head_hex) != OID_HEX_SIZE || hex_to_oid(head_hex, head_oid) != 0)) {
+        return;  // not SHA-1
+    }
+    scan->head_hash = hash_bytes(head, strlen(head));
+    if (have_head) scan->head_hash = hash_mix(scan->head_hash, hash_bytes(head_hex, OID_HEX_SIZE));
+
+    if (join_path(path, sizeof(path), git_dir, "index") != 0) return;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat index_st;
+    if (fstat(fd, &index_st) != 0 || index_st.st_size < 12 + OID_RAW_SIZE) {
+        close(fd);
+        return;
+    }
+    size_t size = index_st.st_size;
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return;
+    scan->index_mtime = stat_mtime_ns(&index_st);
+    scan->index_size = index_st.st_size;
+
+    uint32_t version = get_be32(map + 4);
+    uint32_t entry_count = get_be32(map + 8);
+    if (memcmp(map, "DIRC", 4) != 0 || version < 2 || version > 4) {
+        munmap(map, size);
+        return;
+    }
+    scan->entries = entry_count;
+
+    // Which stat fields git compares: ctime unless core.trustCtime is off,
+    // and with core.checkStat=minimal only whole-second mtime and size.
+    // Settings from the environment can only make git compare less, so
+    // ignoring them errs on the side of asking git.
+    GitConfig cfg;
+    init_git_config(&cfg);
+    load_repo_config(&cfg, common_dir);
+    const char *check_stat_value = git_config_get(&cfg, "core.checkstat");
+    int check_stat = !check_stat_value || strcasecmp(check_stat_value, "minimal") != 0;
+    int trust_ctime = check_stat && !config_false(git_config_get(&cfg, "core.trustctime"));
+    free_git_config(&cfg);
+
+    StringSet tracked, dirs;
+    init_string_set(&tracked);
+    init_string_set(&dirs);
+    string_set_add(&dirs, "", 0);
+
+    int valid = 1;   // index could be parsed and trusted
+    int clean = 1;
+    int racy = 0;
+    int complete = 1;  // the digest covers every untracked path
+    uint64_t digest = 0;
+    size_t end = size - OID_RAW_SIZE;  // trailing checksum
+    size_t off = 12;
+    char name[PATH_MAX] = "";
+    size_t name_len = 0;
+    char full[PATH_MAX];
+    size_t repo_len = strlen(repo_path);
+    if (repo_len + 2 >= sizeof(full)) valid = 0;
+    else {
+        memcpy(full, repo_path, repo_len);
+        full[repo_len++] = '/';
+    }
+
+    for (uint32_t i = 0; valid && (clean || want_digest) && i < entry_count; i++) {
+        if (off + INDEX_ENTRY_FIXED > end) {
+            valid = 0;
+            break;
+        }
+        const unsigned char *ce = map + off;
+        uint32_t ctime_sec = get_be32(ce);
+        uint32_t ctime_nsec = get_be32(ce + 4);
+        uint32_t mtime_sec = get_be32(ce + 8);
+        uint32_t mtime_nsec = get_be32(ce + 12);
+        uint32_t ino = get_be32(ce + 20);
+        uint32_t mode = get_be32(ce + 24);
+        uint32_t uid = get_be32(ce + 28);
+        uint32_t gid = get_be32(ce + 32);
+        uint32_t file_size = get_be32(ce + 36);
+        uint16_t flags = (ce[60] << 8) | ce[61];
+        uint16_t ext_flags = 0;
+        size_t name_off = INDEX_ENTRY_FIXED;
+        if (flags & CE_EXTENDED) {
+            if (version < 3 || off + name_off + 2 > end) {
+                valid = 0;
+                break;
+            }
+            ext_flags = (ce[62] << 8) | ce[63];
+            name_off += 2;
+        }
+
+        // Path: NUL-terminated and padded in v2/v3, prefix-compressed in v4
+        const unsigned char *p = ce + name_off;
+        if (version == 4) {
+            size_t strip = *p & 127;
+            while (*p++ & 128) {
+                if (p >= map + end) break;
+                strip = ((strip + 1) << 7) | (*p & 127);
+            }
+            const unsigned char *nul = memchr(p, '\0', map + end - p);
+            if (!nul || strip > name_len || name_len - strip + (nul - p) >= sizeof(name)) {
+                valid = 0;
+                break;
+            }
+            name_len -= strip;
+            memcpy(name + name_len, p, nul - p);
+            name_len += nul - p;
+            name[name_len] = '\0';
+            off = nul + 1 - map;
+        } else {
+            const unsigned char *nul = memchr(p, '\0', map + end - p);
+            if (!nul || (size_t)(nul - p) >= sizeof(name)) {
+                valid = 0;
+                break;
+            }
+            name_len = nul - p;
+            memcpy(name, p, name_len);
+            name[name_len] = '\0';
+            off += (name_off + name_len + 8) & ~(size_t)7;
+        }
+
+        // Conflicts, submodules and intent-to-add entries need git
+        if ((flags & CE_STAGE_MASK) || (mode & 0170000) == GITLINK_MODE ||
+            (ext_flags & CE_INTENT_TO_ADD)) {
+            valid = 0;
+            break;
+        }
+
+        // Record the path and all its parent directories as tracked
+        for (size_t j = 0; j < name_len; j++) {
+            if (name[j] == '/') {
+                string_set_add(&tracked, name, j);
+                if (!(ext_flags & CE_SKIP_WORKTREE)) string_set_add(&dirs, name, j);
+            }
+        }
+        string_set_add(&tracked, name, name_len);
+
+        if ((flags & CE_ASSUME_VALID) || (ext_flags & CE_SKIP_WORKTREE)) continue;
+
+        // Racily clean: modified in the same instant the index was written,
+        // so its stat data can't prove anything
+        if ((time_t)mtime_sec > index_st.st_mtime ||
+            ((time_t)mtime_sec == index_st.st_mtime && (long)mtime_nsec >= ST_MTIME_NSEC(index_st))) {
+            racy = 1;
+            clean = 0;
+            continue;
+        }
+
+        if (repo_len + name_len >= sizeof(full)) {
+            valid = 0;
+            break;
+        }
+        memcpy(full + repo_len, name, name_len + 1);
+        struct stat st;
+        int missing = lstat(full, &st) != 0;
+        if (missing ||
+            (uint32_t)st.st_mtime != mtime_sec ||
+            (uint32_t)st.st_size != file_size ||
+            ((mode & 0170000) == SYMLINK_MODE ? !S_ISLNK(st.st_mode) : !S_ISREG(st.st_mode)) ||
+            (((mode & 0111) != 0) != ((st.st_mode & S_IXUSR) != 0))) {
+            clean = 0;
+        } else if (check_stat &&
+                   ((mtime_nsec && (uint32_t)ST_MTIME_NSEC(st) != mtime_nsec) ||
+                    (uint32_t)st.st_ino != ino || (uint32_t)st.st_uid != uid ||
+                    (uint32_t)st.st_gid != gid)) {
+            clean = 0;
+        } else if (trust_ctime &&
+                   ((uint32_t)st.st_ctime != ctime_sec ||
+                    (ctime_nsec && (uint32_t)ST_CTIME_NSEC(st) != ctime_nsec))) {
+            clean = 0;
+        }
+        if (want_digest) {
+            uint64_t h = hash_bytes(name, name_len);
+            if (!missing) {
+                h = hash_mix(h, stat_mtime_ns(&st));
+                h = hash_mix(h, (int64_t)st.st_ctime * 1000000000LL + ST_CTIME_NSEC(st));
+                h = hash_mix(h, st.st_size);
+                h = hash_mix(h, st.st_ino);
+                h = hash_mix(h, st.st_mode);
+            }
+            digest += h;
+        }
+    }
+
+    // Staged changes: the index's cached root tree must be valid and match
+    // HEAD's tree. Split and sparse indexes aren't handled here.
+    if (valid && (clean || want_digest)) {
+        int tree_ok = !have_head && entry_count == 0;
+        while (off + 8 <= end) {
+            const unsigned char *ext = map + off;
+            uint32_t ext_size = get_be32(ext + 4);
+            const unsigned char *data = ext + 8;
+            if (off + 8 + ext_size > end) {
+                valid = 0;
+                break;
+            }
+            if (memcmp(ext, "link", 4) == 0 || memcmp(ext, "sdir", 4) == 0) {
+                valid = 0;
+                break;
+            }
+            if (memcmp(ext, "TREE", 4) == 0 && have_head && ext_size > 0 && data[0] == '\0') {
+                // Root entry: "\0<entry_count> <subtrees>\n<oid>"
+                int cached_entries;
+                const unsigned char *nl = memchr(data, '\n', ext_size);
+                if (nl && sscanf((const char *)data + 1, "%d", &cached_entries) == 1 &&
+                    cached_entries >= 0 && (size_t)(nl + 1 - data) + OID_RAW_SIZE <= ext_size) {
+                    unsigned char tree_oid[OID_RAW_SIZE];
+                    if (join_path(path, sizeof(path), common_dir, "objects") == 0 &&
+                        read_commit_tree(path, head_oid, tree_oid, 0) == 0 &&
+                        memcmp(tree_oid, nl + 1, OID_RAW_SIZE) == 0) {
+                        tree_ok = 1;
+                    }
+                }
+            }
+            off += 8 + ext_size;
+        }
+        if (!tree_ok) clean = 0;
+    }
+    munmap(map, size);
+
+    if (valid && check_untracked && (clean || want_digest)) {
+        IgnoreMatcher ignores;
+        init_ignore_matcher(&ignores, repo_path);
+        if (!worktree_has_only_tracked(repo_path, &tracked, &dirs, &ignores, want_digest ? &digest : NULL,
+                                       &complete)) {
+            clean = 0;
+        }
+        free_ignore_matcher(&ignores);
+    }
+
+    free_string_set(&tracked);
+    free_string_set(&dirs);
+
+    scan->clean = valid && clean;
+    scan->cacheable = valid && !racy && complete && want_digest;
+    scan->digest = digest;
+}
+
+// Index extensions that let git status skip work, for --profile
+#define INDEX_EXT_UNTR 1    // untracked cache
+#define INDEX_EXT_FSMN 2    // fsmonitor token
+
+// Which of the INDEX_EXT_* extensions a repo's index carries. They follow
+// the entries, so every entry is stepped over to reach them.
+int read_index_extensions(const char *repo_path) {
+    char git_dir[PATH_MAX];
+    char common_dir[PATH_MAX];
+    char path[PATH_MAX];
+
+    if (resolve_git_dirs(repo_path, git_dir, common_dir, sizeof(git_dir)) != 0 ||
+        join_path(path, sizeof(path), git_dir, "index") != 0) {
+        return 0;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 12 + OID_RAW_SIZE) {
+        close(fd);
+        return 0;
+    }
+    size_t size = st.st_size;
+    unsigned char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    uint32_t version = get_be32(map + 4);
+    uint32_t entry_count = get_be32(map + 8);
+    size_t end = size - OID_RAW_SIZE;
+    size_t off = 12;
+    int found = 0;
+    if (memcmp(map, "DIRC", 4) != 0 || version < 2 || version > 4) {
+        munmap(map, size);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < entry_count && off < end; i++) {
+        if (off + INDEX_ENTRY_FIXED > end) {
+            off = end;
+            break;
+        }
+        uint16_t flags = (map[off + 60] << 8) | map[off + 61];
+        size_t name_off = INDEX_ENTRY_FIXED + ((flags & CE_EXTENDED) ? 2 : 0);
+        const unsigned char *p = map + off + name_off;
+        if (version == 4) {
+            while (p < map + end && (*p++ & 128)) {}  // prefix length varint
+        }
+        const unsigned char *nul = p < map + end ? memchr(p, '\0', map + end - p) : NULL;
+        if (!nul) {
+            off = end;
+            break;
+        }
+        if (version == 4) off = nul + 1 - map;
+        else off += (name_off + (nul - p) + 8) & ~(size_t)7;
+    }
+
+    // Each extension: a four-letter signature, a 32-bit size and the data
+    while (off + 8 <= end) {
+        uint32_t ext_size = get_be32(map + off + 4);
+        if (memcmp(map + off, "UNTR", 4) == 0) found |= INDEX_EXT_UNTR;
+        if (memcmp(map + off, "FSMN", 4) == 0) found |= INDEX_EXT_FSMN;
+        if (ext_size > end - off - 8) break;
+        off += 8 + ext_size;
+    }
+    munmap(map, size);
+    return found;
+}
+
+// Fast pre-check for clean repos that avoids running git.
+// Returns 1 only if the repo is certainly clean; 0 means full status is
+// needed (something differs, or the index can't be trusted).
+int index_precheck(const char *repo_path) {
+    IndexScan scan;
+    scan_index(repo_path, 0, 1, &scan);
+    return scan.clean;
+}
+
+// Mark which of the given paths match gitignore patterns (even if tracked);
+// ignored[i] is set to 1 for every matching path. The rules are matched
+// in-process. If the config can't be followed here, all paths go through a
+// single `git check-ignore --stdin` process instead.
+void mark_gitignored(const char *repo_path, char **paths, int count, char *ignored, Buffer *out) {
+    memset(ignored, 0, count);
+    if (count == 0) return;
+
+    IgnoreMatcher ignores;
+    init_ignore_matcher(&ignores, repo_path);
+    int native = 1;
+    for (int i = 0; i < count && native; i++) {
+        int match = path_is_ignored(&ignores, paths[i], -1);
+        if (match < 0) native = 0;
+        else ignored[i] = match;
+    }
+    free_ignore_matcher(&ignores);
+    if (native) return;
+
+    // Input is the NUL-separated list of paths
+    Buffer input;
+    init_buffer(&input);
+    for (int i = 0; i < count; i++) {
+        size_t n = strlen(paths[i]) + 1;
+        buffer_reserve(&input, n);
+        memcpy(input.data + input.len, paths[i], n);
+        input.len += n;
+    }
+
+    // --no-index checks ignore rules even for tracked files
+    const char *args[] = {"check-ignore", "--stdin", "-z", "--no-index", NULL};
+    run_git(repo_path, args, input.data, input.len, out);
+
+    // git reports matching paths in input order, so walk both lists together
+    int cursor = 0;
+    size_t off = 0;
+    while (off < out->len && cursor < count) {
+        const char *match = out->data + off;
+        size_t match_len = strnlen(match, out->len - off);
+        if (off + match_len >= out->len) break;  // unterminated record
+        while (cursor < count && strcmp(paths[cursor], match) != 0) cursor++;
+        if (cursor < count) ignored[cursor++] = 1;
+        off += match_len + 1;
+    }
+
+    free_buffer(&input);
+}
+
+// Porcelain entries collected before gitignore filtering. The strings are
+// scratch: kept entries are copied into the repo's change list.
+typedef struct {
+    Arena arena;
+    char **filenames;   // display names ("old -> new" for renames)
+    char **paths;       // paths checked against .gitignore; usually the filename
+    char *statuses;     // index/worktree status pairs
+    int count;
+    int capacity;
+    int count_untracked;  // count untracked files instead of collecting them
+    int untracked;
+} StatusEntries;
+
+void init_status_entries(StatusEntries *entries) {
+    init_arena(&entries->arena);
+    entries->filenames = NULL;
+    entries->paths = NULL;
+    entries->statuses = NULL;
+    entries->count = 0;
+    entries->capacity = 0;
+    entries->count_untracked = 0;
+    entries->untracked = 0;
+}
+
+void add_status_entry(StatusEntries *entries, char index_status, char worktree_status,
+                      const char *path, const char *orig_path) {
+    if (entries->count >= entries->capacity) {
+        entries->capacity = entries->capacity ? entries->capacity * 2 : INITIAL_FILES_CAPACITY;
+        entries->filenames = realloc(entries->filenames, entries->capacity * sizeof(char *));
+        entries->paths = realloc(entries->paths, entries->capacity * sizeof(char *));
+        entries->statuses = realloc(entries->statuses, entries->capacity * 2);
+        if (!entries->filenames || !entries->paths || !entries->statuses) {
+            fprintf(stderr, "Failed to allocate memory for file changes\n");
+            exit(1);
+        }
+    }
+
+    int i = entries->count++;
+    if (orig_path) {
+        size_t len = strlen(orig_path) + strlen(path) + 5;
+        entries->filenames[i] = arena_alloc(&entries->arena, len);
+        snprintf(entries->filenames[i], len, "%s -> %s", orig_path, path);
+        entries->paths[i] = entries->filenames[i] + len - 1 - strlen(path);
+    } else {
+        entries->paths[i] = entries->filenames[i] = arena_strdup(&entries->arena, path);
+    }
+    // v2 uses '.' for an unchanged side where v1 used a space
+    entries->statuses[i * 2] = index_status == '.' ? ' ' : index_status;
+    entries->statuses[i * 2 + 1] = worktree_status == '.' ? ' ' : worktree_status;
+}
+
+void free_status_entries(StatusEntries *entries) {
+    free_arena(&entries->arena);
+    free(entries->filenames);
+    free(entries->paths);
+    free(entries->statuses);
+}
+
+// Skip n space-separated fields, returning the rest of the record
+const char *skip_fields(const char *p, int n) {
+    while (n-- > 0 && p) {
+        p = strchr(p, ' ');
+        if (p) p++;
+    }
+    return p;
+}
+
+// Parse `git status --porcelain=v2 --branch -z` output. Branch headers fill
+// the fields of repo that are still unset; file records are collected into
+// entries.
+void parse_status_v2(const char *buf, size_t len, GitRepo *repo, StatusEntries *entries) {
+    const char *upstream = NULL;
+    int have_ab = 0;
+    size_t off = 0;
+
+    while (off < len) {
+        const char *rec = buf + off;
+        size_t rec_len = strnlen(rec, len - off);
+        off += rec_len + 1;
+        if (rec_len < 2) continue;
+
+        if (strncmp(rec, "# branch.head ", 14) == 0 && !repo->branch) {
+            const char *head = rec + 14;
+            // Detached HEAD is reported as "HEAD", like rev-parse --abbrev-ref
+            repo->branch = arena_strdup(&repo->arena, strcmp(head, "(detached)") == 0 ? "HEAD" : head);
+        } else if (strncmp(rec, "# branch.upstream ", 18) == 0) {
+            upstream = rec + 18;
+        } else if (strncmp(rec, "# branch.ab ", 12) == 0) {
+            if (sscanf(rec + 12, "+%d -%d", &repo->ahead, &repo->behind) == 2) {
+                have_ab = 1;
+            }
+        } else if (rec[0] == '1' && rec[1] == ' ') {
+            const char *path = skip_fields(rec, 8);
+            if (path) add_status_entry(entries, rec[2], rec[3], path, NULL);
+        } else if (rec[0] == '2' && rec[1] == ' ') {
+            // Renames and copies carry the original path as the next record
+            const char *path = skip_fields(rec, 9);
+            const char *orig_path = off < len ? buf + off : "";
+            off += strnlen(orig_path, len - off) + 1;
+            if (path) add_status_entry(entries, rec[2], rec[3], path, orig_path);
+        } else if (rec[0] == 'u' && rec[1] == ' ') {
+            const char *path = skip_fields(rec, 10);
+            if (path) add_status_entry(entries, rec[2], rec[3], path, NULL);
+        } else if (rec[0] == '?' && rec[1] == ' ') {
+            // status has already left out ignored untracked files, so
+            // they only need collecting for the file list
+            if (entries->count_untracked) entries->untracked++;
+            else add_status_entry(entries, '?', '?', rec + 2, NULL);
+        }
+    }
+
+    // An upstream whose ref is gone has no ahead/behind line; treat it
+    // like `rev-parse @{u}` failing
+    if (upstream && have_ab && !repo->remote_branch) {
+        repo->remote_branch = arena_strdup(&repo->arena, upstream);
+        repo->is_pushed = 1;  // Branch has upstream, so it's been pushed
+    }
+}
+
+// Turn status entries into the repo's counts and file changes, leaving out
+// the ones marked in ignored
+void add_status_changes(GitRepo *repo, const StatusEntries *entries, const char *ignored, int count_only) {
+    for (int i = 0; i < entries->count; i++) {
+        char index_status = entries->statuses[i * 2];
+        char worktree_status = entries->statuses[i * 2 + 1];
+        const char *filename = entries->filenames[i];
+
+        // Skip files that are in .gitignore
+        if (ignored[i]) {
+            continue;
+        }
+
+        // Handle staged changes
+        if (index_status != ' ' && index_status != '?') {
+            if (!count_only) add_file_change(repo, filename, index_status, 1);
+            repo->staged_count++;
+        }
+
+        // Handle unstaged changes
+        if (worktree_status != ' ' && worktree_status != '?') {
+            if (!count_only) add_file_change(repo, filename, worktree_status, 0);
+            repo->unstaged_count++;
+        }
+
+        // Handle untracked files
+        if (index_status == '?' && worktree_status == '?') {
+            if (!count_only) add_file_change(repo, filename, '?', 0);
+            repo->untracked_count++;
+        }
+    }
+    repo->untracked_count += entries->untracked;
+}
+
+// The core.fsmonitor setting for --fsmonitor: the given hook or, without
+// one, the repo's fsmonitor-watchman hook, else git's built-in daemon where
+// there is one. Returns 0 to leave git's own setting alone.
+int fsmonitor_setting(const char *repo_path, const char *hook, char *out, size_t size) {
+    char git_dir[PATH_MAX];
+    char common_dir[PATH_MAX];
+    char path[PATH_MAX];
+
+    if (hook[0]) {
+        snprintf(out, size, "core.fsmonitor=%s", hook);
+        return 1;
+    }
+    if (resolve_git_dirs(repo_path, git_dir, common_dir, sizeof(git_dir)) != 0) return 0;
+
+    // A repo that configures its own monitor keeps it
+    GitConfig cfg;
+    init_git_config(&cfg);
+    int configured = join_path(path, sizeof(path), common_dir, "config") == 0 &&
+                     load_git_config(&cfg, path) == 0 && git_config_get(&cfg, "core.fsmonitor");
+    free_git_config(&cfg);
+    if (configured) return 0;
+
+    if (join_path(path, sizeof(path), common_dir, "hooks/fsmonitor-watchman") == 0 &&
+        access(path, X_OK) == 0) {
+        snprintf(out, size, "core.fsmonitor=%s", path);
+        return 1;
+    }
+#if defined(__APPLE__) || defined(_WIN32)
+    snprintf(out, size, "core.fsmonitor=true");
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+#ifdef WITH_LIBGIT2
+// libgit2 backend (--backend=libgit2): status, branch metadata and ignore
+// rules in-process, with each worker opening its own repository handle.
+// Anything it can't open or read falls back to running git.
+
+char libgit2_index_status(unsigned status) {
+    if (status & GIT_STATUS_INDEX_NEW) return 'A';
+    if (status & GIT_STATUS_INDEX_MODIFIED) return 'M';
+    if (status & GIT_STATUS_INDEX_DELETED) return 'D';
+    if (status & GIT_STATUS_INDEX_RENAMED) return 'R';
+    if (status & GIT_STATUS_INDEX_TYPECHANGE) return 'T';
+    return '.';
+}
+
+char libgit2_worktree_status(unsigned status) {
+    if (status & GIT_STATUS_WT_MODIFIED) return 'M';
+    if (status & GIT_STATUS_WT_DELETED) return 'D';
+    if (status & GIT_STATUS_WT_RENAMED) return 'R';
+    if (status & GIT_STATUS_WT_TYPECHANGE) return 'T';
+    return '.';
+}
+
+// Status list flags for an --untracked-files mode, falling back to the
+// repo's status.showUntrackedFiles like git does
+unsigned libgit2_status_flags(git_repository *lg, const char *mode) {
+    git_config *cfg = NULL;
+    const char *configured = NULL;
+    if (!mode && git_repository_config_snapshot(&cfg, lg) == 0 &&
+        git_config_get_string(&configured, cfg, "status.showUntrackedFiles") == 0) {
+        mode = configured;
+    }
+
+    // Renames between HEAD and the index are on by default in git status
+    unsigned flags = GIT_STATUS_OPT_RENAMES_HEAD_TO_INDEX;
+    if (!mode || strcmp(mode, "no") != 0) flags |= GIT_STATUS_OPT_INCLUDE_UNTRACKED;
+    if (mode && strcmp(mode, "all") == 0) flags |= GIT_STATUS_OPT_RECURSE_UNTRACKED_DIRS;
+    git_config_free(cfg);
+    return flags;
+}
+
+// Branch, upstream, remote and ahead/behind, for repos read_branch_info
+// couldn't handle; mirrors get_branch_info
+void libgit2_branch_info(git_repository *lg, GitRepo *repo) {
+    git_reference *head = NULL;
+    git_reference *upstream = NULL;
+    git_remote *origin = NULL;
+
+    if (git_repository_head(&head, lg) == 0) {
+        if (git_repository_head_detached(lg)) {
+            repo->branch = arena_strdup(&repo->arena, "HEAD");
+        } else {
+            repo->branch = arena_strdup(&repo->arena, git_reference_shorthand(head));
+        }
+    }
+
+    if (git_remote_lookup(&origin, lg, "origin") == 0) {
+        const char *url = git_remote_url(origin);
+        if (url && url[0]) {
+            repo->remote_url = arena_strdup(&repo->arena, url);
+            repo->has_remote = 1;
+        }
+        git_remote_free(origin);
+    }
+
+    const char *name;
+    if (head && !git_repository_head_detached(lg) && git_branch_upstream(&upstream, head) == 0 &&
+        git_branch_name(&name, upstream) == 0) {
+        repo->remote_branch = arena_strdup(&repo->arena, name);
+        repo->is_pushed = 1;  // Branch has upstream, so it's been pushed
+    }
+
+    // If no tracking branch but has remote, check cached origin/<branch>
+    if (!repo->is_pushed && repo->has_remote && repo->branch && strcmp(repo->branch, "HEAD") != 0) {
+        char ref_name[PATH_MAX];
+        git_reference *ref;
+        snprintf(ref_name, sizeof(ref_name), "refs/remotes/origin/%s", repo->branch);
+        if (git_reference_lookup(&ref, lg, ref_name) == 0) {
+            repo->is_pushed = 1;
+            git_reference_free(ref);
+        }
+    }
+
+    git_reference_free(upstream);
+    git_reference_free(head);
+}
+
+// Ahead/behind against the upstream, which git status reports unasked
+void libgit2_ahead_behind(git_repository *lg, GitRepo *repo) {
+    git_reference *head = NULL;
+    git_reference *upstream = NULL;
+    if (git_repository_head(&head, lg) == 0 && !git_repository_head_detached(lg) &&
+        git_branch_upstream(&upstream, head) == 0) {
+        const git_oid *local = git_reference_target(head);
+        const git_oid *remote = git_reference_target(upstream);
+        size_t ahead, behind;
+        if (local && remote && git_graph_ahead_behind(&ahead, &behind, lg, local, remote) == 0) {
+            repo->ahead = (int)ahead;
+            repo->behind = (int)behind;
+        }
+    }
+    git_reference_free(upstream);
+    git_reference_free(head);
+}
+
+// get_git_status without spawning git, except for the check-ignore fallback
+// that out is scratch space for. Returns -1, with repo untouched, if
+// libgit2 can't read the repo. --max-entries applies; --repo-timeout can't
+// interrupt a status walk in progress.
+int libgit2_git_status(const char *repo_path, GitRepo *repo, Buffer *out, const Options *opts) {
+    git_repository *lg;
+    git_status_list *list;
+    git_status_options status_opts;
+
+    if (git_repository_open_ext(&lg, repo_path, GIT_REPOSITORY_OPEN_NO_SEARCH, NULL) != 0) return -1;
+    git_status_options_init(&status_opts, GIT_STATUS_OPTIONS_VERSION);
+    status_opts.show = GIT_STATUS_SHOW_INDEX_AND_WORKDIR;
+    status_opts.flags = libgit2_status_flags(lg, opts->untracked);
+
+    int64_t probe = probe_start(PHASE_STATUS);
+    int failed = git_status_list_new(&list, lg, &status_opts) != 0;
+    probe_end(PHASE_STATUS, probe);
+    if (failed) {
+        git_repository_free(lg);
+        return -1;
+    }
+
+    repo->path = arena_strdup(&repo->arena, repo_path);
+    probe = probe_start(PHASE_BRANCH);
+    if (!read_branch_info(repo_path, repo)) libgit2_branch_info(lg, repo);
+    if (repo->remote_branch) libgit2_ahead_behind(lg, repo);
+    probe_end(PHASE_BRANCH, probe);
+
+    probe = probe_start(PHASE_PARSE);
+    StatusEntries entries;
+    init_status_entries(&entries);
+    entries.count_untracked = opts->count_only;
+    size_t count = git_status_list_entrycount(list);
+    for (size_t i = 0; i < count; i++) {
+        if (opts->max_entries && i >= (size_t)opts->max_entries) {
+            if (git_budget) git_budget->truncated = 1;
+            break;
+        }
+        const git_status_entry *entry = git_status_byindex(list, i);
+        const git_diff_delta *delta = entry->head_to_index ? entry->head_to_index : entry->index_to_workdir;
+        if (!delta || !delta->new_file.path) continue;
+
+        const char *orig_path = NULL;
+        if (entry->head_to_index && (entry->status & GIT_STATUS_INDEX_RENAMED)) {
+            orig_path = entry->head_to_index->old_file.path;
+        }
+        if (entry->status & GIT_STATUS_WT_NEW) {
+            if (entries.count_untracked) entries.untracked++;
+            else add_status_entry(&entries, '?', '?', delta->new_file.path, NULL);
+        } else if (entry->status & GIT_STATUS_CONFLICTED) {
+            add_status_entry(&entries, 'U', 'U', delta->new_file.path, NULL);
+        } else {
+            add_status_entry(&entries, libgit2_index_status(entry->status),
+                             libgit2_worktree_status(entry->status), delta->new_file.path, orig_path);
+        }
+    }
+    git_status_list_free(list);
+    probe_end(PHASE_PARSE, probe);
+
+    // Ignore rules apply to tracked files too, like check-ignore --no-index.
+    // The git backend's matcher is used because git_ignore_path_is_ignored
+    // disagrees with git on some patterns.
+    probe = probe_start(PHASE_IGNORE);
+    char *ignored = malloc(entries.count > 0 ? entries.count : 1);
+    if (!ignored) {
+        fprintf(stderr, "Failed to allocate memory for file changes\n");
+        exit(1);
+    }
+    mark_gitignored(repo_path, entries.paths, entries.count, ignored, out);
+    probe_end(PHASE_IGNORE, probe);
+
+    probe = probe_start(PHASE_PARSE);
+    add_status_changes(repo, &entries, ignored, opts->count_only);
+    free_status_entries(&entries);
+    free(ignored);
+    probe_end(PHASE_PARSE, probe);
+
+    git_repository_free(lg);
+    return 0;
+}
+#endif
+
+// Fill in a repo's branch info and changes. In count-only mode only the
+// counts are kept, and untracked files aren't collected at all.
+void get_git_status(const char *repo_path, GitRepo *repo, Buffer *out, const Options *opts) {
+#ifdef WITH_LIBGIT2
+    if (opts->backend == BACKEND_LIBGIT2 && libgit2_git_status(repo_path, repo, out, opts) == 0) return;
+#endif
+    repo->path = arena_strdup(&repo->arena, repo_path);
+
+    // Branch metadata comes from the git directory when possible
+    int64_t probe = probe_start(PHASE_BRANCH);
+    int have_branch_info = read_branch_info(repo_path, repo);
+    probe_end(PHASE_BRANCH, probe);
+
+    // One status call reports branch, upstream, ahead/behind and all files
+    char untracked_arg[64];
+    char fsmonitor_arg[PATH_MAX + 32];
+    const char *args[12];
+    int n = 0;
+    if (opts->untracked_cache) {
+        args[n++] = "-c";
+        args[n++] = "core.untrackedCache=true";
+    }
+    if (opts->fsmonitor && fsmonitor_setting(repo_path, opts->fsmonitor, fsmonitor_arg, sizeof(fsmonitor_arg))) {
+        args[n++] = "-c";
+        args[n++] = fsmonitor_arg;
+    }
+    args[n++] = "status";
+    args[n++] = "--porcelain=v2";
+    args[n++] = "--branch";
+    args[n++] = "-z";
+    if (opts->untracked) {
+        snprintf(untracked_arg, sizeof(untracked_arg), "--untracked-files=%s", opts->untracked);
+        args[n++] = untracked_arg;
+    }
+    args[n] = NULL;
+    if (profile_repo) {
+        profile_repo->ran_status = 1;
+        profile_repo->index_ext = read_index_extensions(repo_path);
+    }
+    probe = probe_start(PHASE_STATUS);
+    if (git_budget) git_budget->limit_status = 1;
+    int status_failed = run_git(repo_path, args, NULL, 0, out) != 0;
+    if (git_budget) git_budget->limit_status = 0;
+    if (status_failed && !(git_budget && git_budget->truncated)) out->len = 0;
+    probe_end(PHASE_STATUS, probe);
+
+    probe = probe_start(PHASE_PARSE);
+    StatusEntries entries;
+    init_status_entries(&entries);
+    entries.count_untracked = opts->count_only;
+    parse_status_v2(out->data, out->len, repo, &entries);
+    probe_end(PHASE_PARSE, probe);
+
+    if (!have_branch_info) {
+        probe = probe_start(PHASE_BRANCH);
+        get_branch_info(repo_path, repo, out);
+        probe_end(PHASE_BRANCH, probe);
+    }
+
+    probe = probe_start(PHASE_IGNORE);
+    char *ignored = malloc(entries.count > 0 ? entries.count : 1);
+    mark_gitignored(repo_path, entries.paths, entries.count, ignored, out);
+    probe_end(PHASE_IGNORE, probe);
+
+    probe = probe_start(PHASE_PARSE);
+    add_status_changes(repo, &entries, ignored, opts->count_only);
+    free_status_entries(&entries);
+    free(ignored);
+    probe_end(PHASE_PARSE, probe);
+}
+
+// Everything a cached scan result depends on. A cache entry is only used
+// while all of these still match the repo on disk.
+typedef struct {
+    int64_t index_mtime;      // nanoseconds
+    int64_t index_size;
+    int64_t root_mtime;       // worktree root directory
+    int64_t config_mtime;
+    int64_t exclude_mtime;    // .git/info/exclude
+    uint64_t head_hash;       // HEAD contents and the commit it points at
+    uint64_t worktree_digest; // stat data of tracked and untracked entries
+    uint64_t refs_hash;       // upstream and origin/<branch> refs
+} RepoSignature;
+
+#define CACHE_MAGIC     "UNCMTC01"
+#define CACHE_BOM       0x01020304U
+#define CACHE_NULL_STR  0xffffffffU
+
+// On-disk scan cache: the loaded file plus the records produced this run
+typedef struct {
+    char *data;               // previous cache file contents
+    size_t size;
+    size_t *table;            // record offsets hashed by key, 0 = empty slot
+    size_t table_size;        // power of two
+    uint64_t global_hash;     // state of global git config files
+    Buffer updates;           // records written during this run
+    int update_count;
+    StringSet updated;        // keys of those records
+    pthread_mutex_t lock;
+} ScanCache;
+
+// Sequential reader over a serialized record
+typedef struct {
+    const char *p;
+    const char *end;
+    int ok;
+} CacheReader;
+
+void buffer_put(Buffer *buf, const void *data, size_t len) {
+    if (len == 0) return;
+    buffer_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+void buffer_put_u32(Buffer *buf, uint32_t v) {
+    buffer_put(buf, &v, sizeof(v));
+}
+
+void buffer_put_i64(Buffer *buf, int64_t v) {
+    buffer_put(buf, &v, sizeof(v));
+}
+
+void buffer_put_str(Buffer *buf, const char *s) {
+    if (!s) {
+        buffer_put_u32(buf, CACHE_NULL_STR);
+        return;
+    }
+    uint32_t len = strlen(s);
+    buffer_put_u32(buf, len);
+    buffer_put(buf, s, len);
+}
+
+void cache_read(CacheReader *r, void *out, size_t len) {
+    if (!r->ok || (size_t)(r->end - r->p) < len) {
+        r->ok = 0;
+        memset(out, 0, len);
+        return;
+    }
+    memcpy(out, r->p, len);
+    r->p += len;
+}
+
+uint32_t cache_read_u32(CacheReader *r) {
+    uint32_t v;
+    cache_read(r, &v, sizeof(v));
+    return v;
+}
+
+int64_t cache_read_i64(CacheReader *r) {
+    int64_t v;
+    cache_read(r, &v, sizeof(v));
+    return v;
+}
+
+// Read a string; returns a pointer into the record (not NUL-terminated)
+const char *cache_read_str(CacheReader *r, uint32_t *len) {
+    *len = cache_read_u32(r);
+    if (!r->ok || *len == CACHE_NULL_STR) return NULL;
+    if ((size_t)(r->end - r->p) < *len) {
+        r->ok = 0;
+        return NULL;
+    }
+    const char *s = r->p;
+    r->p += *len;
+    return s;
+}
+
+char *cache_read_strdup(CacheReader *r, Arena *arena) {
+    uint32_t len;
+    const char *s = cache_read_str(r, &len);
+    return s ? arena_strndup(arena, s, len) : NULL;
+}
+
+void put_signature(Buffer *buf, const RepoSignature *sig) {
+    buffer_put_i64(buf, sig->index_mtime);
+    buffer_put_i64(buf, sig->index_size);
+    buffer_put_i64(buf, sig->root_mtime);
+    buffer_put_i64(buf, sig->config_mtime);
+    buffer_put_i64(buf, sig->exclude_mtime);
+    buffer_put_i64(buf, (int64_t)sig->head_hash);
+    buffer_put_i64(buf, (int64_t)sig->worktree_digest);
+    buffer_put_i64(buf, (int64_t)sig->refs_hash);
+}
+
+void read_signature(CacheReader *r, RepoSignature *sig) {
+    sig->index_mtime = cache_read_i64(r);
+    sig->index_size = cache_read_i64(r);
+    sig->root_mtime = cache_read_i64(r);
+    sig->config_mtime = cache_read_i64(r);
+    sig->exclude_mtime = cache_read_i64(r);
+    sig->head_hash = (uint64_t)cache_read_i64(r);
+    sig->worktree_digest = (uint64_t)cache_read_i64(r);
+    sig->refs_hash = (uint64_t)cache_read_i64(r);
+}
+
+int64_t file_mtime_ns(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? stat_mtime_ns(&st) : -1;
+}
+
+// Hash the refs that ahead/behind and push status were computed from
+uint64_t refs_signature(const char *common_dir, const char *branch, const char *remote_branch) {
+    char ref[PATH_MAX];
+    char oid[128];
+    uint64_t h = 0;
+
+    if (remote_branch) {
+        if ((join_path(ref, sizeof(ref), "refs/remotes", remote_branch) == 0 &&
+             resolve_ref(common_dir, ref, oid, sizeof(oid))) ||
+            (join_path(ref, sizeof(ref), "refs/heads", remote_branch) == 0 &&
+             resolve_ref(common_dir, ref, oid, sizeof(oid)))) {
+            h = hash_mix(h, hash_bytes(oid, strlen(oid)));
+        }
+    }
+    if (branch && join_path(ref, sizeof(ref), "refs/remotes/origin", branch) == 0 &&
+        resolve_ref(common_dir, ref, oid, sizeof(oid))) {
+        h = hash_mix(h + 1, hash_bytes(oid, strlen(oid)));
+    }
+    return h;
+}
+
+// Build a repo's signature; branch and remote_branch name the refs its
+// result depends on. Returns -1 if the git directory can't be found.
+int compute_signature(const char *repo_path, const IndexScan *scan, const char *branch,
+                      const char *remote_branch, RepoSignature *sig) {
+    char git_dir[PATH_MAX];
+    char common_dir[PATH_MAX];
+    char path[PATH_MAX];
+
+    if (resolve_git_dirs(repo_path, git_dir, common_dir, sizeof(git_dir)) != 0) return -1;
+
+    memset(sig, 0, sizeof(*sig));
+    sig->index_mtime = scan->index_mtime;
+    sig->index_size = scan->index_size;
+    sig->root_mtime = file_mtime_ns(repo_path);
+    sig->config_mtime = join_path(path, sizeof(path), common_dir, "config") == 0 ? file_mtime_ns(path) : -1;
+    sig->exclude_mtime = join_path(path, sizeof(path), common_dir, "info/exclude") == 0 ? file_mtime_ns(path) : -1;
+    sig->head_hash = scan->head_hash;
+    sig->worktree_digest = scan->digest;
+    sig->refs_hash = refs_signature(common_dir, branch, remote_branch);
+    return 0;
+}
+
+// Global config and ignore files affect every repo; a change to any of
+// them invalidates the whole cache
+uint64_t cache_global_hash(void) {
+    char path[PATH_MAX];
+    const char *home = getenv("HOME");
+    const char *xdg = getenv("XDG_CONFIG_HOME");
+    uint64_t h = hash_bytes(CACHE_MAGIC, strlen(CACHE_MAGIC));
+
+    if (home) {
+        snprintf(path, sizeof(path), "%s/.gitconfig", home);
+        h = hash_mix(h, file_mtime_ns(path));
+    }
+    if (xdg && xdg[0]) {
+        snprintf(path, sizeof(path), "%s/git/config", xdg);
+        h = hash_mix(h, file_mtime_ns(path));
+        snprintf(path, sizeof(path), "%s/git/ignore", xdg);
+        h = hash_mix(h, file_mtime_ns(path));
+    } else if (home) {
+        snprintf(path, sizeof(path), "%s/.config/git/config", home);
+        h = hash_mix(h, file_mtime_ns(path));
+        snprintf(path, sizeof(path), "%s/.config/git/ignore", home);
+        h = hash_mix(h, file_mtime_ns(path));
+    }
+    return h;
+}
+
+// Directory holding uncommitted's cache files, created on demand.
+// Returns 0 on success.
+int get_cache_dir(char *out, size_t size) {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int n;
+
+    if (xdg && xdg[0]) {
+        n = snprintf(out, size, "%s", xdg);
+    } else if (home) {
+        n = snprintf(out, size, "%s/.cache", home);
+    } else {
+        return -1;
+    }
+    if (n < 0 || (size_t)n + 16 >= size) return -1;
+    mkdir(out, 0755);
+    strcat(out, "/uncommitted");
+    if (mkdir(out, 0755) != 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+// Canonical key for a repo, so relative and absolute scans share entries
+void cache_key(const char *repo_path, char *key, size_t size) {
+    char resolved[PATH_MAX];
+    if (realpath(repo_path, resolved)) snprintf(key, size, "%s", resolved);
+    else snprintf(key, size, "%s", repo_path);
+}
+
+// Find the offset of a loaded record by key, or 0
+size_t cache_find(const ScanCache *cache, const char *key) {
+    if (!cache->table) return 0;
+    size_t mask = cache->table_size - 1;
+    size_t len = strlen(key);
+    for (size_t i = hash_bytes(key, len) & mask; cache->table[i]; i = (i + 1) & mask) {
+        CacheReader r = {cache->data + cache->table[i], cache->data + cache->size, 1};
+        uint32_t record_len = cache_read_u32(&r);
+        r.end = r.p + record_len;
+        uint32_t key_len;
+        const char *record_key = cache_read_str(&r, &key_len);
+        if (record_key && key_len == len && memcmp(record_key, key, len) == 0) {
+            return cache->table[i];
+        }
+    }
+    return 0;
+}
+
+// Load the cache file with a single read. A missing or incompatible file
+// just gives an empty cache.
+void load_scan_cache(ScanCache *cache) {
+    memset(cache, 0, sizeof(*cache));
+    init_buffer(&cache->updates);
+    init_string_set(&cache->updated);
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->global_hash = cache_global_hash();
+
+    char path[PATH_MAX];
+    if (get_cache_dir(path, sizeof(path) - 16) != 0) return;
+    strcat(path, "/scan.bin");
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 24) {
+        close(fd);
+        return;
+    }
+    cache->data = malloc(st.st_size);
+    ssize_t n = cache->data ? read(fd, cache->data, st.st_size) : -1;
+    close(fd);
+    if (n != st.st_size) {
+        free(cache->data);
+        cache->data = NULL;
+        return;
+    }
+    cache->size = n;
+
+    CacheReader r = {cache->data, cache->data + cache->size, 1};
+    char magic[8];
+    cache_read(&r, magic, sizeof(magic));
+    uint32_t bom = cache_read_u32(&r);
+    uint64_t global_hash = (uint64_t)cache_read_i64(&r);
+    uint32_t count = cache_read_u32(&r);
+    if (!r.ok || memcmp(magic, CACHE_MAGIC, 8) != 0 || bom != CACHE_BOM ||
+        global_hash != cache->global_hash) {
+        free(cache->data);
+        cache->data = NULL;
+        cache->size = 0;
+        return;
+    }
+
+    cache->table_size = 16;
+    while (cache->table_size < (size_t)count * 2) cache->table_size *= 2;
+    cache->table = calloc(cache->table_size, sizeof(size_t));
+    size_t mask = cache->table_size - 1;
+    for (uint32_t i = 0; i < count && r.ok; i++) {
+        size_t offset = r.p - cache->data;
+        uint32_t record_len = cache_read_u32(&r);
+        if (!r.ok || (size_t)(r.end - r.p) < record_len) break;
+        CacheReader rec = {r.p, r.p + record_len, 1};
+        uint32_t key_len;
+        const char *key = cache_read_str(&rec, &key_len);
+        r.p += record_len;
+        if (!key) continue;
+
+        size_t slot = hash_bytes(key, key_len) & mask;
+        while (cache->table[slot]) slot = (slot + 1) & mask;
+        cache->table[slot] = offset;
+    }
+}
+
+// Serve a repo from the cache if its signature still matches.
+// Returns 1 and fills repo on a hit.
+int scan_cache_lookup(ScanCache *cache, const char *repo_path, const IndexScan *scan, GitRepo *repo) {
+    char key[PATH_MAX];
+    cache_key(repo_path, key, sizeof(key));
+    size_t offset = cache_find(cache, key);
+    if (!offset) return 0;
+
+    CacheReader r = {cache->data + offset, cache->data + cache->size, 1};
+    uint32_t record_len = cache_read_u32(&r);
+    r.end = r.p + record_len;
+    uint32_t key_len;
+    cache_read_str(&r, &key_len);
+
+    RepoSignature cached;
+    read_signature(&r, &cached);
+    int ahead = cache_read_u32(&r);
+    int behind = cache_read_u32(&r);
+    int has_remote = cache_read_u32(&r);
+    int is_pushed = cache_read_u32(&r);
+    int staged_count = cache_read_u32(&r);
+    int unstaged_count = cache_read_u32(&r);
+    int untracked_count = cache_read_u32(&r);
+    uint32_t change_count = cache_read_u32(&r);
+    uint32_t branch_len, remote_branch_len;
+    const char *cached_path_start = r.p;
+    uint32_t path_len;
+    cache_read_str(&r, &path_len);
+    const char *branch = cache_read_str(&r, &branch_len);
+    const char *remote_branch = cache_read_str(&r, &remote_branch_len);
+    if (!r.ok) return 0;
+
+    char branch_buf[PATH_MAX], remote_buf[PATH_MAX];
+    if (branch) snprintf(branch_buf, sizeof(branch_buf), "%.*s", (int)branch_len, branch);
+    if (remote_branch) snprintf(remote_buf, sizeof(remote_buf), "%.*s", (int)remote_branch_len, remote_branch);
+
+    RepoSignature current;
+    if (compute_signature(repo_path, scan, branch ? branch_buf : NULL,
+                          remote_branch ? remote_buf : NULL, &current) != 0 ||
+        memcmp(&current, &cached, sizeof(current)) != 0) {
+        return 0;
+    }
+
+    // Signature matches: rebuild the repo from the record
+    r.p = cached_path_start;
+    uint32_t skip_len;
+    cache_read_str(&r, &skip_len);  // path as it was scanned then
+    repo->path = arena_strdup(&repo->arena, repo_path);
+    repo->branch = cache_read_strdup(&r, &repo->arena);
+    repo->remote_branch = cache_read_strdup(&r, &repo->arena);
+    repo->remote_url = cache_read_strdup(&r, &repo->arena);
+    repo->ahead = ahead;
+    repo->behind = behind;
+    repo->has_remote = has_remote;
+    repo->is_pushed = is_pushed;
+    repo->staged_count = staged_count;
+    repo->unstaged_count = unstaged_count;
+    repo->untracked_count = untracked_count;
+    for (uint32_t i = 0; i < change_count && r.ok; i++) {
+        unsigned char flags[2];
+        cache_read(&r, flags, sizeof(flags));
+        uint32_t name_len;
+        const char *name = cache_read_str(&r, &name_len);
+        if (!name) break;
+        add_change(&repo->changes, name, name_len, (char)flags[0], flags[1]);
+    }
+    return r.ok;
+}
+
+// Record a freshly inspected repo for the next run
+void scan_cache_store(ScanCache *cache, const char *repo_path, const IndexScan *scan, const GitRepo *repo) {
+    char key[PATH_MAX];
+    RepoSignature sig;
+    if (compute_signature(repo_path, scan, repo->branch, repo->remote_branch, &sig) != 0) return;
+    cache_key(repo_path, key, sizeof(key));
+
+    Buffer rec;
+    init_buffer(&rec);
+    buffer_put_u32(&rec, 0);  // record length, filled in below
+    buffer_put_str(&rec, key);
+    put_signature(&rec, &sig);
+    buffer_put_u32(&rec, repo->ahead);
+    buffer_put_u32(&rec, repo->behind);
+    buffer_put_u32(&rec, repo->has_remote);
+    buffer_put_u32(&rec, repo->is_pushed);
+    buffer_put_u32(&rec, repo->staged_count);
+    buffer_put_u32(&rec, repo->unstaged_count);
+    buffer_put_u32(&rec, repo->untracked_count);
+    buffer_put_u32(&rec, repo->changes.count);
+    buffer_put_str(&rec, repo->path);
+    buffer_put_str(&rec, repo->branch);
+    buffer_put_str(&rec, repo->remote_branch);
+    buffer_put_str(&rec, repo->remote_url);
+    for (int i = 0; i < repo->changes.count; i++) {
+        unsigned char flags[2] = {(unsigned char)change_status(&repo->changes, i),
+                                  (unsigned char)change_staged(&repo->changes, i)};
+        size_t dir_len;
+        const char *dir = change_dir(&repo->changes, i, &dir_len);
+        const char *name = change_name(&repo->changes, i);
+        size_t name_len = strlen(name);
+        buffer_put(&rec, flags, sizeof(flags));
+        buffer_put_u32(&rec, dir_len + name_len);  // as buffer_put_str would
+        buffer_put(&rec, dir, dir_len);
+        buffer_put(&rec, name, name_len);
+    }
+    uint32_t record_len = rec.len - sizeof(uint32_t);
+    memcpy(rec.data, &record_len, sizeof(record_len));
+
+    pthread_mutex_lock(&cache->lock);
+    if (string_set_add(&cache->updated, key, strlen(key))) {
+        buffer_put(&cache->updates, rec.data, rec.len);
+        cache->update_count++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    free_buffer(&rec);
+}
+
+// Write this run's records plus the untouched old ones, replacing the
+// cache file atomically
+void save_scan_cache(ScanCache *cache) {
+    char dir[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX];
+    if (get_cache_dir(dir, sizeof(dir)) != 0) return;
+    if (join_path(path, sizeof(path), dir, "scan.bin") != 0) return;
+    if (snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid()) >= (int)sizeof(tmp)) return;
+
+    Buffer out;
+    init_buffer(&out);
+    buffer_put(&out, CACHE_MAGIC, 8);
+    buffer_put_u32(&out, CACHE_BOM);
+    buffer_put_i64(&out, (int64_t)cache->global_hash);
+    size_t count_offset = out.len;
+    buffer_put_u32(&out, 0);
+    uint32_t count = cache->update_count;
+    buffer_put(&out, cache->updates.data, cache->updates.len);
+
+    for (size_t i = 0; i < cache->table_size; i++) {
+        if (!cache->table[i]) continue;
+        CacheReader r = {cache->data + cache->table[i], cache->data + cache->size, 1};
+        uint32_t record_len = cache_read_u32(&r);
+        CacheReader rec = {r.p, r.p + record_len, 1};
+        uint32_t key_len;
+        const char *key = cache_read_str(&rec, &key_len);
+        if (!r.ok || !key || string_set_contains(&cache->updated, key, key_len)) continue;
+        buffer_put(&out, cache->data + cache->table[i], sizeof(uint32_t) + record_len);
+        count++;
+    }
+    memcpy(out.data + count_offset, &count, sizeof(count));
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        ssize_t n = write(fd, out.data, out.len);
+        close(fd);
+        if (n == (ssize_t)out.len) rename(tmp, path);
+        else unlink(tmp);
+    }
+    free_buffer(&out);
+}
+
+void free_scan_cache(ScanCache *cache) {
+    free(cache->data);
+    free(cache->table);
+    free_buffer(&cache->updates);
+    free_string_set(&cache->updated);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+// Renders boxes into a growable buffer that is written out in one go
+typedef struct {
+    Buffer out;
+    int width;             // box width
+    char *horiz;           // the width - 2 HORIZ glyphs between two corners
+    size_t horiz_len;
+    int show_files;        // 0 with --summary
+    int max_files;         // --max-files: file rows per repo, 0 for no limit
+    int fd;                // where flushes go; -1 for stdout
+    int hold;              // flushes keep the output until hold is cleared
+} Renderer;
+
+void init_renderer(Renderer *r, int width) {
+    init_buffer(&r->out);
+    r->width = width;
+    r->show_files = 1;
+    r->max_files = 0;
+    r->fd = -1;
+    r->hold = 0;
+    int count = width > 2 ? width - 2 : 0;
+    size_t glyph_len = strlen(HORIZ);
+    r->horiz_len = count * glyph_len;
+    r->horiz = malloc(r->horiz_len + 1);
+    if (!r->horiz) {
+        fprintf(stderr, "Failed to allocate memory for borders\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) memcpy(r->horiz + i * glyph_len, HORIZ, glyph_len);
+    r->horiz[r->horiz_len] = '\0';
+}
+
+void free_renderer(Renderer *r) {
+    free_buffer(&r->out);
+    free(r->horiz);
+}
+
+// Decode one UTF-8 sequence into *c; returns its length. Invalid bytes
+// decode one at a time as themselves.
+size_t utf8_decode(const char *s, size_t len, uint32_t *c) {
+    const unsigned char *u = (const unsigned char *)s;
+    size_t n = u[0] >= 0xf0 ? 4 : u[0] >= 0xe0 ? 3 : u[0] >= 0xc0 ? 2 : 1;
+    if (n > len || u[0] >= 0xf8 || (u[0] >= 0x80 && u[0] < 0xc0)) n = 1;
+    uint32_t v = n == 1 ? u[0] : u[0] & (0x7f >> n);
+    for (size_t i = 1; i < n; i++) {
+        if ((u[i] & 0xc0) != 0x80) {
+            *c = u[0];
+            return 1;
+        }
+        v = (v << 6) | (u[i] & 0x3f);
+    }
+    *c = v;
+    return n;
+}
+
+// Length of the well-formed UTF-8 sequence at s (no overlong forms,
+// surrogates or code points past U+10FFFF), or 0 if there isn't one
+size_t utf8_valid_len(const char *s, size_t len) {
+    const unsigned char *u = (const unsigned char *)s;
+    size_t n;
+    unsigned char lo = 0x80, hi = 0xbf;  // allowed range of the second byte
+    if (u[0] < 0x80) return 1;
+    if (u[0] >= 0xc2 && u[0] <= 0xdf) n = 2;
+    else if (u[0] >= 0xe0 && u[0] <= 0xef) {
+        n = 3;
+        if (u[0] == 0xe0) lo = 0xa0;
+        if (u[0] == 0xed) hi = 0x9f;
+    } else if (u[0] >= 0xf0 && u[0] <= 0xf4) {
+        n = 4;
+        if (u[0] == 0xf0) lo = 0x90;
+        if (u[0] == 0xf4) hi = 0x8f;
+    } else {
+        return 0;
+    }
+    if (n > len || u[1] < lo || u[1] > hi) return 0;
+    for (size_t i = 2; i < n; i++) {
+        if ((u[i] & 0xc0) != 0x80) return 0;
+    }
+    return n;
+}
+
+// Terminal columns taken by a code point: 0 for combining marks and other
+// zero-width characters, 2 for East Asian wide ones and emoji
+int codepoint_width(uint32_t c) {
+    static const uint32_t zero[][2] = {
+        {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x0610, 0x061a},
+        {0x064b, 0x065f}, {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e},
+        {0x1ab0, 0x1aff}, {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x202a, 0x202e},
+        {0x2060, 0x2064}, {0x20d0, 0x20ff}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f},
+        {0xfeff, 0xfeff}, {0xe0100, 0xe01ef},
+    };
+    static const uint32_t wide[][2] = {
+        {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec},
+        {0x25fd, 0x25fe}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x26aa, 0x26ab},
+        {0x26bd, 0x26be}, {0x26c4, 0x26c5}, {0x2705, 0x2705}, {0x270a, 0x270b},
+        {0x2728, 0x2728}, {0x274c, 0x274c}, {0x2753, 0x2755}, {0x2795, 0x2797},
+        {0x2b1b, 0x2b1c}, {0x2e80, 0x303e}, {0x3041, 0x33ff}, {0x3400, 0x4dbf},
+        {0x4e00, 0x9fff}, {0xa000, 0xa4cf}, {0xa960, 0xa97f}, {0xac00, 0xd7a3},
+        {0xf900, 0xfaff}, {0xfe10, 0xfe19}, {0xfe30, 0xfe6f}, {0xff00, 0xff60},
+        {0xffe0, 0xffe6}, {0x1f300, 0x1f64f}, {0x1f680, 0x1f6ff}, {0x1f900, 0x1f9ff},
+        {0x20000, 0x2fffd}, {0x30000, 0x3fffd},
+    };
+    if (c < 0x300) return c < 0x20 || (c >= 0x7f && c < 0xa0) ? 0 : 1;
+    for (size_t i = 0; i < sizeof(zero) / sizeof(zero[0]); i++) {
+        if (c >= zero[i][0] && c <= zero[i][1]) return 0;
+    }
+    for (size_t i = 0; i < sizeof(wide) / sizeof(wide[0]); i++) {
+        if (c >= wide[i][0] && c <= wide[i][1]) return 2;
+    }
+    return 1;
+}
+
+// Terminal columns taken by len bytes of UTF-8
+int display_width(const char *s, size_t len) {
+    int width = 0;
+    for (size_t i = 0; i < len;) {
+        // ASCII runs are the common case
+        if ((unsigned char)s[i] < 0x80) {
+            width += (unsigned char)s[i] >= 0x20 && s[i] != 0x7f;
+            i++;
+            continue;
+        }
+        uint32_t c;
+        i += utf8_decode(s + i, len - i, &c);
+        width += codepoint_width(c);
+    }
+    return width;
+}
+
+// Bytes of the longest prefix of s that fits in max columns; its width
+// goes to *width
+size_t fit_width(const char *s, size_t len, int max, int *width) {
+    size_t i = 0;
+    int w = 0;
+    while (i < len) {
+        uint32_t c;
+        size_t n = utf8_decode(s + i, len - i, &c);
+        int cw = codepoint_width(c);
+        if (w + cw > max) break;
+        w += cw;
+        i += n;
+    }
+    *width = w;
+    return i;
+}
+
+void render_bytes(Renderer *r, const char *s, size_t len) {
+    buffer_put(&r->out, s, len);
+}
+
+void render_str(Renderer *r, const char *s) {
+    render_bytes(r, s, strlen(s));
+}
+
+// Append n spaces (nothing if n <= 0)
+void render_pad(Renderer *r, int n) {
+    if (n <= 0) return;
+    buffer_reserve(&r->out, n);
+    memset(r->out.data + r->out.len, ' ', n);
+    r->out.len += n;
+}
+
+// Append s left-aligned in a field of the given width, like "%-*s"
+void render_field(Renderer *r, const char *s, size_t len, int width) {
+    render_bytes(r, s, len);
+    render_pad(r, width - (int)len);
+}
+
+// Append formatted text; returns the number of bytes added
+int render_fmt(Renderer *r, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n <= 0) return 0;
+
+    buffer_reserve(&r->out, n + 1);
+    va_start(ap, fmt);
+    vsnprintf(r->out.data + r->out.len, n + 1, fmt, ap);
+    va_end(ap);
+    r->out.len += n;
+    return n;
+}
+
+// Close a line whose content took len columns
+void render_line_end(Renderer *r, int len) {
+    render_pad(r, r->width - 2 - len);
+    render_str(r, BOX_EDGE "\n");
+}
+
+void render_horizontal_line(Renderer *r, const char *left, const char *right) {
+    render_str(r, CYAN);
+    render_str(r, left);
+    render_bytes(r, r->horiz, r->horiz_len);
+    render_str(r, right);
+    render_str(r, RESET "\n");
+}
+
+void render_centered(Renderer *r, const char *text) {
+    int len = strlen(text);
+    int width = display_width(text, len);
+    int padding = (r->width - width - 2) / 2;
+    render_str(r, BOX_EDGE);
+    render_pad(r, padding);
+    render_bytes(r, text, len);
+    render_line_end(r, padding + width);
+}
+
+// Write out everything rendered so far
+void flush_renderer(Renderer *r) {
+    if (r->hold) return;
+    if (r->fd < 0) {
+        if (r->out.len > 0) fwrite(r->out.data, 1, r->out.len, stdout);
+    } else {
+        // A client that went away just loses the rest
+        size_t off = 0;
+        while (off < r->out.len) {
+            ssize_t n = write(r->fd, r->out.data + off, r->out.len - off);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            off += n;
+        }
+    }
+    r->out.len = 0;
+}
+
+void print_repo_info(Renderer *r, const GitRepo *repo) {
+    int box_width = r->width;
+
+    // Repository header
+    render_horizontal_line(r, TOP_LEFT, TOP_RIGHT);
+
+    // Repository path, keeping its end when it's too long
+    render_str(r, BOX_EDGE " " BOLD WHITE);
+    size_t path_len = strlen(repo->path);
+    int path_width = display_width(repo->path, path_len);
+    if (path_width > box_width - 3) {
+        const char *tail = repo->path;
+        while (path_width > box_width - 6) {
+            uint32_t c;
+            size_t n = utf8_decode(tail, path_len - (tail - repo->path), &c);
+            path_width -= codepoint_width(c);
+            tail += n;
+        }
+        render_str(r, "...");
+        render_str(r, tail);
+        path_width += 3;
+    } else {
+        render_bytes(r, repo->path, path_len);
+    }
+    render_pad(r, box_width - path_width - 3);
+    render_str(r, RESET BOX_EDGE "\n");
+
+    render_horizontal_line(r, T_RIGHT, T_LEFT);
+
+    // Branch info
+    const char *branch = repo->branch ? repo->branch : "(unknown)";
+    render_str(r, BOX_EDGE "  " BOLD "Branch:" RESET " " GREEN);
+    render_str(r, branch);
+    render_str(r, RESET);
+    int len = 10 + display_width(branch, strlen(branch));
+
+    if (repo->remote_branch && repo->remote_branch[0]) {
+        render_str(r, " -> " BLUE);
+        render_str(r, repo->remote_branch);
+        render_str(r, RESET);
+        len += 4 + display_width(repo->remote_branch, strlen(repo->remote_branch));
+    }
+    render_line_end(r, len);
+
+    // Remote/Push status
+    render_str(r, BOX_EDGE "  " BOLD "Remote:" RESET " ");
+    len = 10;
+    if (!repo->has_remote) {
+        render_str(r, RED "No remote configured" RESET);
+        len += 20;  // "No remote configured"
+    } else {
+        // Check if it's a GitHub URL
+        int is_github = repo->remote_url &&
+            (strstr(repo->remote_url, "github.com") != NULL);
+
+        if (is_github) {
+            render_str(r, BLUE "GitHub" RESET);
+            len += 6;  // "GitHub"
+        } else {
+            render_str(r, GREEN "Remote configured" RESET);
+            len += 17;  // "Remote configured"
+        }
+
+        if (repo->is_pushed) {
+            render_str(r, " " GREEN "(pushed)" RESET);
+            len += 9;  // " (pushed)"
+        } else {
+            render_str(r, " " YELLOW "(not pushed)" RESET);
+            len += 13;  // " (not pushed)"
+        }
+    }
+    render_line_end(r, len);
+
+    // Ahead/Behind info
+    if (repo->ahead > 0 || repo->behind > 0) {
+        render_str(r, BOX_EDGE "  ");
+        len = 2;
+        if (repo->ahead > 0) {
+            render_str(r, GREEN);
+            len += render_fmt(r, "↑ %d ahead", repo->ahead) - 2;  // the arrow is 3 bytes wide
+            render_str(r, RESET);
+        }
+        if (repo->ahead > 0 && repo->behind > 0) {
+            render_str(r, "  ");
+            len += 2;
+        }
+        if (repo->behind > 0) {
+            render_str(r, RED);
+            len += render_fmt(r, "↓ %d behind", repo->behind) - 2;
+            render_str(r, RESET);
+        }
+        render_line_end(r, len);
+    }
+
+    // Summary
+    render_str(r, BOX_EDGE "  " BOLD "Summary:" RESET " ");
+    len = 11;
+    if (repo->staged_count > 0) {
+        render_str(r, GREEN);
+        len += render_fmt(r, "%d staged", repo->staged_count) + 1;
+        render_str(r, RESET " ");
+    }
+    if (repo->unstaged_count > 0) {
+        render_str(r, YELLOW);
+        len += render_fmt(r, "%d modified", repo->unstaged_count) + 1;
+        render_str(r, RESET " ");
+    }
+    if (repo->untracked_count > 0) {
+        render_str(r, MAGENTA);
+        len += render_fmt(r, "%d untracked", repo->untracked_count);
+        render_str(r, RESET);
+    }
+    render_line_end(r, len);
+
+    // Changes may be missing when git was cut short
+    if (repo->timed_out || repo->truncated) {
+        const char *why = repo->timed_out ? "timed out, changes may be missing"
+                                          : "entry limit reached, list truncated";
+        render_str(r, BOX_EDGE "  " BOLD RED "Incomplete:" RESET " " RED);
+        render_str(r, why);
+        render_str(r, RESET);
+        render_line_end(r, 14 + (int)strlen(why));
+    }
+
+    if (!r->show_files) {
+        render_horizontal_line(r, BOT_LEFT, BOT_RIGHT);
+        render_str(r, "\n");
+        flush_renderer(r);
+        return;
+    }
+
+    render_horizontal_line(r, T_RIGHT, T_LEFT);
+
+    // Layout, in one pass over the rows shown: the file column grows to
+    // the longest path, up to what the box has beyond the default layout
+    const ChangeList *changes = &repo->changes;
+    int shown = changes->count;
+    if (r->max_files > 0 && shown > r->max_files) shown = r->max_files;
+    int max_file_width = box_width - (DEFAULT_WIDTH - FILE_COLUMN);
+    int file_width = max_file_width < FILE_COLUMN ? max_file_width : FILE_COLUMN;
+    int *widths = malloc((shown > 0 ? shown : 1) * sizeof(int));
+    if (!widths) {
+        fprintf(stderr, "Failed to allocate memory for file list\n");
+        exit(1);
+    }
+    for (int i = 0; i < shown; i++) {
+        size_t dir_len;
+        const char *dir = change_dir(changes, i, &dir_len);
+        const char *name = change_name(changes, i);
+        widths[i] = display_width(dir, dir_len) + display_width(name, strlen(name));
+        if (widths[i] > file_width) file_width = widths[i] < max_file_width ? widths[i] : max_file_width;
+    }
+    int row_width = 2 + file_width + 2 + STATUS_COLUMN;
+
+    // File list header
+    render_str(r, BOX_EDGE "  " BOLD);
+    render_field(r, "File", 4, file_width);
+    render_str(r, "  ");
+    render_field(r, "Status", 6, STATUS_COLUMN);
+    render_str(r, RESET);
+    render_line_end(r, row_width);
+
+    // File list
+    for (int i = 0; i < shown; i++) {
+        char status = change_status(changes, i);
+        int staged = change_staged(changes, i);
+        const char *color = get_status_color(status, staged);
+        const char *status_label = get_status_label(status, staged);
+
+        render_str(r, BOX_EDGE "  ");
+        render_str(r, color);
+
+        // Truncate filename for display if needed
+        size_t dir_len;
+        const char *dir = change_dir(changes, i, &dir_len);
+        const char *name = change_name(changes, i);
+        size_t name_len = strlen(name);
+        if (widths[i] > file_width) {
+            int dir_width, name_width = 0;
+            size_t keep = fit_width(dir, dir_len, file_width - 3, &dir_width);
+            render_bytes(r, dir, keep);
+            if (keep == dir_len) {
+                render_bytes(r, name, fit_width(name, name_len, file_width - 3 - dir_width, &name_width));
+            }
+            render_str(r, "...");
+            render_pad(r, file_width - 3 - dir_width - name_width);
+        } else {
+            render_bytes(r, dir, dir_len);
+            render_bytes(r, name, name_len);
+            render_pad(r, file_width - widths[i]);
+        }
+
+        render_str(r, RESET "  ");
+        render_str(r, color);
+        render_field(r, status_label, strlen(status_label), STATUS_COLUMN);
+        render_str(r, RESET);
+        render_line_end(r, row_width);
+    }
+    free(widths);
+
+    // Rows cut by --max-files
+    if (shown < changes->count) {
+        render_str(r, BOX_EDGE "  ");
+        int more = render_fmt(r, "… and %d more", changes->count - shown) - 2;  // "…" is 3 bytes
+        render_line_end(r, 2 + more);
+    }
+
+    render_horizontal_line(r, BOT_LEFT, BOT_RIGHT);
+    render_str(r, "\n");
+    flush_renderer(r);
+}
+
+void print_header(Renderer *r) {
+    render_str(r, "\n");
+    render_horizontal_line(r, TOP_LEFT, TOP_RIGHT);
+    render_str(r, BOX_EDGE);
+
+    const char *title = "  GIT UNCOMMITTED CHANGES SCANNER  ";
+    int title_len = display_width(title, strlen(title));
+    int padding = (r->width - title_len - 2) / 2;
+
+    render_pad(r, padding);
+    render_str(r, BOLD BG_BLUE);
+    render_str(r, title);
+    render_str(r, RESET);
+    render_line_end(r, padding + title_len);
+
+    render_horizontal_line(r, BOT_LEFT, BOT_RIGHT);
+    render_str(r, "\n");
+    flush_renderer(r);
+}
+
+void print_summary(Renderer *r, int total_repos, int total_staged, int total_unstaged, int total_untracked) {
+    render_horizontal_line(r, TOP_LEFT, TOP_RIGHT);
+
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "SUMMARY: %d repositories with uncommitted changes", total_repos);
+    render_centered(r, buffer);
+
+    render_horizontal_line(r, T_RIGHT, T_LEFT);
+
+    render_fmt(r, BOX_EDGE "  " GREEN "%d" RESET " staged  |  " YELLOW "%d" RESET " modified  |  "
+               MAGENTA "%d" RESET " untracked",
+               total_staged, total_unstaged, total_untracked);
+    // The same text without its color codes, for its width
+    int len = snprintf(buffer, sizeof(buffer), "  %d staged  |  %d modified  |  %d untracked",
+                       total_staged, total_unstaged, total_untracked);
+    render_line_end(r, len);
+
+    render_horizontal_line(r, BOT_LEFT, BOT_RIGHT);
+    render_str(r, "\n");
+    flush_renderer(r);
+}
+
+// Append len bytes of s escaped for a JSON string, without the quotes.
+// Bytes that aren't valid UTF-8 become U+FFFD, one per byte, so the line
+// still parses.
+void render_json_chars(Renderer *r, const char *s, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const char *end = s + len;
+    const char *run = s;
+    for (; s < end; s++) {
+        unsigned char c = *s;
+        if (c >= 0x80) {
+            size_t n = utf8_valid_len(s, end - s);
+            if (n > 0) {
+                s += n - 1;
+                continue;
+            }
+            render_bytes(r, run, s - run);
+            render_str(r, "\\ufffd");
+            run = s + 1;
+            continue;
+        }
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        render_bytes(r, run, s - run);
+        run = s + 1;
+        switch (c) {
+            case '"': render_str(r, "\\\""); break;
+            case '\\': render_str(r, "\\\\"); break;
+            case '\n': render_str(r, "\\n"); break;
+            case '\t': render_str(r, "\\t"); break;
+            default: {
+                char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+                render_bytes(r, esc, sizeof(esc));
+            }
+        }
+    }
+    render_bytes(r, run, s - run);
+}
+
+// Append s as a JSON string literal
+void render_json_str(Renderer *r, const char *s) {
+    render_bytes(r, "\"", 1);
+    render_json_chars(r, s, strlen(s));
+    render_bytes(r, "\"", 1);
+}
+
+void render_json_str_or_null(Renderer *r, const char *s) {
+    if (s) render_json_str(r, s);
+    else render_str(r, "null");
+}
+
+// One line of JSON per repo
+void print_repo_json(Renderer *r, const GitRepo *repo) {
+    render_str(r, "{\"type\":\"repo\",\"path\":");
+    render_json_str(r, repo->path);
+    render_str(r, ",\"branch\":");
+    render_json_str_or_null(r, repo->branch);
+    render_str(r, ",\"upstream\":");
+    render_json_str_or_null(r, repo->remote_branch && repo->remote_branch[0] ? repo->remote_branch : NULL);
+    render_str(r, ",\"remote_url\":");
+    render_json_str_or_null(r, repo->remote_url);
+    render_fmt(r, ",\"has_remote\":%s,\"pushed\":%s,\"ahead\":%d,\"behind\":%d,"
+               "\"staged\":%d,\"unstaged\":%d,\"untracked\":%d",
+               repo->has_remote ? "true" : "false", repo->is_pushed ? "true" : "false",
+               repo->ahead, repo->behind,
+               repo->staged_count, repo->unstaged_count, repo->untracked_count);
+    if (repo->timed_out) render_str(r, ",\"timed_out\":true");
+    if (repo->truncated) render_str(r, ",\"truncated\":true");
+    if (r->show_files) {
+        render_str(r, ",\"changes\":[");
+        const ChangeList *changes = &repo->changes;
+        for (int i = 0; i < changes->count; i++) {
+            size_t dir_len;
+            const char *dir = change_dir(changes, i, &dir_len);
+            const char *name = change_name(changes, i);
+            char status = change_status(changes, i);
+            render_str(r, i ? ",{\"path\":\"" : "{\"path\":\"");
+            render_json_chars(r, dir, dir_len);
+            render_json_chars(r, name, strlen(name));
+            render_str(r, "\",\"status\":\"");
+            render_bytes(r, &status, 1);
+            render_str(r, change_staged(changes, i) ? "\",\"staged\":true}" : "\",\"staged\":false}");
+        }
+        render_str(r, "]");
+    }
+    render_str(r, "}\n");
+    flush_renderer(r);
+}
+
+void print_summary_json(Renderer *r, int total_repos, int total_staged, int total_unstaged, int total_untracked) {
+    render_fmt(r, "{\"type\":\"summary\",\"repos\":%d,\"staged\":%d,\"unstaged\":%d,\"untracked\":%d}\n",
+               total_repos, total_staged, total_unstaged, total_untracked);
+    flush_renderer(r);
+}
+
+// Append one NUL-terminated record
+void render_record(Renderer *r, const char *key, const char *value) {
+    render_str(r, key);
+    render_bytes(r, " ", 1);
+    render_bytes(r, value, strlen(value) + 1);
+}
+
+// NUL-terminated records, starting with "repo <path>". Then come "branch",
+// "upstream" and "remote" when known, "ab +<ahead> -<behind>",
+// "pushed 0|1", and one "<status><S|.> <filename>" per change, where S
+// marks a staged change.
+void print_repo_nul(Renderer *r, const GitRepo *repo) {
+    render_record(r, "repo", repo->path);
+    if (repo->branch) render_record(r, "branch", repo->branch);
+    if (repo->remote_branch && repo->remote_branch[0]) render_record(r, "upstream", repo->remote_branch);
+    if (repo->remote_url) render_record(r, "remote", repo->remote_url);
+    render_fmt(r, "ab +%d -%d", repo->ahead, repo->behind);
+    render_bytes(r, "", 1);
+    render_record(r, "pushed", repo->is_pushed ? "1" : "0");
+    if (repo->timed_out) render_record(r, "incomplete", "timed-out");
+    else if (repo->truncated) render_record(r, "incomplete", "truncated");
+    const ChangeList *changes = &repo->changes;
+    for (int i = 0; r->show_files && i < changes->count; i++) {
+        size_t dir_len;
+        const char *dir = change_dir(changes, i, &dir_len);
+        const char *name = change_name(changes, i);
+        char key[4] = {change_status(changes, i), change_staged(changes, i) ? 'S' : '.', ' '};
+        render_bytes(r, key, 3);
+        render_bytes(r, dir, dir_len);
+        render_bytes(r, name, strlen(name) + 1);
+    }
+    flush_renderer(r);
+}
+
+void print_summary_nul(Renderer *r, int total_repos, int total_staged, int total_unstaged, int total_untracked) {
+    render_fmt(r, "summary %d %d %d %d", total_repos, total_staged, total_unstaged, total_untracked);
+    render_bytes(r, "", 1);
+    flush_renderer(r);
+}
+
+// Running totals for the summary footer
+typedef struct {
+    int repos;
+    int staged;
+    int unstaged;
+    int untracked;
+} ScanTotals;
+
+void add_to_totals(ScanTotals *totals, const GitRepo *repo) {
+    totals->repos++;
+    totals->staged += repo->staged_count;
+    totals->unstaged += repo->unstaged_count;
+    totals->untracked += repo->untracked_count;
+}
+
+// Totals over a whole list
+void sum_totals(const RepoList *list, ScanTotals *totals) {
+    memset(totals, 0, sizeof(*totals));
+    for (int i = 0; i < list->count; i++) add_to_totals(totals, &list->repos[i]);
+}
+
+// Repos that failed the index pre-check, taken cheapest (fewest index
+// entries) first by the early-exit modes
+typedef struct {
+    char *path;
+    IndexScan scan;
+    RepoProfile *profile;  // with --profile, the pre-check's record
+} Suspect;
+
+typedef struct {
+    Suspect *items;        // binary min-heap on scan.entries
+    int count;
+    int capacity;
+    pthread_mutex_t lock;
+} SuspectHeap;
+
+void init_suspect_heap(SuspectHeap *heap) {
+    heap->items = NULL;
+    heap->count = 0;
+    heap->capacity = 0;
+    pthread_mutex_init(&heap->lock, NULL);
+}
+
+// Caller holds heap->lock
+void push_suspect(SuspectHeap *heap, char *path, const IndexScan *scan, RepoProfile *rp) {
+    if (heap->count >= heap->capacity) {
+        heap->capacity = heap->capacity ? heap->capacity * 2 : INITIAL_REPOS_CAPACITY;
+        heap->items = realloc(heap->items, heap->capacity * sizeof(Suspect));
+        if (!heap->items) {
+            fprintf(stderr, "Failed to allocate memory for repo queue\n");
+            exit(1);
+        }
+    }
+    int i = heap->count++;
+    while (i > 0 && heap->items[(i - 1) / 2].scan.entries > scan->entries) {
+        heap->items[i] = heap->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->items[i].path = path;
+    heap->items[i].scan = *scan;
+    heap->items[i].profile = rp;
+}
+
+// Caller holds heap->lock. Returns 0 when the heap is empty.
+int pop_suspect(SuspectHeap *heap, Suspect *out) {
+    if (heap->count == 0) return 0;
+    *out = heap->items[0];
+    Suspect last = heap->items[--heap->count];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= heap->count) break;
+        if (child + 1 < heap->count &&
+            heap->items[child + 1].scan.entries < heap->items[child].scan.entries) {
+            child++;
+        }
+        if (heap->items[child].scan.entries >= last.scan.entries) break;
+        heap->items[i] = heap->items[child];
+        i = child;
+    }
+    if (heap->count > 0) heap->items[i] = last;
+    return 1;
+}
+
+void free_suspect_heap(SuspectHeap *heap) {
+    for (int i = 0; i < heap->count; i++) {
+        free(heap->items[i].path);
+        profile_repo_end(heap->items[i].profile);
+    }
+    free(heap->items);
+    pthread_mutex_destroy(&heap->lock);
+}
+
+// State shared between the directory walk and the worker threads
+typedef struct {
+    RepoQueue queue;
+    RepoList *list;
+    pthread_mutex_t list_lock; // also serializes output with --stream
+    ScanCache *cache;      // NULL with --no-cache
+    const Options *opts;
+    ScanTotals *totals;
+    Renderer *renderer;    // used under list_lock with --stream
+    int stop;              // set once --quiet or --any has its answer
+    SuspectHeap suspects;  // early-exit modes only
+} ScanContext;
+
+// Inspect a repo that failed the pre-check and keep, print or count it
+void inspect_repo(ScanContext *ctx, const char *path, const IndexScan *scan, Buffer *out) {
+    GitRepo repo;
+    init_git_repo(&repo);
+
+    // Budget for the git children run for this repo
+    GitBudget budget = {0};
+    if (ctx->opts->repo_timeout_ms) {
+        budget.deadline_ns = now_ns() + (int64_t)ctx->opts->repo_timeout_ms * 1000000;
+    }
+    budget.max_records = ctx->opts->max_entries;
+    git_budget = &budget;
+
+    int64_t probe = probe_start(PHASE_CACHE);
+    // Cached lists were read in full, so they can't honour --max-entries
+    int cached = ctx->cache && scan->cacheable && !ctx->opts->max_entries &&
+                 scan_cache_lookup(ctx->cache, path, scan, &repo);
+    probe_end(PHASE_CACHE, probe);
+    if (!cached) {
+        free_git_repo(&repo);
+        init_git_repo(&repo);
+        get_git_status(path, &repo, out, ctx->opts);
+        repo.timed_out = budget.timed_out;
+        repo.truncated = budget.truncated;
+        if (ctx->cache && scan->cacheable && !ctx->opts->count_only &&
+            !repo.timed_out && !repo.truncated) {
+            probe = probe_start(PHASE_CACHE);
+            scan_cache_store(ctx->cache, path, scan, &repo);
+            probe_end(PHASE_CACHE, probe);
+        }
+    }
+    git_budget = NULL;
+
+    if (repo_has_changes(&repo) && (ctx->opts->quiet || ctx->opts->any)) {
+        // The first dirty repo settles the answer; stop everything else
+        pthread_mutex_lock(&ctx->list_lock);
+        int first = !ctx->stop;
+        if (first) {
+            __atomic_store_n(&ctx->stop, 1, __ATOMIC_RELAXED);
+            add_to_totals(ctx->totals, &repo);
+            if (ctx->opts->any) {
+                printf("%s\n", repo.path);
+                fflush(stdout);
+            }
+        }
+        pthread_mutex_unlock(&ctx->list_lock);
+        if (first) cancel_git_children();
+        free_git_repo(&repo);
+    } else if (repo_is_reportable(&repo) && ctx->opts->stream) {
+        // Print right away; the header goes out with the first box
+        pthread_mutex_lock(&ctx->list_lock);
+        probe = probe_start(PHASE_RENDER);
+        if (ctx->opts->format == FORMAT_JSON) {
+            print_repo_json(ctx->renderer, &repo);
+        } else if (ctx->opts->format == FORMAT_NUL) {
+            print_repo_nul(ctx->renderer, &repo);
+        } else {
+            if (ctx->totals->repos == 0) print_header(ctx->renderer);
+            print_repo_info(ctx->renderer, &repo);
+        }
+        fflush(stdout);
+        probe_end(PHASE_RENDER, probe);
+        add_to_totals(ctx->totals, &repo);
+        pthread_mutex_unlock(&ctx->list_lock);
+        free_git_repo(&repo);
+    } else if (repo_is_reportable(&repo)) {
+        pthread_mutex_lock(&ctx->list_lock);
+        add_repo(ctx->list, &repo);
+        add_to_totals(ctx->totals, &repo);
+        pthread_mutex_unlock(&ctx->list_lock);
+    } else {
+        free_git_repo(&repo);
+    }
+}
+
+// Worker thread: inspect queued repos and keep (or, with --stream, print)
+// the ones with changes. In the early-exit modes repos that fail the
+// pre-check are parked in the suspect heap, and each pre-check is followed
+// by inspecting the cheapest suspect known so far.
+void *repo_worker(void *arg) {
+    ScanContext *ctx = arg;
+    int early_exit = ctx->opts->quiet || ctx->opts->any;
+    int check_untracked = !ctx->opts->untracked || strcmp(ctx->opts->untracked, "no") != 0;
+    Buffer out;
+    char *path;
+
+    init_buffer(&out);
+
+    while ((path = pop_repo_path(&ctx->queue)) != NULL) {
+        // Drain the queue once the answer is known
+        if (__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED)) {
+            free(path);
+            continue;
+        }
+
+        // Clean repos are settled by the index pre-check without git
+        RepoProfile *rp = profile_repo_begin(path);
+        IndexScan scan;
+        int64_t probe = probe_start(PHASE_PRECHECK);
+        scan_index(path, ctx->cache != NULL, check_untracked, &scan);
+        probe_end(PHASE_PRECHECK, probe);
+        if (scan.clean) {
+            profile_repo_end(rp);
+            free(path);
+            continue;
+        }
+
+        if (early_exit) {
+            Suspect next;
+            pthread_mutex_lock(&ctx->suspects.lock);
+            push_suspect(&ctx->suspects, path, &scan, rp);
+            pop_suspect(&ctx->suspects, &next);
+            pthread_mutex_unlock(&ctx->suspects.lock);
+            path = next.path;
+            scan = next.scan;
+            rp = next.profile;
+            profile_repo = rp;
+        }
+
+        inspect_repo(ctx, path, &scan, &out);
+        profile_repo_end(rp);
+        free(path);
+    }
+
+    // The walk is over; work through the remaining suspects
+    while (early_exit && !__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED)) {
+        Suspect next;
+        pthread_mutex_lock(&ctx->suspects.lock);
+        int have = pop_suspect(&ctx->suspects, &next);
+        pthread_mutex_unlock(&ctx->suspects.lock);
+        if (!have) break;
+        profile_repo = next.profile;
+        inspect_repo(ctx, next.path, &next.scan, &out);
+        profile_repo_end(next.profile);
+        free(next.path);
+    }
+
+    free_buffer(&out);
+    return NULL;
+}
+
+// Directory names that are too heavy to be worth walking
+static const char *const default_excludes[] = {
+    "node_modules", "target", "build", "vendor", "venv", "__pycache__",
+};
+
+// Directory names pruned from the walk: literal names are looked up in a
+// hash set, anything with glob characters goes through fnmatch
+typedef struct {
+    StringSet literals;
+    char **globs;
+    int glob_count;
+    int glob_capacity;
+} ExcludeSet;
+
+void init_exclude_set(ExcludeSet *set) {
+    init_string_set(&set->literals);
+    set->globs = NULL;
+    set->glob_count = 0;
+    set->glob_capacity = 0;
+}
+
+void add_exclude(ExcludeSet *set, const char *pattern) {
+    if (!pattern[0]) return;
+    if (!strpbrk(pattern, "*?[\\")) {
+        string_set_add(&set->literals, pattern, strlen(pattern));
+        return;
+    }
+    if (set->glob_count >= set->glob_capacity) {
+        set->glob_capacity = set->glob_capacity ? set->glob_capacity * 2 : 8;
+        set->globs = realloc(set->globs, set->glob_capacity * sizeof(char *));
+        if (!set->globs) {
+            fprintf(stderr, "Failed to allocate memory for exclude patterns\n");
+            exit(1);
+        }
+    }
+    set->globs[set->glob_count++] = strdup(pattern);
+}
+
+// Read one pattern per line from the excludes config file, if there is
+// one; blank lines and lines starting with '#' are ignored
+void load_exclude_file(ExcludeSet *set) {
+    const char *xdg = getenv("XDG_CONFIG_HOME");
+    const char *home = getenv("HOME");
+    char path[PATH_MAX];
+
+    if (xdg && xdg[0]) {
+        if (join_path(path, sizeof(path), xdg, "uncommitted/excludes") != 0) return;
+    } else if (home) {
+        if (join_path(path, sizeof(path), home, ".config/uncommitted/excludes") != 0) return;
+    } else {
+        return;
+    }
+
+    FILE *fp = fopen(path, "re");
+    if (!fp) return;
+
+    char line[PATH_MAX];
+    while (fgets(line, sizeof(line), fp)) {
+        char *start = line;
+        while (isspace((unsigned char)*start)) start++;
+        size_t len = strlen(start);
+        while (len > 0 && isspace((unsigned char)start[len - 1])) start[--len] = '\0';
+        if (len == 0 || start[0] == '#') continue;
+        add_exclude(set, start);
+    }
+    fclose(fp);
+}
+
+int is_excluded(const ExcludeSet *set, const char *name, size_t len) {
+    if (set->literals.count > 0 && string_set_contains(&set->literals, name, len)) return 1;
+    for (int i = 0; i < set->glob_count; i++) {
+        if (fnmatch(set->globs[i], name, 0) == 0) return 1;
+    }
+    return 0;
+}
+
+void free_exclude_set(ExcludeSet *set) {
+    free_string_set(&set->literals);
+    for (int i = 0; i < set->glob_count; i++) free(set->globs[i]);
+    free(set->globs);
+}
+
+// The built-in names, the excludes file and --exclude, in that order
+void build_exclude_set(ExcludeSet *set, const Options *opts) {
+    init_exclude_set(set);
+    if (opts->default_excludes) {
+        for (size_t i = 0; i < sizeof(default_excludes) / sizeof(default_excludes[0]); i++) {
+            add_exclude(set, default_excludes[i]);
+        }
+    }
+    load_exclude_file(set);
+    for (int i = 0; i < opts->exclude_count; i++) {
+        add_exclude(set, opts->excludes[i]);
+    }
+}
+
+// Discovery index: every directory the last walk from the same start read,
+// with its mtime. A directory whose mtime hasn't changed still has the
+// same entries, so its subdirectories (or the repo it is) come from the
+// index instead of readdir.
+#define DISCOVERY_MAGIC "UNCDSC01"
+#define DISCOVERY_RACY_NS 2000000000LL  // mtimes this close to the walk may change unseen
+
+// How a walk uses the discovery index
+enum {
+    DISCOVERY_OFF,         // crawl everything, index left alone
+    DISCOVERY_USE,         // replay unchanged directories, then update it
+    DISCOVERY_REFRESH,     // --rediscover: crawl everything, then rewrite it
+};
+
+typedef struct {
+    const char *path;      // into the loaded file, not NUL-terminated
+    uint32_t len;
+    int64_t mtime;         // -1: read the directory again
+    int is_repo;
+    int first_child;       // subdirectories walked, -1 for none
+    int next_sibling;
+} DiscoveryEntry;
+
+typedef struct {
+    char *data;            // file contents
+    size_t size;
+    DiscoveryEntry *entries;
+    int count;
+    int *table;            // entry index + 1 by path, open addressing
+    size_t mask;
+} DiscoveryIndex;
+
+void init_discovery_index(DiscoveryIndex *index) {
+    memset(index, 0, sizeof(*index));
+}
+
+// The index file for walks from start_path with these settings
+int discovery_index_path(const char *start_path, const ExcludeSet *excludes, int max_depth,
+                         char *out, size_t size) {
+    char dir[PATH_MAX];
+    char resolved[PATH_MAX];
+    if (get_cache_dir(dir, sizeof(dir)) != 0) return -1;
+
+    uint64_t h = hash_bytes(DISCOVERY_MAGIC, strlen(DISCOVERY_MAGIC));
+    h = hash_mix(h, hash_bytes(start_path, strlen(start_path)));
+    if (realpath(start_path, resolved)) h = hash_mix(h, hash_bytes(resolved, strlen(resolved)));
+    h = hash_mix(h, (uint64_t)(int64_t)max_depth);
+    // Literal names are summed, as their slot order depends on insertion
+    uint64_t literals = 0;
+    for (size_t i = 0; i < excludes->literals.capacity; i++) {
+        const char *name = excludes->literals.slots[i];
+        if (name) literals += hash_bytes(name, strlen(name));
+    }
+    h = hash_mix(h, literals);
+    for (int i = 0; i < excludes->glob_count; i++) {
+        h = hash_mix(h + 1, hash_bytes(excludes->globs[i], strlen(excludes->globs[i])));
+    }
+    int n = snprintf(out, size, "%s/discovery-%016llx.bin", dir, (unsigned long long)h);
+    return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
+
+int find_discovery_entry(const DiscoveryIndex *index, const char *path, size_t len) {
+    if (!index->table) return -1;
+    size_t slot = hash_bytes(path, len) & index->mask;
+    while (index->table[slot]) {
+        const DiscoveryEntry *entry = &index->entries[index->table[slot] - 1];
+        if (entry->len == len && memcmp(entry->path, path, len) == 0) return index->table[slot] - 1;
+        slot = (slot + 1) & index->mask;
+    }
+    return -1;
+}
+
+// Records are an i64 mtime, a u32 repo flag and the path. An unreadable
+// or damaged file leaves the index empty.
+void load_discovery_index(DiscoveryIndex *index, const char *file) {
+    init_discovery_index(index);
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 16) {
+        close(fd);
+        return;
+    }
+    index->data = malloc(st.st_size);
+    if (!index->data) {
+        fprintf(stderr, "Failed to allocate memory for discovery index\n");
+        exit(1);
+    }
+    index->size = read(fd, index->data, st.st_size) == st.st_size ? (size_t)st.st_size : 0;
+    close(fd);
+
+    CacheReader r = {index->data, index->data + index->size, index->size > 0};
+    char magic[8];
+    cache_read(&r, magic, sizeof(magic));
+    uint32_t bom = cache_read_u32(&r);
+    uint32_t count = cache_read_u32(&r);
+    // Each record takes at least 16 bytes
+    if (!r.ok || memcmp(magic, DISCOVERY_MAGIC, 8) != 0 || bom != CACHE_BOM ||
+        count > (index->size - 16) / 16) {
+        free(index->data);
+        init_discovery_index(index);
+        return;
+    }
+
+    size_t table_size = 16;
+    while (table_size < (size_t)count * 2) table_size *= 2;
+    index->entries = malloc((count > 0 ? count : 1) * sizeof(DiscoveryEntry));
+    index->table = calloc(table_size, sizeof(int));
+    if (!index->entries || !index->table) {
+        fprintf(stderr, "Failed to allocate memory for discovery index\n");
+        exit(1);
+    }
+    index->mask = table_size - 1;
+    for (uint32_t i = 0; i < count && r.ok; i++) {
+        DiscoveryEntry *entry = &index->entries[index->count];
+        entry->mtime = cache_read_i64(&r);
+        entry->is_repo = cache_read_u32(&r) != 0;
+        entry->path = cache_read_str(&r, &entry->len);
+        if (!r.ok || !entry->path || find_discovery_entry(index, entry->path, entry->len) >= 0) break;
+        entry->first_child = -1;
+        entry->next_sibling = -1;
+        size_t slot = hash_bytes(entry->path, entry->len) & index->mask;
+        while (index->table[slot]) slot = (slot + 1) & index->mask;
+        index->table[slot] = ++index->count;
+    }
+
+    // Link each directory to its parent, whose path it extends by "/name"
+    for (int i = 0; i < index->count; i++) {
+        DiscoveryEntry *entry = &index->entries[i];
+        const char *slash = memrchr(entry->path, '/', entry->len);
+        if (!slash) continue;
+        int parent = find_discovery_entry(index, entry->path, slash - entry->path);
+        if (parent < 0 || parent == i) continue;
+        entry->next_sibling = index->entries[parent].first_child;
+        index->entries[parent].first_child = i;
+    }
+}
+
+void free_discovery_index(DiscoveryIndex *index) {
+    free(index->data);
+    free(index->entries);
+    free(index->table);
+}
+
+// Write the records collected by each walker thread as the new index
+void save_discovery_index(const char *file, const Buffer *records, const uint32_t *counts, int threads) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.%ld", file, (long)getpid()) >= (int)sizeof(tmp)) return;
+
+    uint32_t count = 0;
+    for (int i = 0; i < threads; i++) count += counts[i];
+    Buffer out;
+    init_buffer(&out);
+    buffer_put(&out, DISCOVERY_MAGIC, 8);
+    buffer_put_u32(&out, CACHE_BOM);
+    buffer_put_u32(&out, count);
+    for (int i = 0; i < threads; i++) buffer_put(&out, records[i].data, records[i].len);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        ssize_t n = write(fd, out.data, out.len);
+        close(fd);
+        if (n == (ssize_t)out.len) rename(tmp, file);
+        else unlink(tmp);
+    }
+    free_buffer(&out);
+}
+
+// With --nested, the repo whose worktree a directory is in: its ignore
+// rules prune the walk. Shared by every queued directory under it.
+typedef struct {
+    char *root;
+    size_t root_len;
+    IgnoreMatcher ignores;
+    pthread_mutex_t lock;  // the matcher reads .gitignore files as it goes
+    int refs;
+} NestedRepo;
+
+NestedRepo *new_nested_repo(const char *root, size_t len) {
+    NestedRepo *repo = malloc(sizeof(NestedRepo));
+    if (!repo || !(repo->root = strndup(root, len))) {
+        fprintf(stderr, "Failed to allocate memory for nested repos\n");
+        exit(1);
+    }
+    repo->root_len = len;
+    init_ignore_matcher(&repo->ignores, repo->root);
+    pthread_mutex_init(&repo->lock, NULL);
+    repo->refs = 1;
+    return repo;
+}
+
+NestedRepo *hold_nested_repo(NestedRepo *repo) {
+    if (repo) __atomic_add_fetch(&repo->refs, 1, __ATOMIC_RELAXED);
+    return repo;
+}
+
+void release_nested_repo(NestedRepo *repo) {
+    if (!repo || __atomic_sub_fetch(&repo->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    free_ignore_matcher(&repo->ignores);
+    pthread_mutex_destroy(&repo->lock);
+    free(repo->root);
+    free(repo);
+}
+
+// Whether a subdirectory of repo's worktree is ignored there
+int nested_path_ignored(NestedRepo *repo, const char *path) {
+    if (strncmp(path, repo->root, repo->root_len) != 0 || path[repo->root_len] != '/') return 0;
+    pthread_mutex_lock(&repo->lock);
+    int ignored = path_is_ignored(&repo->ignores, path + repo->root_len + 1, 1);
+    pthread_mutex_unlock(&repo->lock);
+    return ignored == 1;
+}
+
+// A directory waiting to be walked
+typedef struct {
+    char *path;
+    int depth;             // levels below the start directory
+    int known;             // its discovery index entry, or -1
+    NestedRepo *owner;     // repo it's in with --nested, else NULL
+} DirTask;
+
+// Per-thread deque of directories waiting to be walked. The owner pushes
+// and pops at the tail (depth-first); idle threads steal from the head,
+// which holds the shallower, larger subtrees.
+typedef struct {
+    DirTask *tasks;
+    int head;
+    int tail;
+    int capacity;
+    pthread_mutex_t lock;
+} DirDeque;
+
+// Parallel directory walk shared by all walker threads
+typedef struct {
+    DirDeque *deques;      // one per walker thread
+    int count;
+    int pending;           // directories queued or being walked
+    unsigned generation;   // bumped whenever work is queued
+    int idle;              // threads waiting for work
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    RepoQueue *repos;      // discovered repos go straight to the status workers
+    const ExcludeSet *excludes;
+    int max_depth;
+    const int *stop;       // once set, remaining directories are skipped
+    const DiscoveryIndex *index;  // last walk's directories; NULL to crawl everything
+    Buffer *records;       // one per walker thread, NULL when not saving an index
+    uint32_t *record_counts;
+    int64_t racy_after;    // mtimes from here on aren't trusted next time
+    int nested;            // --nested: keep walking inside repos
+    int submodules;        // --submodules: queue the repos a repo links to
+    StringSet seen;        // canonical paths queued, with either of those
+    pthread_mutex_t seen_lock;
+} DirWalker;
+
+typedef struct {
+    DirWalker *walker;
+    int id;
+} WalkerThread;
+
+void push_dir(DirWalker *walker, int id, char *path, int depth, int known, NestedRepo *owner) {
+    DirDeque *dq = &walker->deques[id];
+
+    pthread_mutex_lock(&walker->idle_lock);
+    walker->pending++;
+    walker->generation++;
+    pthread_mutex_unlock(&walker->idle_lock);
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head > 0 && dq->head == dq->tail) {
+        dq->head = dq->tail = 0;
+    }
+    if (dq->tail >= dq->capacity) {
+        dq->capacity = dq->capacity ? dq->capacity * 2 : 64;
+        dq->tasks = realloc(dq->tasks, dq->capacity * sizeof(DirTask));
+        if (!dq->tasks) {
+            fprintf(stderr, "Failed to allocate memory for directory queue\n");
+            exit(1);
+        }
+    }
+    dq->tasks[dq->tail].path = path;
+    dq->tasks[dq->tail].depth = depth;
+    dq->tasks[dq->tail].known = known;
+    dq->tasks[dq->tail].owner = hold_nested_repo(owner);
+    dq->tail++;
+    pthread_mutex_unlock(&dq->lock);
+
+    pthread_mutex_lock(&walker->idle_lock);
+    if (walker->idle > 0) pthread_cond_signal(&walker->idle_cond);
+    pthread_mutex_unlock(&walker->idle_lock);
+}
+
+// Take a directory from our own deque, or steal one from another thread
+int take_dir(DirWalker *walker, int id, DirTask *task) {
+    for (int i = 0; i < walker->count; i++) {
+        int victim = (id + i) % walker->count;
+        DirDeque *dq = &walker->deques[victim];
+        int found = 0;
+
+        pthread_mutex_lock(&dq->lock);
+        if (dq->head < dq->tail) {
+            *task = (victim == id) ? dq->tasks[--dq->tail] : dq->tasks[dq->head++];
+            found = 1;
+        }
+        pthread_mutex_unlock(&dq->lock);
+        if (found) return 1;
+    }
+    return 0;
+}
+
+// Mark a directory as fully walked; wakes everyone once the walk is done
+void finish_dir(DirWalker *walker) {
+    pthread_mutex_lock(&walker->idle_lock);
+    if (--walker->pending == 0) pthread_cond_broadcast(&walker->idle_cond);
+    pthread_mutex_unlock(&walker->idle_lock);
+}
+
+void queue_repo(DirWalker *walker, const char *path);
+
+// --submodules: queue the checked-out submodules listed in .gitmodules and
+// the linked worktrees under the common git dir, without walking for them
+void queue_linked_repos(DirWalker *walker, const char *repo_path) {
+    char path[PATH_MAX];
+    char line[PATH_MAX];
+    struct stat st;
+
+    GitConfig modules;
+    init_git_config(&modules);
+    if (join_path(path, sizeof(path), repo_path, ".gitmodules") == 0) load_git_config(&modules, path);
+    for (int i = 0; i < modules.count; i++) {
+        const char *key = modules.keys[i];
+        const char *sub = modules.values[i];
+        size_t len = strlen(key);
+        if (strncmp(key, "submodule.", 10) != 0 || len < 15 || strcmp(key + len - 5, ".path") != 0) continue;
+        // Stay inside the worktree, whatever .gitmodules says
+        if (!sub[0] || sub[0] == '/' || strcmp(sub, "..") == 0 || strncmp(sub, "../", 3) == 0 ||
+            strstr(sub, "/../") || (strlen(sub) >= 3 && strcmp(sub + strlen(sub) - 3, "/..") == 0)) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s/.git", repo_path, sub) >= (int)sizeof(path)) continue;
+        if (stat(path, &st) != 0) continue;  // not checked out
+        path[strlen(path) - 5] = '\0';
+        queue_repo(walker, path);
+    }
+    free_git_config(&modules);
+
+    // Each worktrees/<name>/gitdir holds the path of the worktree's .git file
+    char git_dir[PATH_MAX];
+    char common_dir[PATH_MAX];
+    if (resolve_git_dirs(repo_path, git_dir, common_dir, sizeof(git_dir)) != 0 ||
+        join_path(path, sizeof(path), common_dir, "worktrees") != 0) {
+        return;
+    }
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char gitdir_file[PATH_MAX];
+        if (snprintf(gitdir_file, sizeof(gitdir_file), "%s/%s/gitdir", path, entry->d_name) >=
+                (int)sizeof(gitdir_file) ||
+            read_small_file(gitdir_file, line, sizeof(line)) != 0) {
+            continue;
+        }
+        size_t len = strlen(line);
+        if (line[0] != '/' || len < 6 || strcmp(line + len - 5, "/.git") != 0) continue;
+        if (stat(line, &st) != 0) continue;  // pruned but not yet cleaned up
+        line[len - 5] = '\0';
+        queue_repo(walker, line);
+    }
+    closedir(dir);
+}
+
+// Queue a repo for the status workers. With --nested or --submodules the
+// same repo can be reached more than once, so it's only queued the first
+// time its canonical path is seen.
+void queue_repo(DirWalker *walker, const char *path) {
+    if (!walker->nested && !walker->submodules) {
+        push_repo_path(walker->repos, path);
+        return;
+    }
+    char resolved[PATH_MAX];
+    if (!realpath(path, resolved)) return;
+    pthread_mutex_lock(&walker->seen_lock);
+    int added = string_set_add(&walker->seen, resolved, strlen(resolved));
+    pthread_mutex_unlock(&walker->seen_lock);
+    if (!added) return;
+
+    push_repo_path(walker->repos, path);
+    if (walker->submodules) queue_linked_repos(walker, path);
+}
+
+// Note a walked directory for the next discovery index
+void record_dir(DirWalker *walker, int id, const char *path, size_t len, int64_t mtime, int is_repo) {
+    if (!walker->records) return;
+    Buffer *out = &walker->records[id];
+    buffer_put_i64(out, mtime);
+    buffer_put_u32(out, is_repo);
+    buffer_put_u32(out, len);
+    buffer_put(out, path, len);
+    walker->record_counts[id]++;
+}
+
+// A directory that hasn't changed since the last walk: it's the repo it
+// was, or its subdirectories are the ones it had. Returns 0 when it has to
+// be read instead.
+int replay_directory(DirWalker *walker, int id, const Buffer *path, int depth, int known) {
+    const DiscoveryEntry *entry = &walker->index->entries[known];
+    struct stat st;
+    if (entry->mtime < 0 || stat(path->data, &st) != 0 || !S_ISDIR(st.st_mode) ||
+        stat_mtime_ns(&st) != entry->mtime) {
+        return 0;
+    }
+
+    record_dir(walker, id, path->data, path->len, entry->mtime, entry->is_repo);
+    if (entry->is_repo) {
+        queue_repo(walker, path->data);
+        return 1;
+    }
+    const DiscoveryEntry *entries = walker->index->entries;
+    for (int child = entry->first_child; child >= 0; child = entries[child].next_sibling) {
+        push_dir(walker, id, strndup(entries[child].path, entries[child].len), depth + 1, child, NULL);
+    }
+    return 1;
+}
+
+// Walk one directory: repos are handed to the status workers and
+// subdirectories queued for any walker. path is extended in place to
+// build the children's paths, so the only allocation is one string per
+// queued subdirectory; lookups are relative to the directory's fd.
+// Directories unchanged since the last walk are replayed from the
+// discovery index instead. With --nested the walk goes on inside repos,
+// skipping what their ignore rules exclude; owner is the repo path is in.
+void walk_directory(DirWalker *walker, int id, Buffer *path, int depth, int known, NestedRepo *owner) {
+    if (__atomic_load_n(walker->stop, __ATOMIC_RELAXED)) return;
+    if (known >= 0 && replay_directory(walker, id, path, depth, known)) return;
+
+    int dir_fd = open(path->data, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        // Tried again next time, e.g. once permissions allow it
+        record_dir(walker, id, path->data, path->len, -1, 0);
+        return;
+    }
+
+    // Taken before reading, so changes made meanwhile show up next time
+    int64_t mtime = -1;
+    struct stat dir_st;
+    if (walker->records && fstat(dir_fd, &dir_st) == 0) {
+        mtime = stat_mtime_ns(&dir_st);
+        if (mtime >= walker->racy_after) mtime = -1;
+    }
+
+    // Hand git repos to the workers
+    NestedRepo *repo = NULL;
+    if (is_git_repo_at(dir_fd)) {
+        record_dir(walker, id, path->data, path->len, mtime, 1);
+        queue_repo(walker, path->data);
+        if (!walker->nested) {
+            close(dir_fd);
+            return; // Don't recurse into .git subdirectories
+        }
+        repo = new_nested_repo(path->data, path->len);
+        owner = repo;
+    } else {
+        record_dir(walker, id, path->data, path->len, mtime, 0);
+    }
+    if (walker->max_depth >= 0 && depth >= walker->max_depth) {
+        release_nested_repo(repo);
+        close(dir_fd);
+        return;
+    }
+
+    DIR *dir = fdopendir(dir_fd);
+    if (!dir) {
+        release_nested_repo(repo);
+        close(dir_fd);
+        return;
+    }
+
+    struct dirent *entry;
+    size_t base_len = path->len;
+    while ((entry = readdir(dir)) != NULL) {
+        // Skip hidden directories and special entries
+        if (entry->d_name[0] == '.') continue;
+
+        // Prune excluded names before paying for a stat or an open
+        size_t name_len = strlen(entry->d_name);
+        if (is_excluded(walker->excludes, entry->d_name, name_len)) continue;
+
+        // d_type avoids a stat for most entries; symlinks are followed
+        // like stat() would
+        int is_dir = 0;
+        if (entry->d_type == DT_DIR) {
+            is_dir = 1;
+        } else if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            struct stat st;
+            is_dir = fstatat(dir_fd, entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (!is_dir) continue;
+
+        // Paths that wouldn't fit in PATH_MAX (e.g. symlink loops) end the descent
+        if (base_len + name_len + 2 > PATH_MAX) continue;
+
+        buffer_reserve(path, name_len + 7);  // room to check for name/.git
+        path->data[base_len] = '/';
+        memcpy(path->data + base_len + 1, entry->d_name, name_len + 1);
+        size_t child_len = base_len + 1 + name_len;
+        int child = walker->index ? find_discovery_entry(walker->index, path->data, child_len) : -1;
+        if (owner && nested_path_ignored(owner, path->data)) {
+            // An ignored subtree isn't walked, but a repo right there still counts
+            memcpy(path->data + child_len, "/.git", 6);
+            struct stat st;
+            int is_repo = stat(path->data, &st) == 0;
+            path->data[child_len] = '\0';
+            if (is_repo) push_dir(walker, id, strndup(path->data, child_len), depth + 1, child, NULL);
+        } else {
+            push_dir(walker, id, strndup(path->data, child_len), depth + 1, child, owner);
+        }
+        path->data[base_len] = '\0';
+    }
+
+    closedir(dir);
+    release_nested_repo(repo);
+}
+
+// Walker thread: walk directories until none are left anywhere
+void *walker_thread(void *arg) {
+    WalkerThread *self = arg;
+    DirWalker *walker = self->walker;
+    Buffer path;
+    init_buffer(&path);
+
+    for (;;) {
+        pthread_mutex_lock(&walker->idle_lock);
+        unsigned seen = walker->generation;
+        pthread_mutex_unlock(&walker->idle_lock);
+
+        DirTask task;
+        if (take_dir(walker, self->id, &task)) {
+            size_t len = strlen(task.path);
+            path.len = 0;
+            buffer_reserve(&path, len + 1);
+            memcpy(path.data, task.path, len + 1);
+            path.len = len;
+            free(task.path);
+
+            walk_directory(walker, self->id, &path, task.depth, task.known, task.owner);
+            release_nested_repo(task.owner);
+            finish_dir(walker);
+            continue;
+        }
+
+        // Nothing to take: wait for new work, or stop once the walk is done
+        pthread_mutex_lock(&walker->idle_lock);
+        if (walker->pending == 0) {
+            pthread_mutex_unlock(&walker->idle_lock);
+            break;
+        }
+        if (walker->generation == seen) {
+            walker->idle++;
+            pthread_cond_wait(&walker->idle_cond, &walker->idle_lock);
+            walker->idle--;
+        }
+        pthread_mutex_unlock(&walker->idle_lock);
+    }
+
+    free_buffer(&path);
+    return NULL;
+}
+
+// Discover repos under start_path with a pool of work-stealing walker
+// threads, queueing each one for the status workers as soon as it's found.
+// discovery says how the index of the last walk from here is used;
+// nested and submodules are --nested and --submodules.
+void scan_directories(const char *start_path, RepoQueue *queue, int threads,
+                      const ExcludeSet *excludes, int max_depth, const int *stop, int discovery,
+                      int nested, int submodules) {
+    char index_file[PATH_MAX];
+    DiscoveryIndex index;
+    init_discovery_index(&index);
+    if (discovery != DISCOVERY_OFF &&
+        discovery_index_path(start_path, excludes, max_depth, index_file, sizeof(index_file)) != 0) {
+        discovery = DISCOVERY_OFF;
+    }
+    if (discovery == DISCOVERY_USE) load_discovery_index(&index, index_file);
+
+    DirWalker walker;
+    walker.count = threads;
+    walker.deques = calloc(threads, sizeof(DirDeque));
+    walker.pending = 0;
+    walker.generation = 0;
+    walker.idle = 0;
+    walker.repos = queue;
+    walker.excludes = excludes;
+    walker.max_depth = max_depth;
+    walker.stop = stop;
+    walker.index = index.count > 0 ? &index : NULL;
+    walker.records = NULL;
+    walker.record_counts = NULL;
+    if (discovery != DISCOVERY_OFF) {
+        walker.records = calloc(threads, sizeof(Buffer));
+        walker.record_counts = calloc(threads, sizeof(uint32_t));
+        if (!walker.records || !walker.record_counts) {
+            fprintf(stderr, "Failed to allocate memory for discovery index\n");
+            exit(1);
+        }
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    walker.racy_after = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec - DISCOVERY_RACY_NS;
+    walker.nested = nested;
+    walker.submodules = submodules;
+    init_string_set(&walker.seen);
+    pthread_mutex_init(&walker.seen_lock, NULL);
+    pthread_mutex_init(&walker.idle_lock, NULL);
+    pthread_cond_init(&walker.idle_cond, NULL);
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&walker.deques[i].lock, NULL);
+    }
+
+    push_dir(&walker, 0, strdup(start_path), 0,
+             walker.index ? find_discovery_entry(walker.index, start_path, strlen(start_path)) : -1, NULL);
+
+    // This thread is walker 0
+    WalkerThread *selves = malloc(threads * sizeof(WalkerThread));
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        selves[i].walker = &walker;
+        selves[i].id = i;
+    }
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&tids[started], NULL, walker_thread, &selves[i]) == 0) {
+            started++;
+        }
+    }
+    walker_thread(&selves[0]);
+    for (int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        free(walker.deques[i].tasks);
+        pthread_mutex_destroy(&walker.deques[i].lock);
+    }
+    free(walker.deques);
+    free(selves);
+    free(tids);
+    // An interrupted walk would leave directories out
+    if (walker.records) {
+        if (!__atomic_load_n(stop, __ATOMIC_RELAXED)) {
+            save_discovery_index(index_file, walker.records, walker.record_counts, threads);
+        }
+        for (int i = 0; i < threads; i++) free_buffer(&walker.records[i]);
+        free(walker.records);
+        free(walker.record_counts);
+    }
+    free_discovery_index(&index);
+    free_string_set(&walker.seen);
+    pthread_mutex_destroy(&walker.seen_lock);
+    pthread_mutex_destroy(&walker.idle_lock);
+    pthread_cond_destroy(&walker.idle_cond);
+}
+
+// --verify-remote: whether a listed repo's branch is on origin is asked of
+// the remote with `git ls-remote`, instead of trusting remote-tracking refs
+// that are only as fresh as the last fetch. Answers are kept in remotes.txt
+// for --remote-ttl seconds.
+#define REMOTE_TTL_DEFAULT 300     // seconds
+#define REMOTE_JOBS_DEFAULT 8      // ls-remote processes at a time
+#define REMOTE_TIMEOUT_MS 10000    // per ls-remote, unless --repo-timeout is set
+
+typedef struct {
+    char *key;             // "<url>\t<branch>"
+    int64_t checked;       // unix time
+    int exists;            // the branch was on the remote
+} RemoteAnswer;
+
+typedef struct {
+    RemoteAnswer *answers;
+    int count;
+    int capacity;
+} RemoteCache;
+
+typedef struct {
+    GitRepo *repo;
+    char *key;
+    char host[256];
+    int exists;            // 1 or 0, -1 if the remote couldn't be asked
+} RemoteCheck;
+
+// A set of checks shared out to ls-remote threads
+typedef struct {
+    RemoteCheck *checks;
+    const int *order;      // indices into checks
+    int count;
+    int next;              // next entry of order to claim
+    const char *ssh_command;  // keeps master connections, or NULL
+    const Options *opts;
+} RemoteBatch;
+
+void init_remote_cache(RemoteCache *cache) {
+    cache->answers = NULL;
+    cache->count = 0;
+    cache->capacity = 0;
+}
+
+RemoteAnswer *find_remote_answer(const RemoteCache *cache, const char *key) {
+    for (int i = 0; i < cache->count; i++) {
+        if (strcmp(cache->answers[i].key, key) == 0) return &cache->answers[i];
+    }
+    return NULL;
+}
+
+void store_remote_answer(RemoteCache *cache, const char *key, int64_t checked, int exists) {
+    RemoteAnswer *answer = find_remote_answer(cache, key);
+    if (!answer) {
+        if (cache->count >= cache->capacity) {
+            cache->capacity = cache->capacity ? cache->capacity * 2 : 16;
+            cache->answers = realloc(cache->answers, cache->capacity * sizeof(RemoteAnswer));
+            if (!cache->answers) {
+                fprintf(stderr, "Failed to allocate memory for remote cache\n");
+                exit(1);
+            }
+        }
+        answer = &cache->answers[cache->count++];
+        answer->key = strdup(key);
+    }
+    answer->checked = checked;
+    answer->exists = exists;
+}
+
+// One "<checked> <exists> <url>\t<branch>" line per answer
+void load_remote_cache(RemoteCache *cache) {
+    char dir[PATH_MAX], path[PATH_MAX];
+    init_remote_cache(cache);
+    if (get_cache_dir(dir, sizeof(dir)) != 0 || join_path(path, sizeof(path), dir, "remotes.txt") != 0) return;
+    FILE *fp = fopen(path, "r");
+    if (!fp) return;
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    while (getline(&line, &line_cap, fp) > 0) {
+        long long checked;
+        int exists, key_off;
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%lld %d %n", &checked, &exists, &key_off) == 2 && strchr(line + key_off, '\t')) {
+            store_remote_answer(cache, line + key_off, checked, exists != 0);
+        }
+    }
+    free(line);
+    fclose(fp);
+}
+
+// Write back the answers checked after oldest
+void save_remote_cache(const RemoteCache *cache, int64_t oldest) {
+    char dir[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX];
+    if (get_cache_dir(dir, sizeof(dir)) != 0) return;
+    if (join_path(path, sizeof(path), dir, "remotes.txt") != 0) return;
+    if (snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid()) >= (int)sizeof(tmp)) return;
+
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) return;
+    for (int i = 0; i < cache->count; i++) {
+        const RemoteAnswer *answer = &cache->answers[i];
+        if (answer->checked <= oldest) continue;
+        fprintf(fp, "%lld %d %s\n", (long long)answer->checked, answer->exists, answer->key);
+    }
+    if (fclose(fp) == 0) rename(tmp, path);
+    else unlink(tmp);
+}
+
+void free_remote_cache(RemoteCache *cache) {
+    for (int i = 0; i < cache->count; i++) free(cache->answers[i].key);
+    free(cache->answers);
+}
+
+// Host part of a remote URL ("" for local paths), for grouping repos that
+// can share an SSH connection
+void remote_url_host(const char *url, char *host, size_t size) {
+    const char *p = strstr(url, "://");
+    const char *end;
+    if (p) {
+        p += 3;
+        const char *at = strchr(p, '@');
+        const char *slash = strchr(p, '/');
+        if (at && (!slash || at < slash)) p = at + 1;
+        end = p + strcspn(p, ":/");
+    } else if ((end = strchr(url, ':')) && !memchr(url, '/', end - url)) {
+        // scp-like "user@host:path"
+        const char *at = memchr(url, '@', end - url);
+        p = at ? at + 1 : url;
+    } else {
+        host[0] = '\0';
+        return;
+    }
+    snprintf(host, size, "%.*s", (int)(end - p), p);
+}
+
+// Does the config already pick an ssh command for this repo?
+int repo_sets_ssh_command(const char *repo_path) {
+    char git_dir[PATH_MAX];
+    char common_dir[PATH_MAX];
+    if (resolve_git_dirs(repo_path, git_dir, common_dir, sizeof(git_dir)) != 0) return 0;
+    GitConfig cfg;
+    init_git_config(&cfg);
+    load_repo_config(&cfg, common_dir);
+    int sets = git_config_get(&cfg, "core.sshcommand") != NULL;
+    free_git_config(&cfg);
+    return sets;
+}
+
+// Ask origin whether the repo's branch exists: 1 or 0, or -1 if it
+// couldn't be reached in time
+int ls_remote_branch(const GitRepo *repo, const RemoteBatch *batch, Buffer *out) {
+    char ref[PATH_MAX];
+    char ssh_arg[PATH_MAX + 160];
+    const char *args[8];
+    int n = 0;
+
+    snprintf(ref, sizeof(ref), "refs/heads/%s", repo->branch);
+    if (batch->ssh_command && !repo_sets_ssh_command(repo->path)) {
+        snprintf(ssh_arg, sizeof(ssh_arg), "core.sshCommand=%s", batch->ssh_command);
+        args[n++] = "-c";
+        args[n++] = ssh_arg;
+    }
+    args[n++] = "ls-remote";
+    args[n++] = "origin";
+    args[n++] = ref;
+    args[n] = NULL;
+
+    GitBudget budget = {0};
+    int timeout_ms = batch->opts->repo_timeout_ms ? batch->opts->repo_timeout_ms : REMOTE_TIMEOUT_MS;
+    budget.deadline_ns = now_ns() + (int64_t)timeout_ms * 1000000;
+    git_budget = &budget;
+    int64_t probe = probe_start(PHASE_REMOTE);
+    int status = run_git(repo->path, args, NULL, 0, out);
+    probe_end(PHASE_REMOTE, probe);
+    git_budget = NULL;
+    if (status != 0 || budget.timed_out) return -1;
+
+    // "<oid>\t<ref>" lines; the pattern also matches longer refs ending in it
+    size_t ref_len = strlen(ref);
+    size_t off = 0;
+    while (off < out->len) {
+        const char *line = out->data + off;
+        const char *nl = memchr(line, '\n', out->len - off);
+        size_t len = nl ? (size_t)(nl - line) : out->len - off;
+        const char *tab = memchr(line, '\t', len);
+        if (tab && (size_t)(line + len - tab - 1) == ref_len && memcmp(tab + 1, ref, ref_len) == 0) return 1;
+        off += len + 1;
+    }
+    return 0;
+}
+
+void *remote_worker(void *arg) {
+    RemoteBatch *batch = arg;
+    Buffer out;
+    int i;
+
+    init_buffer(&out);
+    while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->count) {
+        RemoteCheck *check = &batch->checks[batch->order[i]];
+        check->exists = ls_remote_branch(check->repo, batch, &out);
+    }
+    free_buffer(&out);
+    return NULL;
+}
+
+// Run a batch of checks, at most --remote-jobs at a time
+void run_remote_batch(RemoteBatch *batch) {
+    int jobs = batch->opts->remote_jobs < batch->count ? batch->opts->remote_jobs : batch->count;
+    pthread_t *threads = malloc((jobs > 0 ? jobs : 1) * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; threads && i < jobs; i++) {
+        if (pthread_create(&threads[started], NULL, remote_worker, batch) == 0) started++;
+    }
+    if (started == 0) remote_worker(batch);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+// Replace each listed repo's pushed state with what its remote says. The
+// ls-remote calls run side by side; the first one to each host goes ahead
+// of the rest, so the others can reuse its SSH master connection.
+void verify_remotes(RepoList *list, const Options *opts) {
+    RemoteCache cache;
+    load_remote_cache(&cache);
+    int64_t now = time(NULL);
+
+    RemoteCheck *checks = calloc(list->count > 0 ? list->count : 1, sizeof(RemoteCheck));
+    int *order = malloc((list->count > 0 ? list->count : 1) * sizeof(int));
+    if (!checks || !order) {
+        fprintf(stderr, "Failed to allocate memory for remote checks\n");
+        exit(1);
     }
+    int count = 0;
+    for (int i = 0; i < list->count; i++) {
+        GitRepo *repo = &list->repos[i];
+        if (!repo->has_remote || !repo->remote_url || !repo->branch || strcmp(repo->branch, "HEAD") == 0) continue;
+
+        // Relative paths to local remotes only mean something from the repo
+        char base[PATH_MAX + 2] = "";
+        char host[256];
+        remote_url_host(repo->remote_url, host, sizeof(host));
+        if (!host[0] && repo->remote_url[0] != '/') {
+            cache_key(repo->path, base, sizeof(base) - 1);
+            strcat(base, "/");
+        }
+        size_t key_len = strlen(base) + strlen(repo->remote_url) + strlen(repo->branch) + 2;
+        char *key = malloc(key_len);
+        if (!key) {
+            fprintf(stderr, "Failed to allocate memory for remote checks\n");
+            exit(1);
+        }
+        snprintf(key, key_len, "%s%s\t%s", base, repo->remote_url, repo->branch);
+        const RemoteAnswer *answer = find_remote_answer(&cache, key);
+        if (answer && now - answer->checked < opts->remote_ttl) {
+            repo->is_pushed = answer->exists;
+            free(key);
+            continue;
+        }
+        checks[count].repo = repo;
+        checks[count].key = key;
+        checks[count].exists = -1;
+        snprintf(checks[count].host, sizeof(checks[count].host), "%s", host);
+        count++;
+    }
+
+    // Hosts' first checks, then everything else
+    int firsts = 0;
+    for (int i = 0; i < count; i++) {
+        int seen = 0;
+        for (int j = 0; j < i && !seen; j++) seen = strcmp(checks[j].host, checks[i].host) == 0;
+        if (!seen) order[firsts++] = i;
+    }
+    int rest = firsts;
+    for (int i = 0; i < count; i++) {
+        int first = 0;
+        for (int j = 0; j < firsts && !first; j++) first = order[j] == i;
+        if (!first) order[rest++] = i;
+    }
+
+    char dir[PATH_MAX];
+    char ssh_command[PATH_MAX + 128];
+    RemoteBatch batch = {checks, order, firsts, 0, NULL, opts};
+    if (!getenv("GIT_SSH_COMMAND") && !getenv("GIT_SSH") && get_cache_dir(dir, sizeof(dir)) == 0 &&
+        !strchr(dir, '\'')) {
+        snprintf(ssh_command, sizeof(ssh_command),
+                 "ssh -o ControlMaster=auto -o 'ControlPath=%s/ssh-%%C' -o ControlPersist=60 -o BatchMode=yes", dir);
+        batch.ssh_command = ssh_command;
+    }
+    if (count > 0) {
+        run_remote_batch(&batch);
+        batch.order = order + firsts;
+        batch.count = count - firsts;
+        batch.next = 0;
+        run_remote_batch(&batch);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (checks[i].exists >= 0) {
+            checks[i].repo->is_pushed = checks[i].exists;
+            store_remote_answer(&cache, checks[i].key, now, checks[i].exists);
+        }
+        free(checks[i].key);
+    }
+    if (count > 0) save_remote_cache(&cache, now - opts->remote_ttl);
+    free(checks);
+    free(order);
+    free_remote_cache(&cache);
+}
+
+// Walk the tree and inspect the discovered repos with a pool of workers.
+// With start_path NULL the repos in paths are inspected instead of walking;
+// otherwise paths, if given, receives every repo the walk found.
+void scan_repositories(const char *start_path, RepoList *list, const Options *opts, ScanTotals *totals,
+                       Renderer *renderer, RepoPaths *paths) {
+    ScanContext ctx;
+    ScanCache cache;
+    int jobs = opts->jobs;
+    init_repo_queue(&ctx.queue);
+    ctx.list = list;
+    ctx.opts = opts;
+    ctx.totals = totals;
+    ctx.renderer = renderer;
+    ctx.stop = 0;
+    init_suspect_heap(&ctx.suspects);
+    pthread_mutex_init(&ctx.list_lock, NULL);
+    ctx.cache = NULL;
+    // Cached results were made with git's own untracked-files setting
+    if (opts->use_cache && !opts->untracked) {
+        load_scan_cache(&cache);
+        ctx.cache = &cache;
+    }
+
+    pthread_t *workers = malloc(jobs * sizeof(pthread_t));
+    int started = 0;
+    for (int i = 0; i < jobs; i++) {
+        if (pthread_create(&workers[started], NULL, repo_worker, &ctx) == 0) {
+            started++;
+        }
+    }
+
+    if (start_path) {
+        ExcludeSet excludes;
+        build_exclude_set(&excludes, opts);
+        ctx.queue.keep_paths = paths != NULL;
+        int64_t probe = probe_start(PHASE_WALK);
+        // The index only knows where the walk stopped at repos
+        int discovery = !opts->use_cache || opts->nested ? DISCOVERY_OFF
+                        : opts->rediscover               ? DISCOVERY_REFRESH
+                                                         : DISCOVERY_USE;
+        scan_directories(start_path, &ctx.queue, jobs, &excludes, opts->max_depth, &ctx.stop, discovery,
+                         opts->nested, opts->submodules);
+        probe_end(PHASE_WALK, probe);
+        free_exclude_set(&excludes);
+    } else {
+        for (int i = 0; i < paths->count; i++) {
+            push_repo_path(&ctx.queue, paths->paths[i]);
+        }
+    }
+    finish_repo_queue(&ctx.queue);
+
+    // No worker could be started; inspect everything on this thread
+    if (started == 0) {
+        repo_worker(&ctx);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    if (start_path && paths) {
+        // The queue kept every path; hand them over
+        paths->paths = ctx.queue.paths;
+        paths->count = ctx.queue.count;
+        ctx.queue.paths = NULL;
+        ctx.queue.count = 0;
+    }
+    free_repo_queue(&ctx.queue);
+    free_suspect_heap(&ctx.suspects);
+    pthread_mutex_destroy(&ctx.list_lock);
+    if (ctx.cache) {
+        save_scan_cache(ctx.cache);
+        free_scan_cache(ctx.cache);
+    }
+
+    if (opts->verify_remote) verify_remotes(list, opts);
+    sort_repo_list(list);
+}
+
+// Print one repo in the chosen format
+void print_repo(Renderer *r, const GitRepo *repo, int format) {
+    if (format == FORMAT_JSON) {
+        print_repo_json(r, repo);
+    } else if (format == FORMAT_NUL) {
+        print_repo_nul(r, repo);
+    } else {
+        print_repo_info(r, repo);
+    }
+}
+
+// Print the sorted list and the summary; repos that were streamed during
+// the scan aren't printed again
+void print_results(Renderer *r, const RepoList *list, const ScanTotals *totals, const Options *opts) {
+    int64_t probe = probe_start(PHASE_RENDER);
+    if (opts->format != FORMAT_BOX) {
+        for (int i = 0; !opts->stream && i < list->count; i++) {
+            print_repo(r, &list->repos[i], opts->format);
+        }
+        // Machine formats end with a summary record, even when nothing is dirty
+        if (opts->format == FORMAT_JSON) {
+            print_summary_json(r, totals->repos, totals->staged, totals->unstaged, totals->untracked);
+        } else {
+            print_summary_nul(r, totals->repos, totals->staged, totals->unstaged, totals->untracked);
+        }
+    } else if (totals->repos == 0) {
+        render_fmt(r, "\n%s%s✓ No uncommitted changes found in any git repository!%s\n\n", BOLD, GREEN, RESET);
+        flush_renderer(r);
+    } else {
+        if (!opts->stream) {
+            print_header(r);
+            for (int i = 0; i < list->count; i++) {
+                print_repo_info(r, &list->repos[i]);
+            }
+        }
+        print_summary(r, totals->repos, totals->staged, totals->unstaged, totals->untracked);
+    }
+    probe_end(PHASE_RENDER, probe);
+}
+
+// Whether two strings differ, either of them possibly NULL
+int strings_differ(const char *a, const char *b) {
+    if (!a || !b) return a != b;
+    return strcmp(a, b) != 0;
+}
+
+// Whether a rescan changed anything that would be printed
+int repos_differ(const GitRepo *a, const GitRepo *b) {
+    if (a->ahead != b->ahead || a->behind != b->behind || a->has_remote != b->has_remote ||
+        a->is_pushed != b->is_pushed || a->staged_count != b->staged_count ||
+        a->unstaged_count != b->unstaged_count || a->untracked_count != b->untracked_count ||
+        a->timed_out != b->timed_out || a->truncated != b->truncated ||
+        strings_differ(a->branch, b->branch) || strings_differ(a->remote_branch, b->remote_branch) ||
+        strings_differ(a->remote_url, b->remote_url)) {
+        return 1;
+    }
+
+    const ChangeList *ca = &a->changes, *cb = &b->changes;
+    if (ca->count != cb->count || memcmp(ca->flags, cb->flags, ca->count) != 0) return 1;
+    for (int i = 0; i < ca->count; i++) {
+        size_t dir_a, dir_b;
+        const char *da = change_dir(ca, i, &dir_a);
+        const char *db = change_dir(cb, i, &dir_b);
+        if (dir_a != dir_b || memcmp(da, db, dir_a) != 0 ||
+            strcmp(change_name(ca, i), change_name(cb, i)) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A repo that has nothing to report any more, for the machine formats
+void print_repo_clean(Renderer *r, const char *path, int format) {
+    if (format == FORMAT_JSON) {
+        render_str(r, "{\"type\":\"clean\",\"path\":");
+        render_json_str(r, path);
+        render_str(r, "}\n");
+    } else {
+        render_record(r, "clean", path);
+    }
+    flush_renderer(r);
+}
+
+// --watch: after the first scan, only the repos whose worktree or git
+// directory changed are inspected again. Linux uses inotify; elsewhere, or
+// once the watch limit runs out, every repo is pre-checked on a timer.
+#define WATCH_DEBOUNCE_MS 200    // quiet time that ends a burst of events
+#define WATCH_MAX_DELAY_MS 2000  // rescan at least this often during a long burst
+#define WATCH_POLL_MS 2000       // pre-check interval without inotify
+
+enum {
+    WATCH_WORKTREE,        // any change counts
+    WATCH_GIT_DIR,         // only the index, HEAD and packed-refs
+    WATCH_REFS,            // any ref but lock files
+};
+
+typedef struct {
+    int repo;              // index into the watched paths, -1 if unused
+    int kind;              // WATCH_*
+    char *path;
+} WatchDir;
+
+// inotify hands out small descriptors, so directories are indexed by them.
+// A directory shared by several repos, like the common git directory of
+// linked worktrees, is credited to the first one.
+typedef struct {
+    int fd;                // inotify descriptor, -1 when polling
+    WatchDir *dirs;
+    int dir_capacity;
+} Watcher;
+
+static int watch_stop;  // set by SIGINT and SIGTERM
+
+void handle_watch_signal(int sig) {
+    (void)sig;
+    __atomic_store_n(&watch_stop, 1, __ATOMIC_RELAXED);
+}
+
+// Whether an event on name in a directory of the given kind can change
+// what a repo reports
+int watch_event_matters(int kind, const char *name) {
+    size_t len = strlen(name);
+    if (kind == WATCH_GIT_DIR) {
+        return strcmp(name, "index") == 0 || strcmp(name, "HEAD") == 0 || strcmp(name, "packed-refs") == 0;
+    }
+    if (kind == WATCH_REFS) return len < 5 || strcmp(name + len - 5, ".lock") != 0;
+    return strcmp(name, ".git") != 0;
+}
+
+// Whether a subdirectory is left out of a worktree or refs watch: the git
+// directory and nested repos, which are watched on their own. The walk's
+// excludes don't apply; a repo's own build/ or vendor/ may be tracked.
+int watch_skips_dir(int kind, const char *path, const char *name) {
+    if (kind != WATCH_WORKTREE) return 0;
+    if (strcmp(name, ".git") == 0) return 1;
+    char git_path[PATH_MAX];
+    struct stat st;
+    return join_path(git_path, sizeof(git_path), path, ".git") == 0 && lstat(git_path, &st) == 0;
+}
+
+#ifdef __linux__
+// Watch a directory and, for worktrees and refs, everything below it.
+// Returns -1 once the kernel runs out of watches.
+int watch_dir(Watcher *w, int repo, int kind, const char *path) {
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO |
+                    IN_DELETE_SELF | IN_ONLYDIR;
+    int wd = inotify_add_watch(w->fd, path, mask);
+    if (wd < 0) return errno == ENOSPC || errno == ENOMEM ? -1 : 0;
+    if (wd >= w->dir_capacity) {
+        int capacity = w->dir_capacity ? w->dir_capacity : 64;
+        while (capacity <= wd) capacity *= 2;
+        w->dirs = realloc(w->dirs, capacity * sizeof(WatchDir));
+        if (!w->dirs) {
+            fprintf(stderr, "Failed to allocate memory for watches\n");
+            exit(1);
+        }
+        for (int i = w->dir_capacity; i < capacity; i++) {
+            w->dirs[i].repo = -1;
+            w->dirs[i].path = NULL;
+        }
+        w->dir_capacity = capacity;
+    }
+    // The same directory watched twice gets the same descriptor back
+    if (w->dirs[wd].path) return 0;
+    w->dirs[wd].repo = repo;
+    w->dirs[wd].kind = kind;
+    w->dirs[wd].path = strdup(path);
+    if (kind == WATCH_GIT_DIR) return 0;
 
+    DIR *dir = opendir(path);
+    if (!dir) return 0;
+    struct dirent *entry;
+    char child[PATH_MAX];
+    int status = 0;
+    while (status == 0 && (entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+        if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) continue;
+        if (join_path(child, sizeof(child), path, name) != 0) continue;
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(child, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+        }
+        if (watch_skips_dir(kind, child, name)) continue;
+        status = watch_dir(w, repo, kind, child);
+    }
     closedir(dir);
+    return status;
+}
+
+// Watch a repo's worktree, git directory and refs
+int watch_repo(Watcher *w, int repo, const char *path) {
+    char git_dir[PATH_MAX], common_dir[PATH_MAX], refs[PATH_MAX];
+    if (watch_dir(w, repo, WATCH_WORKTREE, path) != 0) return -1;
+    if (resolve_git_dirs(path, git_dir, common_dir, sizeof(git_dir)) != 0) return 0;
+    if (watch_dir(w, repo, WATCH_GIT_DIR, git_dir) != 0) return -1;
+    // packed-refs lives in the common directory of linked worktrees
+    if (strcmp(common_dir, git_dir) != 0 && watch_dir(w, repo, WATCH_GIT_DIR, common_dir) != 0) return -1;
+    if (join_path(refs, sizeof(refs), common_dir, "refs") != 0) return 0;
+    return watch_dir(w, repo, WATCH_REFS, refs);
 }
 
-void print_header(int width) {
-    printf("\n");
-    print_horizontal_line(width, TOP_LEFT, TOP_RIGHT);
-    printf("%s%s%s", CYAN, VERT, RESET);
+// Read the queued events, marking the repos they touch in dirty and
+// counting newly marked ones in *pending. Returns the number of events
+// that mattered, or -1 once the kernel runs out of watches.
+int read_watch_events(Watcher *w, char *dirty, int repo_count, int *pending) {
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int relevant = 0;
+    ssize_t n;
+    while ((n = read(w->fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
 
-    const char *title = "  GIT UNCOMMITTED CHANGES SCANNER  ";
-    int title_len = strlen(title);
-    int padding = (width - title_len - 2) / 2;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Events were lost; any repo may have changed
+                memset(dirty, 1, repo_count);
+                *pending = repo_count;
+                relevant++;
+                continue;
+            }
+            if (ev->wd < 0 || ev->wd >= w->dir_capacity || w->dirs[ev->wd].repo < 0) continue;
+            if (ev->mask & IN_IGNORED) {
+                free(w->dirs[ev->wd].path);
+                w->dirs[ev->wd].path = NULL;
+                w->dirs[ev->wd].repo = -1;
+                continue;
+            }
+
+            int repo = w->dirs[ev->wd].repo;
+            int kind = w->dirs[ev->wd].kind;
+            const char *name = ev->len ? ev->name : "";
+            if (!watch_event_matters(kind, name)) continue;
+
+            // New directories are watched too, unless left out like in the first pass
+            if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) && kind != WATCH_GIT_DIR) {
+                char child[PATH_MAX];
+                if (join_path(child, sizeof(child), w->dirs[ev->wd].path, name) == 0 &&
+                    !watch_skips_dir(kind, child, name) && watch_dir(w, repo, kind, child) < 0) {
+                    return -1;
+                }
+            }
+
+            relevant++;
+            if (!dirty[repo]) {
+                dirty[repo] = 1;
+                (*pending)++;
+            }
+        }
+    }
+    return relevant;
+}
+#endif
 
-    for (int i = 0; i < padding; i++) printf(" ");
-    printf("%s%s%s%s", BOLD, BG_BLUE, title, RESET);
-    for (int i = 0; i < width - title_len - padding - 2; i++) printf(" ");
-    printf("%s%s%s\n", CYAN, VERT, RESET);
+// When to rescan after a burst of events that started at first and was
+// last added to at last
+int64_t watch_due(int64_t first, int64_t last) {
+    int64_t quiet = last + (int64_t)WATCH_DEBOUNCE_MS * 1000000;
+    int64_t limit = first + (int64_t)WATCH_MAX_DELAY_MS * 1000000;
+    return quiet < limit ? quiet : limit;
+}
 
-    print_horizontal_line(width, BOT_LEFT, BOT_RIGHT);
-    printf("\n");
+void stop_watcher(Watcher *w) {
+    if (w->fd >= 0) close(w->fd);
+    w->fd = -1;
+    for (int i = 0; i < w->dir_capacity; i++) free(w->dirs[i].path);
+    free(w->dirs);
+    w->dirs = NULL;
+    w->dir_capacity = 0;
 }
 
-void print_summary(int total_repos, int total_staged, int total_unstaged, int total_untracked, int width) {
-    print_horizontal_line(width, TOP_LEFT, TOP_RIGHT);
+// Inspect the marked repos again and fold the results into list. Box
+// output is redrawn when anything changed; the machine formats get a
+// record per changed repo, "clean" for ones that no longer have changes,
+// and a new summary.
+//
+// A server prints nothing and folds the results in under list_lock.
+void rescan_watched(const RepoPaths *paths, char *dirty, RepoList *list, const Options *opts,
+                    Renderer *renderer, pthread_mutex_t *list_lock) {
+    RepoPaths batch;
+    batch.paths = malloc(paths->count * sizeof(char *));
+    batch.count = 0;
+    if (!batch.paths) {
+        fprintf(stderr, "Failed to allocate memory for repo paths\n");
+        exit(1);
+    }
+    for (int i = 0; i < paths->count; i++) {
+        if (dirty[i]) batch.paths[batch.count++] = paths->paths[i];
+        dirty[i] = 0;
+    }
 
-    char buffer[256];
-    snprintf(buffer, sizeof(buffer), "SUMMARY: %d repositories with uncommitted changes", total_repos);
-    print_centered(buffer, width);
+    RepoList fresh;
+    ScanTotals totals = {0};
+    init_repo_list(&fresh);
+    scan_repositories(NULL, &fresh, opts, &totals, renderer, &batch);
+    char *moved = calloc(fresh.count ? fresh.count : 1, 1);
+    if (!moved) {
+        fprintf(stderr, "Failed to allocate memory for repos\n");
+        exit(1);
+    }
+
+    int changed = 0;
+    int quiet = opts->command == COMMAND_SERVE;
+    if (list_lock) pthread_mutex_lock(list_lock);
+    for (int i = 0; i < batch.count; i++) {
+        int old = find_repo(list, batch.paths[i]);
+        int new = find_repo(&fresh, batch.paths[i]);
+        if (old < 0 && new < 0) continue;
+        if (old >= 0 && new >= 0 && !repos_differ(&list->repos[old], &fresh.repos[new])) continue;
+
+        changed++;
+        if (!quiet && opts->format != FORMAT_BOX) {
+            if (new >= 0) print_repo(renderer, &fresh.repos[new], opts->format);
+            else print_repo_clean(renderer, batch.paths[i], opts->format);
+        }
+        if (old >= 0) remove_repo(list, old);
+        if (new >= 0) {
+            // The list takes the repo over
+            add_repo(list, &fresh.repos[new]);
+            moved[new] = 1;
+        }
+    }
+    if (changed) sort_repo_list(list);
+    if (list_lock) pthread_mutex_unlock(list_lock);
+    free(batch.paths);
+
+    for (int i = 0; i < fresh.count; i++) {
+        if (!moved[i]) free_git_repo(&fresh.repos[i]);
+    }
+    free(fresh.repos);
+    free(moved);
+
+    if (changed && !quiet) {
+        sum_totals(list, &totals);
+        if (opts->format == FORMAT_BOX) printf("\033[H\033[2J");
+        Options shown = *opts;
+        shown.stream = opts->format != FORMAT_BOX;  // only the summary follows the deltas
+        print_results(renderer, list, &totals, &shown);
+        fflush(stdout);
+    }
+}
+
+// Keep list up to date until interrupted. list_lock, if given, is held
+// while the list changes.
+void watch_repositories(const RepoPaths *paths, RepoList *list, const Options *opts, Renderer *renderer,
+                        pthread_mutex_t *list_lock) {
+    Watcher w;
+    w.fd = -1;
+    w.dirs = NULL;
+    w.dir_capacity = 0;
+
+#ifdef __linux__
+    w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (int i = 0; w.fd >= 0 && i < paths->count; i++) {
+        if (watch_repo(&w, i, paths->paths[i]) != 0) {
+            fprintf(stderr, "uncommitted: out of inotify watches, polling instead\n");
+            stop_watcher(&w);
+        }
+    }
+#endif
+
+    char *dirty = calloc(paths->count ? paths->count : 1, 1);
+    if (!dirty) {
+        fprintf(stderr, "Failed to allocate memory for repo paths\n");
+        exit(1);
+    }
+
+    // Interrupting poll() ends the loop; the caller then cleans up as usual
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_watch_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int pending = 0;
+    int64_t first_event = 0, last_event = 0;
+    while (!__atomic_load_n(&watch_stop, __ATOMIC_RELAXED)) {
+        int timeout = w.fd < 0 ? WATCH_POLL_MS : -1;
+        if (w.fd >= 0 && pending) {
+            int64_t left = watch_due(first_event, last_event) - now_ns();
+            timeout = left > 0 ? (int)((left + 999999) / 1000000) : 0;
+        }
+
+        struct pollfd pfd = {w.fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeout);
+        if (__atomic_load_n(&watch_stop, __ATOMIC_RELAXED)) break;
+        if (ready < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        if (w.fd < 0) {
+            // Without events every repo is due; the pre-check keeps clean ones cheap
+            memset(dirty, 1, paths->count);
+            pending = paths->count;
+        }
+#ifdef __linux__
+        else if (ready > 0) {
+            int was_pending = pending;
+            int relevant = read_watch_events(&w, dirty, paths->count, &pending);
+            if (relevant < 0) {
+                fprintf(stderr, "uncommitted: out of inotify watches, polling instead\n");
+                stop_watcher(&w);
+            } else if (relevant > 0) {
+                int64_t now = now_ns();
+                if (!was_pending) first_event = now;
+                last_event = now;
+            }
+        }
+#endif
+
+        if (pending && (w.fd < 0 || now_ns() >= watch_due(first_event, last_event))) {
+            rescan_watched(paths, dirty, list, opts, renderer, list_lock);
+            pending = 0;
+        }
+    }
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    free(dirty);
+    stop_watcher(&w);
+}
+
+// `uncommitted serve` keeps the list fresh with the watch loop and answers
+// queries over a Unix socket. A query is one line, "<format> <files|counts>
+// <width> <max files> <absolute path>", and the answer is what a scan of
+// that path would print, ending with its summary.
+typedef struct {
+    int fd;                // listening socket
+    RepoList *list;
+    const RepoPaths *paths;  // every repo, clean ones included
+    pthread_mutex_t *list_lock;
+} Server;
+
+// Socket path: --socket, else $XDG_RUNTIME_DIR/uncommitted.sock, else
+// serve.sock in the cache directory
+int get_socket_path(const Options *opts, char *out, size_t size) {
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    int n;
+    if (opts->socket_path) {
+        n = snprintf(out, size, "%s", opts->socket_path);
+    } else if (runtime && runtime[0]) {
+        n = snprintf(out, size, "%s/uncommitted.sock", runtime);
+    } else {
+        char dir[PATH_MAX];
+        if (get_cache_dir(dir, sizeof(dir)) != 0) return -1;
+        n = snprintf(out, size, "%s/serve.sock", dir);
+    }
+    return n < 0 || (size_t)n >= size ? -1 : 0;
+}
+
+// Fill in a socket address; -1 if the path doesn't fit
+int make_socket_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) return -1;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// Whether path is dir or somewhere below it
+int path_within(const char *path, const char *dir) {
+    size_t len = strlen(dir);
+    if (len == 1 && dir[0] == '/') return path[0] == '/';
+    return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// The repos a query answers for: the innermost repo the path is inside of,
+// or else every repo at or below it. view gets shallow copies.
+void select_repos(const Server *server, const char *path, RepoList *view) {
+    const char *inside = NULL;
+    for (int i = 0; i < server->paths->count; i++) {
+        const char *repo = server->paths->paths[i];
+        if (strcmp(repo, path) != 0 && path_within(path, repo) &&
+            (!inside || strlen(repo) > strlen(inside))) {
+            inside = repo;
+        }
+    }
+
+    for (int i = 0; i < server->list->count; i++) {
+        const GitRepo *repo = &server->list->repos[i];
+        if (inside ? strcmp(repo->path, inside) == 0 : path_within(repo->path, path)) {
+            add_repo(view, repo);
+        }
+    }
+}
+
+// Answer one query on fd
+void serve_client(Server *server, int fd) {
+    char request[PATH_MAX + 64];
+    size_t len = 0;
+    while (len < sizeof(request) - 1) {
+        ssize_t n = read(fd, request + len, sizeof(request) - 1 - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+        if (memchr(request, '\n', len)) break;
+    }
+    request[len] = '\0';
+    char *end = strchr(request, '\n');
+    if (!end) return;
+    *end = '\0';
+
+    char *files = strchr(request, ' ');
+    char *layout = files ? strchr(files + 1, ' ') : NULL;
+    if (!layout) return;
+    *files++ = '\0';
+    *layout++ = '\0';
+    // The box is laid out for the client's terminal
+    char *end_width;
+    long width = strtol(layout, &end_width, 10);
+    char *end_files;
+    long max_files = strtol(end_width, &end_files, 10);
+    if (end_width == layout || end_files == end_width || *end_files != ' ' ||
+        width < MIN_WIDTH || width > 4096 || max_files < 0 || max_files > INT_MAX) {
+        return;
+    }
+    char *path = end_files + 1;
+
+    Options shown = {0};
+    if (strcmp(request, "json") == 0) shown.format = FORMAT_JSON;
+    else if (strcmp(request, "nul") == 0) shown.format = FORMAT_NUL;
+    else if (strcmp(request, "box") != 0) return;
+    shown.count_only = strcmp(files, "counts") == 0;
+
+    Renderer r;
+    init_renderer(&r, (int)width);
+    r.show_files = !shown.count_only;
+    r.max_files = (int)max_files;
+    r.fd = fd;
+
+    // Render under the lock but write after it, so a slow reader can't
+    // hold up rescans
+    RepoList view;
+    ScanTotals totals;
+    init_repo_list(&view);
+    r.hold = 1;
+    pthread_mutex_lock(server->list_lock);
+    select_repos(server, path, &view);
+    sum_totals(&view, &totals);
+    print_results(&r, &view, &totals, &shown);
+    pthread_mutex_unlock(server->list_lock);
+    r.hold = 0;
+    flush_renderer(&r);
+
+    free(view.repos);  // the repos still belong to the list
+    free_renderer(&r);
+}
+
+void *serve_thread(void *arg) {
+    Server *server = arg;
+    while (!__atomic_load_n(&watch_stop, __ATOMIC_RELAXED)) {
+        // Wake up now and then to notice the watch loop stopping
+        struct pollfd pfd = {server->fd, POLLIN, 0};
+        if (poll(&pfd, 1, 250) <= 0) continue;
+        int client = accept(server->fd, NULL, NULL);
+        if (client < 0) continue;
+        // A client that never sends its query mustn't hold up the others
+        struct timeval timeout = {1, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_client(server, client);
+        close(client);
+    }
+    return NULL;
+}
+
+// Bind the server socket, replacing a stale one. Returns the listening
+// descriptor, or -1 with a message.
+int listen_on_socket(const char *path) {
+    struct sockaddr_un addr;
+    if (make_socket_addr(path, &addr) != 0) {
+        fprintf(stderr, "uncommitted: socket path too long: %s\n", path);
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "uncommitted: a server is already running on %s\n", path);
+        close(fd);
+        return -1;
+    }
+    // Only a stale socket is replaced, never some other file
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "uncommitted: %s exists and isn't a socket\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        fprintf(stderr, "uncommitted: can't listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Scan start_path once, then keep answering queries until interrupted
+int run_server(const char *start_path, const Options *opts) {
+    char socket_path[PATH_MAX];
+    if (get_socket_path(opts, socket_path, sizeof(socket_path)) != 0) {
+        fprintf(stderr, "uncommitted: no socket path; pass --socket\n");
+        return 1;
+    }
+    int fd = listen_on_socket(socket_path);
+    if (fd < 0) return 1;
+
+    RepoList list;
+    RepoPaths paths = {NULL, 0};
+    ScanTotals totals = {0};
+    Renderer renderer;
+    pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+    init_repo_list(&list);
+    init_renderer(&renderer, opts->width);
+    renderer.show_files = !opts->count_only;
+    renderer.max_files = opts->max_files;
+    scan_repositories(start_path, &list, opts, &totals, &renderer, &paths);
+    fprintf(stderr, "uncommitted: serving %d repositories under %s on %s\n",
+            paths.count, start_path, socket_path);
+
+    Server server = {fd, &list, &paths, &list_lock};
+    pthread_t tid;
+    int started = pthread_create(&tid, NULL, serve_thread, &server) == 0;
+    if (!started) {
+        fprintf(stderr, "uncommitted: can't start the server thread\n");
+    } else {
+        watch_repositories(&paths, &list, opts, &renderer, &list_lock);
+        __atomic_store_n(&watch_stop, 1, __ATOMIC_RELAXED);
+        pthread_join(tid, NULL);
+    }
+
+    close(fd);
+    unlink(socket_path);
+    free_repo_paths(&paths);
+    free_repo_list(&list);
+    free_renderer(&renderer);
+    pthread_mutex_destroy(&list_lock);
+    return started ? 0 : 1;
+}
+
+// `uncommitted query`: ask a running server about path and print the
+// answer. -q and --any get the counts and settle the exit status from them.
+int run_query(const char *path, const Options *opts) {
+    char socket_path[PATH_MAX];
+    struct sockaddr_un addr;
+    if (get_socket_path(opts, socket_path, sizeof(socket_path)) != 0 ||
+        make_socket_addr(socket_path, &addr) != 0) {
+        fprintf(stderr, "uncommitted: no socket path; pass --socket\n");
+        return 1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "uncommitted: no server on %s; start one with `uncommitted serve`\n", socket_path);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    int early_exit = opts->quiet || opts->any;
+    static const char *const format_names[] = {"box", "json", "nul"};
+    char request[PATH_MAX + 64];
+    int len = snprintf(request, sizeof(request), "%s %s %d %d %s\n",
+                       early_exit ? "nul" : format_names[opts->format],
+                       opts->count_only ? "counts" : "files", opts->width, opts->max_files, path);
+    if (len < 0 || (size_t)len >= sizeof(request) || write(fd, request, len) != len) {
+        close(fd);
+        return 1;
+    }
+
+    Buffer answer;
+    init_buffer(&answer);
+    for (;;) {
+        buffer_reserve(&answer, 65536);
+        ssize_t n = read(fd, answer.data + answer.len, answer.cap - answer.len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        answer.len += n;
+        if (!early_exit) {
+            fwrite(answer.data, 1, answer.len, stdout);
+            answer.len = 0;
+        }
+    }
+    close(fd);
+
+    // The NUL records start with "repo <path>" and end with "summary <repos> ..."
+    int status = 0;
+    for (size_t off = 0; early_exit && off < answer.len;) {
+        const char *rec = answer.data + off;
+        size_t rec_len = strnlen(rec, answer.len - off);
+        off += rec_len + 1;
+        if (rec_len > 5 && strncmp(rec, "repo ", 5) == 0) {
+            status = EXIT_DIRTY;
+            if (opts->any) printf("%.*s\n", (int)(rec_len - 5), rec + 5);
+            break;
+        }
+    }
+    free_buffer(&answer);
+    return status;
+}
+
+double elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+// One key=value line on stderr, easy to pick apart from scripts
+void print_stats(const struct timespec *start_time) {
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    fprintf(stderr, "stats wall_ms=%.3f spawns=%lu maxrss_kb=%ld child_maxrss_kb=%ld "
+            "user_ms=%.3f sys_ms=%.3f\n",
+            elapsed_ms(start_time), __atomic_load_n(&git_spawns, __ATOMIC_RELAXED),
+            self.ru_maxrss, children.ru_maxrss,
+            (self.ru_utime.tv_sec + children.ru_utime.tv_sec) * 1e3 +
+                (self.ru_utime.tv_usec + children.ru_utime.tv_usec) / 1e3,
+            (self.ru_stime.tv_sec + children.ru_stime.tv_sec) * 1e3 +
+                (self.ru_stime.tv_usec + children.ru_stime.tv_usec) / 1e3);
+}
+
+int compare_repo_profiles(const void *a, const void *b) {
+    const RepoProfile *x = *(RepoProfile *const *)a;
+    const RepoProfile *y = *(RepoProfile *const *)b;
+    if (x->total_ns != y->total_ns) return x->total_ns < y->total_ns ? 1 : -1;
+    return strcmp(x->path, y->path);
+}
+
+// How many repos ran git status, and how many of those had an untracked
+// cache or an fsmonitor token in their index to speed it up
+void count_status_caches(int *ran, int *untracked_cache, int *fsmonitor) {
+    for (int i = 0; i < profile->count; i++) {
+        const RepoProfile *rp = profile->repos[i];
+        if (!rp->ran_status) continue;
+        (*ran)++;
+        if (rp->index_ext & INDEX_EXT_UNTR) (*untracked_cache)++;
+        if (rp->index_ext & INDEX_EXT_FSMN) (*fsmonitor)++;
+    }
+}
+
+// Phase totals and the slowest repos, on stderr. Phase times are summed
+// over all threads, except the walk, which is wall time.
+void print_profile(const Options *opts, double wall_ms) {
+    qsort(profile->repos, profile->count, sizeof(RepoProfile *), compare_repo_profiles);
+    int top = profile->count < opts->profile_top ? profile->count : opts->profile_top;
 
-    print_horizontal_line(width, T_RIGHT, T_LEFT);
+    if (opts->profile == PROFILE_JSON) {
+        Renderer r;
+        init_renderer(&r, 0);
+        render_fmt(&r, "{\"wall_ms\":%.3f,\"repos\":%d,\"phases\":{", wall_ms, profile->count);
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            render_fmt(&r, "%s\"%s\":{\"ms\":%.3f,\"spawns\":%lu}", i ? "," : "", phase_names[i],
+                       profile->ns[i] / 1e6, profile->spawns[i]);
+        }
+        int ran = 0, untr = 0, fsmn = 0;
+        count_status_caches(&ran, &untr, &fsmn);
+        render_fmt(&r, "},\"status_repos\":%d,\"untracked_cache_repos\":%d,\"fsmonitor_repos\":%d", ran, untr, fsmn);
+        render_str(&r, ",\"slowest\":[");
+        for (int i = 0; i < top; i++) {
+            const RepoProfile *rp = profile->repos[i];
+            render_str(&r, i ? ",{\"path\":" : "{\"path\":");
+            render_json_str(&r, rp->path);
+            render_fmt(&r, ",\"ms\":%.3f", rp->total_ns / 1e6);
+            if (rp->ran_status) {
+                render_fmt(&r, ",\"untracked_cache\":%s,\"fsmonitor\":%s",
+                           rp->index_ext & INDEX_EXT_UNTR ? "true" : "false",
+                           rp->index_ext & INDEX_EXT_FSMN ? "true" : "false");
+            }
+            for (int j = 0; j < PHASE_COUNT; j++) {
+                if (rp->ns[j] || rp->spawns[j]) {
+                    render_fmt(&r, ",\"%s_ms\":%.3f,\"%s_spawns\":%u", phase_names[j], rp->ns[j] / 1e6,
+                               phase_names[j], rp->spawns[j]);
+                }
+            }
+            render_str(&r, "}");
+        }
+        render_str(&r, "]}\n");
+        fwrite(r.out.data, 1, r.out.len, stderr);
+        free_renderer(&r);
+        return;
+    }
 
-    printf("%s%s%s  %s%d%s staged  |  %s%d%s modified  |  %s%d%s untracked",
-           CYAN, VERT, RESET,
-           GREEN, total_staged, RESET,
-           YELLOW, total_unstaged, RESET,
-           MAGENTA, total_untracked, RESET);
+    fprintf(stderr, "\nprofile: %d repositories in %.1f ms\n", profile->count, wall_ms);
+    fprintf(stderr, "  %-10s %10s %8s\n", "phase", "ms", "spawns");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        fprintf(stderr, "  %-10s %10.1f %8lu\n", phase_names[i], profile->ns[i] / 1e6, profile->spawns[i]);
+    }
+    int ran = 0, untr = 0, fsmn = 0;
+    count_status_caches(&ran, &untr, &fsmn);
+    fprintf(stderr, "\ngit status ran in %d repositories: %d with an untracked cache, %d with fsmonitor\n",
+            ran, untr, fsmn);
+    if (top > 0) {
+        fprintf(stderr, "\nslowest repositories:\n");
+        fprintf(stderr, "  %10s %8s  %-9s  %s\n", "ms", "spawns", "caches", "path");
+    }
+    for (int i = 0; i < top; i++) {
+        const RepoProfile *rp = profile->repos[i];
+        unsigned spawns = 0;
+        for (int j = 0; j < PHASE_COUNT; j++) spawns += rp->spawns[j];
+        const char *caches = "";
+        if (rp->ran_status) {
+            static const char *const names[] = {"-", "untr", "fsmn", "untr,fsmn"};
+            caches = names[rp->index_ext & (INDEX_EXT_UNTR | INDEX_EXT_FSMN)];
+        }
+        fprintf(stderr, "  %10.1f %8u  %-9s  %s\n", rp->total_ns / 1e6, spawns, caches, rp->path);
+    }
+}
 
-    int len = 50;
-    for (int i = len; i < width - 2; i++) printf(" ");
-    printf("%s%s%s\n", CYAN, VERT, RESET);
+void free_profile(void) {
+    for (int i = 0; i < profile->count; i++) {
+        free(profile->repos[i]->path);
+        free(profile->repos[i]);
+    }
+    free(profile->repos);
+    pthread_mutex_destroy(&profile->lock);
+    profile = NULL;
+}
 
-    print_horizontal_line(width, BOT_LEFT, BOT_RIGHT);
-    printf("\n");
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [options] [directory]\n", prog);
+    fprintf(stderr, "       %s serve [options] [directory]\n", prog);
+    fprintf(stderr, "       %s query [options] [path]\n", prog);
+    fprintf(stderr,
+            "  -j, --jobs N             inspect N repositories in parallel (default: CPUs)\n"
+            "      --max-depth N        descend at most N directories below the start\n"
+            "      --exclude GLOB       skip directories whose name matches GLOB (repeatable)\n"
+            "      --no-default-excludes\n"
+            "                           also walk node_modules, target, build, vendor,\n"
+            "                           venv and __pycache__\n"
+            "      --nested             also look for repositories inside repositories,\n"
+            "                           skipping what their .gitignore excludes\n"
+            "      --submodules         also inspect the submodules and linked worktrees\n"
+            "                           of every repository found\n"
+            "      --stream             print each repository as soon as it's inspected\n"
+            "                           (unsorted)\n"
+            "      --format FORMAT      box (default), json (one object per line) or\n"
+            "                           nul (NUL-terminated records); json and nul stream\n"
+            "      --summary            show change counts without listing files\n"
+            "  -q, --quiet              print nothing; exit with status 2 as soon as a\n"
+            "                           repository with changes is found\n"
+            "      --any                like --quiet, but print the repository found\n"
+            "      --untracked-files MODE\n"
+            "                           no, normal or all, passed on to git status\n"
+            "      --backend BACKEND    cli (default) runs git; libgit2 reads repositories\n"
+            "                           in-process, if built with make WITH_LIBGIT2=1\n"
+            "      --untracked-cache    let git status keep and use an untracked cache\n"
+            "      --fsmonitor[=HOOK]   let git status ask a file system monitor what\n"
+            "                           changed: HOOK, or the repository's\n"
+            "                           fsmonitor-watchman hook or git's daemon\n"
+            "      --repo-timeout MS    give git at most MS milliseconds per repository\n"
+            "                           (libgit2 can't be interrupted)\n"
+            "      --max-entries N      read at most N status entries per repository\n"
+            "                           (libgit2 still builds the full list, then cuts it)\n"
+            "      --max-files N        list at most N files per repository, then how\n"
+            "                           many more there are\n"
+            "      --verify-remote      ask origin with git ls-remote whether branches\n"
+            "                           are pushed, instead of trusting the last fetch\n"
+            "      --remote-ttl SECONDS reuse those answers for this long (default: 300)\n"
+            "      --remote-jobs N      run at most N ls-remote at a time (default: 8)\n"
+            "      --watch              keep running, and rescan repositories as they\n"
+            "                           change; json and nul print deltas\n"
+            "      --socket PATH        server socket for serve and query\n"
+            "                           (default: $XDG_RUNTIME_DIR/uncommitted.sock)\n"
+            "      --no-cache           don't read or update the scan cache or the\n"
+            "                           discovery index\n"
+            "      --rediscover         read every directory again instead of skipping\n"
+            "                           the ones unchanged since the last run\n"
+            "      --stats              print wall time, git processes and peak memory\n"
+            "                           to stderr\n"
+            "      --profile[=json]     print time and git processes per phase and the\n"
+            "                           slowest repositories to stderr\n"
+            "      --profile-top N      how many slow repositories to list (default: 10)\n"
+            "  -h, --help               show this help\n");
 }
 
+// Long-only options
+enum {
+    OPT_NO_CACHE = 256,
+    OPT_REDISCOVER,
+    OPT_NESTED,
+    OPT_SUBMODULES,
+    OPT_MAX_DEPTH,
+    OPT_EXCLUDE,
+    OPT_NO_DEFAULT_EXCLUDES,
+    OPT_STREAM,
+    OPT_FORMAT,
+    OPT_SUMMARY,
+    OPT_UNTRACKED_FILES,
+    OPT_ANY,
+    OPT_STATS,
+    OPT_PROFILE,
+    OPT_PROFILE_TOP,
+    OPT_REPO_TIMEOUT,
+    OPT_MAX_ENTRIES,
+    OPT_MAX_FILES,
+    OPT_WATCH,
+    OPT_SOCKET,
+    OPT_UNTRACKED_CACHE,
+    OPT_FSMONITOR,
+    OPT_BACKEND,
+    OPT_VERIFY_REMOTE,
+    OPT_REMOTE_TTL,
+    OPT_REMOTE_JOBS,
+};
+
 int main(int argc, char *argv[]) {
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
     char *start_path = NULL;
-    int box_width = 80;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    Options opts = {0};
+    opts.use_cache = 1;
+    opts.max_depth = -1;
+    opts.default_excludes = 1;
+    opts.width = DEFAULT_WIDTH;
+    opts.profile_top = 10;
+    opts.remote_ttl = REMOTE_TTL_DEFAULT;
+    opts.remote_jobs = REMOTE_JOBS_DEFAULT;
+    int opt;
+
+    // Subcommands come first; options follow them
+    if (argc > 1 && strcmp(argv[1], "serve") == 0) opts.command = COMMAND_SERVE;
+    else if (argc > 1 && strcmp(argv[1], "query") == 0) opts.command = COMMAND_QUERY;
+    if (opts.command != COMMAND_SCAN) optind = 2;
+
+    static const struct option long_options[] = {
+        {"jobs", required_argument, NULL, 'j'},
+        {"no-cache", no_argument, NULL, OPT_NO_CACHE},
+        {"rediscover", no_argument, NULL, OPT_REDISCOVER},
+        {"nested", no_argument, NULL, OPT_NESTED},
+        {"submodules", no_argument, NULL, OPT_SUBMODULES},
+        {"max-depth", required_argument, NULL, OPT_MAX_DEPTH},
+        {"exclude", required_argument, NULL, OPT_EXCLUDE},
+        {"no-default-excludes", no_argument, NULL, OPT_NO_DEFAULT_EXCLUDES},
+        {"stream", no_argument, NULL, OPT_STREAM},
+        {"format", required_argument, NULL, OPT_FORMAT},
+        {"summary", no_argument, NULL, OPT_SUMMARY},
+        {"quiet", no_argument, NULL, 'q'},
+        {"any", no_argument, NULL, OPT_ANY},
+        {"stats", no_argument, NULL, OPT_STATS},
+        {"watch", no_argument, NULL, OPT_WATCH},
+        {"socket", required_argument, NULL, OPT_SOCKET},
+        {"profile", optional_argument, NULL, OPT_PROFILE},
+        {"profile-top", required_argument, NULL, OPT_PROFILE_TOP},
+        {"repo-timeout", required_argument, NULL, OPT_REPO_TIMEOUT},
+        {"max-entries", required_argument, NULL, OPT_MAX_ENTRIES},
+        {"max-files", required_argument, NULL, OPT_MAX_FILES},
+        {"untracked-files", required_argument, NULL, OPT_UNTRACKED_FILES},
+        {"untracked-cache", no_argument, NULL, OPT_UNTRACKED_CACHE},
+        {"fsmonitor", optional_argument, NULL, OPT_FSMONITOR},
+        {"backend", required_argument, NULL, OPT_BACKEND},
+        {"verify-remote", no_argument, NULL, OPT_VERIFY_REMOTE},
+        {"remote-ttl", required_argument, NULL, OPT_REMOTE_TTL},
+        {"remote-jobs", required_argument, NULL, OPT_REMOTE_JOBS},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    while ((opt = getopt_long(argc, argv, "j:qh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'j': {
+                char *end;
+                jobs = strtol(optarg, &end, 10);
+                if (*end != '\0' || jobs < 1) {
+                    fprintf(stderr, "%s: invalid job count '%s'\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
+            }
+            case OPT_NO_CACHE:
+                opts.use_cache = 0;
+                break;
+            case OPT_REDISCOVER:
+                opts.rediscover = 1;
+                break;
+            case OPT_NESTED:
+                opts.nested = 1;
+                break;
+            case OPT_SUBMODULES:
+                opts.submodules = 1;
+                break;
+            case OPT_MAX_DEPTH: {
+                char *end;
+                long depth = strtol(optarg, &end, 10);
+                if (*end != '\0' || depth < 0 || depth > INT_MAX) {
+                    fprintf(stderr, "%s: invalid depth '%s'\n", argv[0], optarg);
+                    return 1;
+                }
+                opts.max_depth = (int)depth;
+                break;
+            }
+            case OPT_EXCLUDE:
+                opts.excludes = realloc(opts.excludes, (opts.exclude_count + 1) * sizeof(char *));
+                if (!opts.excludes) {
+                    fprintf(stderr, "Failed to allocate memory for exclude patterns\n");
+                    exit(1);
+                }
+                opts.excludes[opts.exclude_count++] = optarg;
+                break;
+            case OPT_NO_DEFAULT_EXCLUDES:
+                opts.default_excludes = 0;
+                break;
+            case OPT_STREAM:
+                opts.stream = 1;
+                break;
+            case OPT_FORMAT:
+                if (strcmp(optarg, "box") == 0) {
+                    opts.format = FORMAT_BOX;
+                } else if (strcmp(optarg, "json") == 0) {
+                    opts.format = FORMAT_JSON;
+                } else if (strcmp(optarg, "nul") == 0) {
+                    opts.format = FORMAT_NUL;
+                } else {
+                    fprintf(stderr, "%s: unknown format '%s'\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case OPT_SUMMARY:
+                opts.count_only = 1;
+                break;
+            case 'q':
+                opts.quiet = 1;
+                opts.count_only = 1;
+                break;
+            case OPT_ANY:
+                opts.any = 1;
+                opts.count_only = 1;
+                break;
+            case OPT_STATS:
+                opts.stats = 1;
+                break;
+            case OPT_WATCH:
+                opts.watch = 1;
+                break;
+            case OPT_SOCKET:
+                opts.socket_path = optarg;
+                break;
+            case OPT_UNTRACKED_CACHE:
+                opts.untracked_cache = 1;
+                break;
+            case OPT_FSMONITOR:
+                opts.fsmonitor = optarg ? optarg : "";
+                break;
+            case OPT_BACKEND:
+                if (strcmp(optarg, "cli") == 0) {
+                    opts.backend = BACKEND_CLI;
+                } else if (strcmp(optarg, "libgit2") == 0) {
+#ifdef WITH_LIBGIT2
+                    opts.backend = BACKEND_LIBGIT2;
+#else
+                    fprintf(stderr, "%s: built without libgit2; rebuild with make WITH_LIBGIT2=1\n", argv[0]);
+                    return 1;
+#endif
+                } else {
+                    fprintf(stderr, "%s: unknown backend '%s'\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case OPT_PROFILE:
+                if (!optarg || strcmp(optarg, "text") == 0) {
+                    opts.profile = PROFILE_TEXT;
+                } else if (strcmp(optarg, "json") == 0) {
+                    opts.profile = PROFILE_JSON;
+                } else {
+                    fprintf(stderr, "%s: unknown profile format '%s'\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case OPT_REPO_TIMEOUT:
+            case OPT_MAX_ENTRIES:
+            case OPT_MAX_FILES: {
+                char *end;
+                long limit = strtol(optarg, &end, 10);
+                if (*end != '\0' || limit < 0 || limit > INT_MAX) {
+                    fprintf(stderr, "%s: invalid limit '%s'\n", argv[0], optarg);
+                    return 1;
+                }
+                if (opt == OPT_REPO_TIMEOUT) opts.repo_timeout_ms = (int)limit;
+                else if (opt == OPT_MAX_ENTRIES) opts.max_entries = (int)limit;
+                else opts.max_files = (int)limit;
+                break;
+            }
+            case OPT_VERIFY_REMOTE:
+                opts.verify_remote = 1;
+                break;
+            case OPT_REMOTE_TTL:
+            case OPT_REMOTE_JOBS: {
+                char *end;
+                long value = strtol(optarg, &end, 10);
+                if (*end != '\0' || value < (opt == OPT_REMOTE_JOBS) || value > INT_MAX) {
+                    fprintf(stderr, "%s: invalid %s '%s'\n", argv[0],
+                            opt == OPT_REMOTE_TTL ? "time" : "count", optarg);
+                    return 1;
+                }
+                if (opt == OPT_REMOTE_TTL) opts.remote_ttl = (int)value;
+                else opts.remote_jobs = (int)value;
+                break;
+            }
+            case OPT_PROFILE_TOP: {
+                char *end;
+                long top = strtol(optarg, &end, 10);
+                if (*end != '\0' || top < 0 || top > INT_MAX) {
+                    fprintf(stderr, "%s: invalid count '%s'\n", argv[0], optarg);
+                    return 1;
+                }
+                opts.profile_top = (int)top;
+                break;
+            }
+            case OPT_UNTRACKED_FILES:
+                if (strcmp(optarg, "no") != 0 && strcmp(optarg, "normal") != 0 &&
+                    strcmp(optarg, "all") != 0) {
+                    fprintf(stderr, "%s: invalid untracked-files mode '%s'\n", argv[0], optarg);
+                    return 1;
+                }
+                opts.untracked = optarg;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+    if (jobs < 1) jobs = 1;
+    opts.jobs = (int)jobs;
+    if (opts.command == COMMAND_SERVE) opts.watch = 1;
+    if (opts.watch && (opts.quiet || opts.any) && opts.command != COMMAND_QUERY) {
+        fprintf(stderr, "%s: --watch can't be combined with --quiet or --any\n", argv[0]);
+        return 1;
+    }
+    // --watch keeps the whole list so it can print deltas against it
+    if (opts.watch) opts.stream = 0;
+    else if (opts.format != FORMAT_BOX) opts.stream = 1;
+    // Pushed states are only known once the scan is over
+    if (opts.verify_remote) opts.stream = 0;
 
-    if (argc > 1) {
-        start_path = strdup(argv[1]);
+    // Boxes fill the terminal, asked once; pipes get the default width
+    struct winsize ws;
+    if (isatty(STDOUT_FILENO) && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) {
+        opts.width = ws.ws_col < MIN_WIDTH ? MIN_WIDTH : ws.ws_col;
+    }
+
+    if (optind < argc) {
+        start_path = strdup(argv[optind]);
     } else {
         start_path = getcwd(NULL, 0);  // POSIX extension: allocates buffer automatically
         if (!start_path) {
@@ -569,35 +6968,100 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    printf("%sScanning for git repositories with uncommitted changes...%s\n", YELLOW, RESET);
+    if (opts.command == COMMAND_QUERY || opts.command == COMMAND_SERVE) {
+        // Server and client agree on absolute paths
+        char *absolute = realpath(start_path, NULL);
+        if (!absolute) {
+            fprintf(stderr, "%s: %s: %s\n", argv[0], start_path, strerror(errno));
+            free(start_path);
+            return 1;
+        }
+        free(start_path);
+        start_path = absolute;
+    }
+    if (opts.command == COMMAND_QUERY) {
+        int query_status = run_query(start_path, &opts);
+        free(start_path);
+        free(opts.excludes);
+        return query_status;
+    }
+
+    static Profile profile_data;
+    if (opts.profile) {
+        pthread_mutex_init(&profile_data.lock, NULL);
+        profile = &profile_data;
+    }
 
-    RepoList list;
-    init_repo_list(&list);
+    // A git child exiting early must not kill us through a broken pipe
+    signal(SIGPIPE, SIG_IGN);
 
-    scan_directories(start_path, &list);
+#ifdef WITH_LIBGIT2
+    if (opts.backend == BACKEND_LIBGIT2) git_libgit2_init();
+#endif
 
-    if (list.count == 0) {
-        printf("\n%s%s✓ No uncommitted changes found in any git repository!%s\n\n", BOLD, GREEN, RESET);
+    // git status mustn't rewrite the index during a watch; the write would
+    // come back as another change
+    if (opts.watch) setenv("GIT_OPTIONAL_LOCKS", "0", 1);
+
+    // ls-remote runs unattended; a remote wanting a password counts as
+    // unreachable
+    if (opts.verify_remote) setenv("GIT_TERMINAL_PROMPT", "0", 1);
+
+    if (opts.command == COMMAND_SERVE) {
+        int serve_status = run_server(start_path, &opts);
+        if (opts.stats) print_stats(&start_time);
+        if (profile) {
+            print_profile(&opts, elapsed_ms(&start_time));
+            free_profile();
+        }
         free(start_path);
-        free_repo_list(&list);
-        return 0;
+        free(opts.excludes);
+#ifdef WITH_LIBGIT2
+        if (opts.backend == BACKEND_LIBGIT2) git_libgit2_shutdown();
+#endif
+        return serve_status;
     }
 
-    print_header(box_width);
+    if (opts.format == FORMAT_BOX && !opts.quiet && !opts.any) {
+        printf("%sScanning for git repositories with uncommitted changes...%s\n", YELLOW, RESET);
+    }
+
+    RepoList list;
+    init_repo_list(&list);
 
-    int total_staged = 0, total_unstaged = 0, total_untracked = 0;
+    ScanTotals totals = {0};
+    Renderer renderer;
+    init_renderer(&renderer, opts.width);
+    renderer.show_files = !opts.count_only;
+    renderer.max_files = opts.max_files;
+    RepoPaths watched = {NULL, 0};
+    scan_repositories(start_path, &list, &opts, &totals, &renderer, opts.watch ? &watched : NULL);
 
-    for (int i = 0; i < list.count; i++) {
-        print_repo_info(&list.repos[i], box_width);
-        total_staged += list.repos[i].staged_count;
-        total_unstaged += list.repos[i].unstaged_count;
-        total_untracked += list.repos[i].untracked_count;
+    int status = 0;
+    if (opts.quiet || opts.any) {
+        status = totals.repos > 0 ? EXIT_DIRTY : 0;
+    } else {
+        print_results(&renderer, &list, &totals, &opts);
     }
 
-    print_summary(list.count, total_staged, total_unstaged, total_untracked, box_width);
+    fflush(stdout);
+    if (opts.watch) {
+        watch_repositories(&watched, &list, &opts, &renderer, NULL);
+        free_repo_paths(&watched);
+    }
+    if (opts.stats) print_stats(&start_time);
+    if (profile) {
+        print_profile(&opts, elapsed_ms(&start_time));
+        free_profile();
+    }
 
     free(start_path);
+    free(opts.excludes);
     free_repo_list(&list);
+    free_renderer(&renderer);
+#ifdef WITH_LIBGIT2
+    if (opts.backend == BACKEND_LIBGIT2) git_libgit2_shutdown();
+#endif
 
-    return 0;
+    return status;
 }